@@ -27,6 +27,10 @@
 
 /* PostgreSQL extension module (using Lua) */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* fopencookie() */
+#endif
+
 #ifdef __APPLE__
 #include <libkern/OSByteOrder.h>
 #define htobe64(x) OSSwapHostToBigInt64(x)
@@ -35,9 +39,23 @@
 #elif __linux__
 #include <endian.h>
 #endif
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libpq-fe.h>
 #include <libpq/libpq-fs.h>
@@ -49,6 +67,8 @@
 
 #include "luapgsql.h"
 
+static void types_invalidate(lua_State *, int);
+
 /*
  * Garbage collected memory
  */
@@ -96,6 +116,54 @@ pgsql_conn_new(lua_State *L) {
 	return data;
 }
 
+/* Wait for events on a socket, returns the events, 0 on timeout or -1 */
+static int
+wait_socket(int fd, int events, int timeout)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	do
+		r = poll(&pfd, 1, timeout);
+	while (r == -1 && errno == EINTR);
+	return r == -1 ? -1 : pfd.revents;
+}
+
+/* Milliseconds on a monotonic clock, used for deadlines */
+static int64_t
+clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Microseconds on a monotonic clock */
+static int64_t
+clock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Milliseconds left until deadline, -1 (infinite) if there is none */
+static int
+time_left(int64_t deadline)
+{
+	int64_t now;
+
+	if (deadline < 0)
+		return -1;
+	now = clock_ms();
+	return now >= deadline ? 0 : (int)(deadline - now);
+}
+
 /*
  * Database Connection Control Functions
  */
@@ -129,16 +197,120 @@ pgsql_connectStart(lua_State *L)
 	return 1;
 }
 
+/*
+ * pgsql.connectMany(conninfo, n [, timeout]) opens n connections
+ * concurrently, driving all of them from a single poll loop.  Returns a
+ * table with the established connections and a table with the error
+ * messages of the connections that failed or were not established within
+ * timeout milliseconds.
+ */
+static int
+pgsql_connectMany(lua_State *L)
+{
+	PGconn ***data;
+	PostgresPollingStatusType *status;
+	struct pollfd *pfd;
+	const char *cstr, *why;
+	lua_Integer n, timeout;
+	int64_t deadline;
+	int i, k, nfds, conns, *map;
+
+	cstr = luaL_checkstring(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n > 0 && n <= 65535, 2,
+	    "invalid number of connections");
+	timeout = luaL_optinteger(L, 3, -1);
+	deadline = timeout < 0 ? -1 : clock_ms() + timeout;
+
+	data = lua_newuserdata(L, n * sizeof(PGconn **));
+	status = lua_newuserdata(L, n * sizeof(PostgresPollingStatusType));
+	pfd = lua_newuserdata(L, n * sizeof(struct pollfd));
+	map = lua_newuserdata(L, n * sizeof(int));
+	lua_createtable(L, n, 0);
+	conns = lua_gettop(L);
+
+	for (i = 0; i < n; i++) {
+		data[i] = pgsql_conn_new(L);
+		lua_rawseti(L, conns, i + 1);
+		*data[i] = PQconnectStart(cstr);
+		if (*data[i] == NULL || PQstatus(*data[i]) == CONNECTION_BAD)
+			status[i] = PGRES_POLLING_FAILED;
+		else
+			status[i] = PGRES_POLLING_WRITING;
+	}
+
+	why = "timeout";
+	for (;;) {
+		for (i = nfds = 0; i < n; i++) {
+			if (status[i] != PGRES_POLLING_READING &&
+			    status[i] != PGRES_POLLING_WRITING)
+				continue;
+			pfd[nfds].fd = PQsocket(*data[i]);
+			pfd[nfds].events = status[i] == PGRES_POLLING_READING ?
+			    POLLIN : POLLOUT;
+			pfd[nfds].revents = 0;
+			map[nfds++] = i;
+		}
+		if (nfds == 0 || (k = time_left(deadline)) == 0)
+			break;
+		if ((k = poll(pfd, nfds, k)) == -1) {
+			if (errno == EINTR)
+				continue;
+			why = strerror(errno);
+			break;
+		}
+		for (k = 0; k < nfds; k++)
+			if (pfd[k].revents)
+				status[map[k]] = PQconnectPoll(*data[map[k]]);
+	}
+
+	lua_newtable(L);
+	lua_newtable(L);
+	for (i = 0; i < n; i++) {
+		if (status[i] == PGRES_POLLING_OK) {
+			lua_rawgeti(L, conns, i + 1);
+			lua_rawseti(L, -3, lua_rawlen(L, -3) + 1);
+			continue;
+		}
+		if (*data[i] == NULL)
+			lua_pushliteral(L, "out of memory");
+		else if (status[i] == PGRES_POLLING_FAILED)
+			lua_pushstring(L, PQerrorMessage(*data[i]));
+		else
+			lua_pushstring(L, why);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		PQfinish(*data[i]);
+		*data[i] = NULL;
+	}
+	return 2;
+}
+
 static PGconn *
 pgsql_conn(lua_State *L, int n)
 {
 	PGconn **data;
 
 	data = luaL_checkudata(L, n, CONN_METATABLE);
-	luaL_argcheck(L, *data != NULL, n, "database connection is finished");
+	if (*data == NULL) {
+		lua_getuservalue(L, n);
+		luaL_argcheck(L, lua_getfield(L, -1, "busy") == LUA_TNIL, n,
+		    "database connection is busy");
+		luaL_argerror(L, n, "database connection is finished");
+	}
 	return *data;
 }
 
+/*
+ * Results keep a reference to the connection they were obtained from, in
+ * order to use the connection's type catalogue.
+ */
+static void
+res_setconn(lua_State *L, int conn)
+{
+	lua_pushvalue(L, conn);
+	lua_setuservalue(L, -2);
+}
+
 static int
 pgsql_connectPoll(lua_State *L)
 {
@@ -203,6 +375,9 @@ pgsql_initOpenSSL(lua_State *L)
 	return 0;
 }
 
+static void notice_release(lua_State *, int);
+static void trace_release(lua_State *, int);
+
 static int
 conn_finish(lua_State *L)
 {
@@ -240,6 +415,10 @@ conn_finish(lua_State *L)
 			lua_getuservalue(L, 1);
 			lua_pushnil(L);
 			lua_setfield(L, -2, "trace_file");
+			lua_pushnil(L);
+			lua_setfield(L, -2, "types");
+			notice_release(L, lua_gettop(L));
+			trace_release(L, lua_gettop(L));
 		}
 	}
 	return 0;
@@ -249,6 +428,7 @@ static int
 conn_reset(lua_State *L)
 {
 	PQreset(pgsql_conn(L, 1));
+	types_invalidate(L, 1);
 	return 0;
 }
 
@@ -256,6 +436,7 @@ static int
 conn_resetStart(lua_State *L)
 {
 	lua_pushboolean(L, PQresetStart(pgsql_conn(L, 1)));
+	types_invalidate(L, 1);
 	return 1;
 }
 
@@ -436,1455 +617,9308 @@ conn_sslAttributeNames(lua_State *L)
 }
 #endif
 
+#if PG_VERSION_NUM >= 170000
 /*
- * Command Execution Functions
+ * Drive a started cancel request until it completes or the deadline
+ * passes.  Returns 1 on success, 0 on failure and -1 on timeout.
  */
 static int
-conn_exec(lua_State *L)
-{
-	PGconn *conn;
-	PGresult **res;
-	const char *command;
+cancel_wait(PGcancelConn *cconn, int64_t deadline)
+{
+	PostgresPollingStatusType status = PGRES_POLLING_WRITING;
+	int events, timeout;
+
+	for (;;) {
+		timeout = time_left(deadline);
+		if (timeout == 0)
+			return -1;
+		events = wait_socket(PQcancelSocket(cconn),
+		    status == PGRES_POLLING_READING ? POLLIN : POLLOUT,
+		    timeout);
+		if (events == -1)
+			return 0;
+		if (events == 0)
+			continue;
+		switch (status = PQcancelPoll(cconn)) {
+		case PGRES_POLLING_OK:
+			return 1;
+		case PGRES_POLLING_FAILED:
+			return 0;
+		default:
+			break;
+		}
+	}
+}
+#endif
 
-	conn = pgsql_conn(L, 1);
-	command = luaL_checkstring(L, 2);
 
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQexec(conn, command);
-	if (*res == NULL)
-		lua_pushnil(L);
-	else
-		luaL_setmetatable(L, RES_METATABLE);
-	return 1;
+/* The query timeout of the connection at index n in ms, 0 if none */
+static int
+query_timeout(lua_State *L, int n)
+{
+	int timeout;
+
+	lua_getuservalue(L, n);
+	lua_getfield(L, -1, "timeout");
+	timeout = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+	return timeout;
 }
 
+/* Send a cancel request for the running query */
 static void
-get_param(lua_State *L, int t, int n, Oid *paramTypes, char **paramValues,
-    int *paramLengths, int *paramFormats)
+query_cancel(PGconn *conn, int timeout)
 {
-	switch (lua_type(L, t)) {
-	case LUA_TBOOLEAN:
-		if (paramTypes != NULL)
-			paramTypes[n] = BOOLOID;
-		if (paramValues != NULL) {
-			paramValues[n] = lua_newuserdata(L, sizeof(char));
-			*(char *)paramValues[n] = lua_toboolean(L, t);
-			paramLengths[n] = 1;
-		}
-		if (paramFormats != NULL)
-			paramFormats[n] = 1;
-		break;
-	case LUA_TNUMBER:
-		if (paramTypes != NULL) {
-			if (lua_isinteger(L, t))
-				paramTypes[n] = INT8OID;
-			else
-				paramTypes[n] = FLOAT8OID;
-		}
-		if (paramValues != NULL) {
-			union {
-				double v;
-				uint64_t i;
-			} swap;
+#if PG_VERSION_NUM >= 170000
+	PGcancelConn *cconn;
 
-			if (lua_isinteger(L, t))
-				swap.i = lua_tointeger(L, t);
-			else
-				swap.v = lua_tonumber(L, t);
-			paramValues[n] = lua_newuserdata(L, sizeof(uint64_t));
-			*(uint64_t *)paramValues[n] = htobe64(swap.i);
-			paramLengths[n] = sizeof(uint64_t);
-		}
-		if (paramFormats != NULL)
-			paramFormats[n] = 1;
-		break;
-	case LUA_TSTRING:
-		if (paramTypes != NULL)
-			paramTypes[n] = TEXTOID;
-		if (paramValues != NULL) {
-			const char *s;
-			size_t len;
+	if ((cconn = PQcancelCreate(conn)) != NULL) {
+		if (PQcancelStart(cconn))
+			cancel_wait(cconn, clock_ms() + timeout);
+		PQcancelFinish(cconn);
+	}
+#else
+	PGcancel *cancel;
+	char errbuf[256];
 
-			s = lua_tolstring(L, t, &len);
-			paramValues[n] = lua_newuserdata(L, len + 1);
-			/*
-			 * lua_tolstring returns a string with '\0' after
-			 * the last character.
-			 */
-			memcpy(paramValues[n], s, len + 1);
-		}
-		if (paramFormats != NULL)
-			paramFormats[n] = 0;
-		break;
-	case LUA_TNIL:
-		if (paramTypes != NULL)
-			paramTypes[n] = 0;
-		if (paramValues != NULL)
-			paramValues[n] = NULL;
-		if (paramFormats != NULL)
-			paramFormats[n] = 0;
-		break;
-	default:
-		luaL_error(L, "unsupported PostgreSQL parameter type %s ("
-		    "use table.unpack() for table types)", luaL_typename(L, t));
-		/* NOTREACHED */
+	if ((cancel = PQgetCancel(conn)) != NULL) {
+		PQcancel(cancel, errbuf, sizeof errbuf);
+		PQfreeCancel(cancel);
 	}
+#endif
 }
 
-static int
-conn_execParams(lua_State *L)
-{
-	PGconn *conn;
-	PGresult **res;
-	Oid *paramTypes;
-	char **paramValues;
-	const char *command;
-	int n, nParams, *paramLengths, *paramFormats;
-
-	conn = pgsql_conn(L, 1);
-	command = luaL_checkstring(L, 2);
-
-	nParams = lua_gettop(L) - 2;	/* subtract connection and command */
-
-	if (nParams > 65535)
-		luaL_error(L, "number of parameters must not exceed 65535");
+/* Time a cancelled query is given to finish, at least */
+#define CANCEL_GRACE	1000
 
-	if (nParams) {
-		luaL_checkstack(L, 4 + nParams, "out of stack space");
+/*
+ * Cancel the running query and discard its results.  If the server does
+ * not finish the query within the timeout, but at least CANCEL_GRACE
+ * milliseconds, the socket is shut down, leaving the connection in state
+ * CONNECTION_BAD instead of blocking, and 0 is returned.  Before libpq 17
+ * sending the cancel request itself blocks.
+ */
+static int
+query_abandon(PGconn *conn, int timeout)
+{
+	PGresult *r;
+	int64_t deadline;
+	int left;
+
+	query_cancel(conn, timeout);
+	deadline = clock_ms() + (timeout > CANCEL_GRACE ? timeout :
+	    CANCEL_GRACE);
+	for (;;) {
+		while (PQisBusy(conn)) {
+			left = time_left(deadline);
+			if (left == 0 ||
+			    wait_socket(PQsocket(conn), POLLIN, left) == 0) {
+				shutdown(PQsocket(conn), SHUT_RDWR);
+				PQconsumeInput(conn);
+				while ((r = PQgetResult(conn)) != NULL)
+					PQclear(r);
+				return 0;
+			}
+			if (!PQconsumeInput(conn))
+				break;
+		}
+		if ((r = PQgetResult(conn)) == NULL)
+			return 1;
+		PQclear(r);
+	}
+}
 
-		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
-		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
-		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
-		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+/*
+ * Collect the results of a query sent with one of the PQsend functions
+ * like PQexec() does, but give up after timeout milliseconds, a timeout of
+ * 0 waits forever.  On timeout the query is cancelled, NULL is returned
+ * and *timedout is set, to 2 if the connection had to be closed.  If the
+ * query could not be sent or returned no result, *timedout is set to -1.
+ * If sp is not NULL, the phases are recorded in it.
+ */
+static PGresult *
+query_wait(PGconn *conn, int sent, int timeout, int *timedout, qspan *sp)
+{
+	PGresult *r, *last = NULL;
+	int64_t deadline;
+	int left, events;
 
-		for (n = 0; n < nParams; n++)
-			get_param(L, 3 + n, n, paramTypes, paramValues,
-			    paramLengths, paramFormats);
-	} else {
-		paramTypes = NULL;
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
+	*timedout = 0;
+	if (!sent) {
+		*timedout = -1;
+		return NULL;
 	}
-	luaL_checkstack(L, 2, "out of stack space");
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQexecParams(conn, command, nParams, paramTypes,
-	    (const char * const*)paramValues, paramLengths, paramFormats, 0);
-	if (*res == NULL)
-		lua_pushnil(L);
-	else
-		luaL_setmetatable(L, RES_METATABLE);
-	return 1;
+	if (sp != NULL)
+		sp->sent = clock_us();
+	deadline = timeout > 0 ? clock_ms() + timeout : -1;
+	for (;;) {
+		while (PQisBusy(conn)) {
+			left = time_left(deadline);
+			events = left == 0 ? 0 :
+			    wait_socket(PQsocket(conn), POLLIN, left);
+			if (events == 0) {
+				PQclear(last);
+				*timedout = query_abandon(conn, timeout) ?
+				    1 : 2;
+				return NULL;
+			}
+			if (sp != NULL && sp->first == 0)
+				sp->first = clock_us();
+			if (events == -1 || !PQconsumeInput(conn))
+				break;
+		}
+		if (sp != NULL && sp->first == 0)
+			sp->first = clock_us();
+		if ((r = PQgetResult(conn)) == NULL)
+			break;
+		PQclear(last);
+		last = r;
+		switch (PQresultStatus(r)) {
+		case PGRES_COPY_IN:
+		case PGRES_COPY_OUT:
+		case PGRES_COPY_BOTH:
+			return r;
+		default:
+			break;
+		}
+	}
+	if (last == NULL)
+		*timedout = -1;
+	return last;
 }
 
+/*
+ * Push the values returned when query_wait() failed: nil and the error
+ * message, or nil and 'timeout' if the query timed out.
+ */
 static int
-conn_prepare(lua_State *L)
+query_failed(lua_State *L, PGconn *conn, int timedout)
 {
-	PGconn *conn;
-	PGresult **res;
-	Oid *paramTypes;
-	const char *command, *name;
-	int n, nParams;
-
-	conn = pgsql_conn(L, 1);
-	command = luaL_checkstring(L, 2);
-	name = luaL_checkstring(L, 3);
-
-	nParams = lua_gettop(L) - 3;	/* subtract connection, name, command */
-
-	if (nParams > 65535)
-		luaL_error(L, "number of parameters must not exceed 65535");
-
-	if (nParams) {
-		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
+	lua_pushnil(L);
+	if (timedout == -1) {
+		lua_pushstring(L, PQerrorMessage(conn));
+		return 2;
+	}
+	lua_pushliteral(L, "timeout");
+	if (timedout == 1)
+		return 2;
+	lua_pushliteral(L, "closed");
+	return 3;
+}
 
-		for (n = 0; n < nParams; n++)
-			get_param(L, 4 + n, n, paramTypes, NULL, NULL, NULL);
-	} else
-		paramTypes = NULL;
+/*
+ * conn:setQueryTimeout(ms) limits the time exec(), execParams(),
+ * execPrepared() and statement executions wait for their result.  When it
+ * expires, the query is cancelled and nil, 'timeout' is returned.  If the
+ * server does not end the query within the timeout again, but at least a
+ * second, the connection is closed and nil, 'timeout', 'closed' is
+ * returned; conn:reset() reconnects.  Queries that can't be sent return
+ * nil and the error message.  A timeout of 0 or nil disables the limit.
+ */
+static int
+conn_setQueryTimeout(lua_State *L)
+{
+	lua_Integer timeout;
 
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQprepare(conn, command, name, nParams, paramTypes);
-	if (*res == NULL)
-		lua_pushnil(L);
+	pgsql_conn(L, 1);
+	timeout = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, timeout >= 0 && timeout <= INT_MAX, 2,
+	    "invalid timeout");
+	lua_getuservalue(L, 1);
+	if (timeout > 0)
+		lua_pushinteger(L, timeout);
 	else
-		luaL_setmetatable(L, RES_METATABLE);
-	return 1;
+		lua_pushnil(L);
+	lua_setfield(L, -2, "timeout");
+	return 0;
 }
 
 static int
-conn_execPrepared(lua_State *L)
+conn_queryTimeout(lua_State *L)
 {
-	PGconn *conn;
-	PGresult **res;
-	char **paramValues;
-	const char *command;
-	int n, nParams, *paramLengths, *paramFormats;
+	pgsql_conn(L, 1);
+	lua_pushinteger(L, query_timeout(L, 1));
+	return 1;
+}
 
-	conn = pgsql_conn(L, 1);
-	command = luaL_checkstring(L, 2);
+/*
+ * Query profiling
+ *
+ * pgsql.setProfiling() enables timing of exec(), execParams(),
+ * execPrepared() and of asynchronous queries from sending to the last
+ * result.  Latencies are aggregated per statement, identified by the
+ * normalised query text or the prepared statement name, and queries
+ * exceeding a threshold are recorded in a slow query log.  Queries sent
+ * in pipeline mode are not profiled.
+ */
+#define PROFILE_KEY	"pgsql profile"
 
-	nParams = lua_gettop(L) - 2;	/* subtract connection and name */
+/* Return the start time of a query if queries are profiled, else -1 */
+static int64_t
+profile_start(lua_State *L)
+{
+	profile *p;
+	int64_t start = -1;
 
-	if (nParams > 65535)
-		luaL_error(L, "number of parameters must not exceed 65535");
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_KEY);
+	p = lua_touserdata(L, -1);
+	if (p != NULL && p->enabled)
+		start = clock_us();
+	lua_pop(L, 1);
+	return start;
+}
 
-	if (nParams) {
-		luaL_checkstack(L, 3 + nParams, "out of stack space");
+/*
+ * Push the query text with literals replaced by '?', comments removed
+ * and white space collapsed, so that queries only differing in their
+ * constants are aggregated.
+ */
+static void
+profile_normalize(lua_State *L, const char *s)
+{
+	luaL_Buffer b;
+	const char *p = s, *q, *tag;
+	size_t taglen;
+	int space = 0, out = 0, esc;
+
+	luaL_buffinit(L, &b);
+	while (*p) {
+		if (isspace((unsigned char)*p)) {
+			space = 1;
+			p++;
+			continue;
+		} else if (p[0] == '-' && p[1] == '-') {
+			p += strcspn(p, "\n");
+			space = 1;
+			continue;
+		} else if (p[0] == '/' && p[1] == '*') {
+			q = strstr(p + 2, "*/");
+			p = q != NULL ? q + 2 : p + strlen(p);
+			space = 1;
+			continue;
+		}
+		if (space && out)
+			luaL_addchar(&b, ' ');
+		space = 0;
+		out = 1;
+
+		if (*p == '\'') {
+			esc = p > s && (p[-1] == 'E' || p[-1] == 'e');
+			for (p++; *p; p++) {
+				if (esc && *p == '\\' && p[1] != '\0')
+					p++;
+				else if (*p == '\'' && p[1] == '\'')
+					p++;
+				else if (*p == '\'') {
+					p++;
+					break;
+				}
+			}
+			luaL_addchar(&b, '?');
+		} else if (*p == '"') {
+			q = p + 1;
+			while (*q && (*q != '"' || q[1] == '"'))
+				q += *q == '"' ? 2 : 1;
+			if (*q)
+				q++;
+			luaL_addlstring(&b, p, q - p);
+			p = q;
+		} else if (*p == '$' && isdigit((unsigned char)p[1])) {
+			for (q = p + 1; isdigit((unsigned char)*q); q++)
+				;
+			luaL_addlstring(&b, p, q - p);
+			p = q;
+		} else if (*p == '$') {
+			/* dollar quoted string, $tag$...$tag$ */
+			for (q = p + 1; isalnum((unsigned char)*q) || *q == '_';
+			    q++)
+				;
+			if (*q != '$') {
+				luaL_addchar(&b, *p++);
+				continue;
+			}
+			tag = p;
+			taglen = q - p + 1;
+			for (q++; *q && strncmp(q, tag, taglen); q++)
+				;
+			p = *q ? q + taglen : q;
+			luaL_addchar(&b, '?');
+		} else if (isdigit((unsigned char)*p) ||
+		    (*p == '.' && isdigit((unsigned char)p[1]))) {
+			while (isdigit((unsigned char)*p) || *p == '.')
+				p++;
+			if ((*p == 'e' || *p == 'E') &&
+			    (isdigit((unsigned char)p[1]) ||
+			    ((p[1] == '+' || p[1] == '-') &&
+			    isdigit((unsigned char)p[2])))) {
+				for (p += 2; isdigit((unsigned char)*p); p++)
+					;
+			}
+			luaL_addchar(&b, '?');
+		} else if (isalpha((unsigned char)*p) || *p == '_' ||
+		    (unsigned char)*p >= 0x80) {
+			for (q = p; isalnum((unsigned char)*q) || *q == '_' ||
+			    *q == '$' || (unsigned char)*q >= 0x80; q++)
+				;
+			luaL_addlstring(&b, p, q - p);
+			p = q;
+		} else
+			luaL_addchar(&b, *p++);
+	}
+	luaL_pushresult(&b);
+}
+
+/* Push a table with the types of the parameters first to first + n - 1 */
+static void
+profile_params(lua_State *L, int first, int n)
+{
+	record *r;
+	int i;
+
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		switch (lua_type(L, first + i)) {
+		case LUA_TBOOLEAN:
+			lua_pushliteral(L, "bool");
+			break;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, first + i))
+				lua_pushliteral(L, "int8");
+			else
+				lua_pushliteral(L, "float8");
+			break;
+		case LUA_TSTRING:
+			lua_pushliteral(L, "text");
+			break;
+		case LUA_TNIL:
+			lua_pushliteral(L, "null");
+			break;
+		default:
+			if ((r = luaL_testudata(L, first + i,
+			    RECORD_METATABLE)) != NULL)
+				lua_pushfstring(L, "record %d", (int)r->oid);
+			else
+				lua_pushstring(L, luaL_typename(L, first + i));
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+/* The number of rows returned or affected by a command */
+static lua_Integer
+profile_rows(PGresult *r)
+{
+	if (PQresultStatus(r) == PGRES_TUPLES_OK)
+		return PQntuples(r);
+	return strtoll(PQcmdTuples(r), NULL, 10);
+}
+
+static int
+profile_failed(PGresult *r)
+{
+	switch (PQresultStatus(r)) {
+	case PGRES_BAD_RESPONSE:
+	case PGRES_FATAL_ERROR:
+		return 1;
+	default:
+		return r == NULL;
+	}
+}
+
+/*
+ * Account a completed query.  key is the index of the statement key,
+ * params the index of a table with the parameter types or 0, in which
+ * case the types are taken from the n parameters starting at first.
+ */
+static void
+profile_add(lua_State *L, int key, int params, int first, int n,
+    lua_Integer rows, int failed, int64_t start)
+{
+	profile *p;
+	profstat *st;
+	struct timespec ts;
+	int64_t elapsed;
+	int top, uv, bucket;
+
+	elapsed = clock_us() - start;
+	top = lua_gettop(L);
+	key = lua_absindex(L, key);
+	if (params)
+		params = lua_absindex(L, params);
+	luaL_checkstack(L, 8, "out of stack space");
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_KEY);
+	if ((p = lua_touserdata(L, -1)) == NULL || !p->enabled) {
+		lua_settop(L, top);
+		return;
+	}
+	lua_getuservalue(L, -1);
+	uv = lua_gettop(L);
+
+	lua_rawgeti(L, uv, 1);
+	lua_pushvalue(L, key);
+	if (lua_rawget(L, -2) == LUA_TNIL) {
+		lua_pop(L, 1);
+		st = lua_newuserdata(L, sizeof(profstat));
+		memset(st, 0, sizeof(profstat));
+		st->min = INT64_MAX;
+		lua_pushvalue(L, key);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	} else
+		st = lua_touserdata(L, -1);
+	st->calls++;
+	st->errors += failed;
+	st->rows += rows;
+	st->total += elapsed;
+	if (elapsed < st->min)
+		st->min = elapsed;
+	if (elapsed > st->max)
+		st->max = elapsed;
+	for (bucket = 0; bucket < PROFILE_BUCKETS - 1 &&
+	    elapsed >= (int64_t)1 << bucket; bucket++)
+		;
+	st->hist[bucket]++;
+
+	if (p->slow >= 0 && elapsed >= p->slow && p->slowmax > 0) {
+		lua_rawgeti(L, uv, 2);
+		lua_createtable(L, 0, 6);
+		lua_pushvalue(L, key);
+		lua_setfield(L, -2, "query");
+		lua_pushnumber(L, (lua_Number)elapsed / 1000);
+		lua_setfield(L, -2, "duration");
+		clock_gettime(CLOCK_REALTIME, &ts);
+		lua_pushnumber(L, ts.tv_sec + (lua_Number)ts.tv_nsec / 1e9);
+		lua_setfield(L, -2, "time");
+		lua_pushinteger(L, rows);
+		lua_setfield(L, -2, "rows");
+		lua_pushboolean(L, failed);
+		lua_setfield(L, -2, "failed");
+		if (params)
+			lua_pushvalue(L, params);
+		else
+			profile_params(L, first, n);
+		lua_setfield(L, -2, "params");
+		lua_rawseti(L, -2, p->nslow++ % p->slowmax + 1);
+	}
+	lua_settop(L, top);
+}
+
+/* Account a synchronous query, r may be NULL */
+static void
+profile_query(lua_State *L, const char *command, int prepared, PGresult *r,
+    int first, int n, int64_t start)
+{
+	if (prepared)
+		lua_pushfstring(L, "EXECUTE %s", command);
+	else
+		profile_normalize(L, command);
+	profile_add(L, -1, 0, first, n, r != NULL ? profile_rows(r) : 0,
+	    profile_failed(r), start);
+	lua_pop(L, 1);
+}
+
+/*
+ * Remember an asynchronous query in the uservalue of the connection, it
+ * is accounted when conn:getResult() returns nil.  In pipeline mode more
+ * than one query can be outstanding, which a single record can't follow.
+ */
+static void
+profile_send(lua_State *L, PGconn *conn, const char *command, int prepared,
+    int first, int n, int64_t start)
+{
+#if PG_VERSION_NUM >= 140000
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+		return;
+#endif
+	lua_getuservalue(L, 1);
+	lua_createtable(L, 0, 5);
+	if (prepared)
+		lua_pushfstring(L, "EXECUTE %s", command);
+	else
+		profile_normalize(L, command);
+	lua_setfield(L, -2, "key");
+	profile_params(L, first, n);
+	lua_setfield(L, -2, "params");
+	lua_pushinteger(L, start);
+	lua_setfield(L, -2, "start");
+	lua_pushinteger(L, 0);
+	lua_setfield(L, -2, "rows");
+	lua_setfield(L, -2, "profile");
+	lua_pop(L, 1);
+}
+
+static void
+profile_result(lua_State *L, PGresult *r)
+{
+	lua_getuservalue(L, 1);
+	if (lua_getfield(L, -1, "profile") != LUA_TTABLE) {
+		lua_pop(L, 2);
+		return;
+	}
+	if (r != NULL) {
+		lua_getfield(L, -1, "rows");
+		lua_pushinteger(L, lua_tointeger(L, -1) + profile_rows(r));
+		lua_setfield(L, -3, "rows");
+		lua_pop(L, 1);
+		if (profile_failed(r)) {
+			lua_pushboolean(L, 1);
+			lua_setfield(L, -2, "failed");
+		}
+	} else {
+		lua_getfield(L, -1, "key");
+		lua_getfield(L, -2, "params");
+		lua_getfield(L, -3, "rows");
+		lua_getfield(L, -4, "failed");
+		lua_getfield(L, -5, "start");
+		profile_add(L, -5, -4, 0, 0, lua_tointeger(L, -3),
+		    lua_toboolean(L, -2), lua_tointeger(L, -1));
+		lua_pop(L, 5);
+		lua_pushnil(L);
+		lua_setfield(L, -3, "profile");
+	}
+	lua_pop(L, 2);
+}
+
+/*
+ * pgsql.setProfiling(opts) enables profiling, opts.slow is the slow query
+ * threshold in milliseconds and opts.slowlog the number of slow queries
+ * kept (100).  pgsql.setProfiling(false) disables it.
+ */
+static int
+pgsql_setProfiling(lua_State *L)
+{
+	profile *p;
+	lua_Number slow = -1;
+	lua_Integer slowmax = 100;
+
+	if (lua_istable(L, 1)) {
+		if (lua_getfield(L, 1, "slow") != LUA_TNIL)
+			slow = luaL_checknumber(L, -1);
+		if (lua_getfield(L, 1, "slowlog") != LUA_TNIL)
+			slowmax = luaL_checkinteger(L, -1);
+		luaL_argcheck(L, slowmax >= 0 && slowmax <= INT_MAX, 1,
+		    "invalid slow query log size");
+		lua_pop(L, 2);
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_KEY);
+	p = lua_touserdata(L, -1);
+	if (!lua_toboolean(L, 1)) {
+		if (p != NULL)
+			p->enabled = 0;
+		return 0;
+	}
+	if (p == NULL) {
+		p = lua_newuserdata(L, sizeof(profile));
+		p->nslow = 0;
+		lua_createtable(L, 2, 0);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+		lua_setuservalue(L, -2);
+		luaL_setmetatable(L, PROFILE_METATABLE);
+		lua_setfield(L, LUA_REGISTRYINDEX, PROFILE_KEY);
+	} else if (slowmax != p->slowmax) {
+		/* a resized slow query log starts over */
+		lua_getuservalue(L, -1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+		p->nslow = 0;
+	}
+	p->enabled = 1;
+	p->slow = slow < 0 ? -1 : (int64_t)(slow * 1000);
+	p->slowmax = slowmax;
+	return 0;
+}
+
+/* The duration below which a fraction q of the calls completed, in ms */
+static lua_Number
+profile_quantile(profstat *st, double q)
+{
+	lua_Integer seen = 0;
+	int n;
+
+	for (n = 0; n < PROFILE_BUCKETS; n++) {
+		seen += st->hist[n];
+		if (seen >= q * st->calls)
+			break;
+	}
+	if (n == PROFILE_BUCKETS - 1 || (int64_t)1 << n > st->max)
+		return (lua_Number)st->max / 1000;
+	return (lua_Number)((int64_t)1 << n) / 1000;
+}
+
+/*
+ * pgsql.profile([reset]) returns the statistics per statement and the
+ * slow query log, oldest first.  Durations are in milliseconds.
+ */
+static int
+pgsql_profile(lua_State *L)
+{
+	profile *p;
+	profstat *st;
+	lua_Integer i, n;
+	int b;
+
+	lua_settop(L, 1);
+	lua_createtable(L, 0, 3);
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_KEY);
+	if ((p = lua_touserdata(L, -1)) == NULL) {
+		lua_pop(L, 1);
+		lua_pushboolean(L, 0);
+		lua_setfield(L, -2, "enabled");
+		return 1;
+	}
+	lua_pushboolean(L, p->enabled);
+	lua_setfield(L, 2, "enabled");
+	lua_getuservalue(L, 3);		/* 4 */
+
+	lua_newtable(L);
+	lua_rawgeti(L, 4, 1);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		st = lua_touserdata(L, -1);
+		lua_createtable(L, 0, 11);
+		lua_pushinteger(L, st->calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, st->errors);
+		lua_setfield(L, -2, "errors");
+		lua_pushinteger(L, st->rows);
+		lua_setfield(L, -2, "rows");
+		lua_pushnumber(L, (lua_Number)st->total / 1000);
+		lua_setfield(L, -2, "total");
+		lua_pushnumber(L, (lua_Number)st->min / 1000);
+		lua_setfield(L, -2, "min");
+		lua_pushnumber(L, (lua_Number)st->max / 1000);
+		lua_setfield(L, -2, "max");
+		lua_pushnumber(L, (lua_Number)st->total / 1000 / st->calls);
+		lua_setfield(L, -2, "mean");
+		lua_pushnumber(L, profile_quantile(st, 0.5));
+		lua_setfield(L, -2, "p50");
+		lua_pushnumber(L, profile_quantile(st, 0.95));
+		lua_setfield(L, -2, "p95");
+		lua_pushnumber(L, profile_quantile(st, 0.99));
+		lua_setfield(L, -2, "p99");
+		lua_createtable(L, PROFILE_BUCKETS, 0);
+		for (b = 0; b < PROFILE_BUCKETS; b++) {
+			lua_pushinteger(L, st->hist[b]);
+			lua_rawseti(L, -2, b + 1);
+		}
+		lua_setfield(L, -2, "histogram");
+		lua_pushvalue(L, -3);
+		lua_insert(L, -2);
+		lua_rawset(L, -6);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, 2, "statements");
+
+	lua_newtable(L);
+	lua_rawgeti(L, 4, 2);
+	n = p->nslow < p->slowmax ? p->nslow : p->slowmax;
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, -1, (p->nslow - n + i) % p->slowmax + 1);
+		lua_rawseti(L, -3, i + 1);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, 2, "slow");
+
+	if (lua_toboolean(L, 1)) {
+		lua_newtable(L);
+		lua_rawseti(L, 4, 1);
+		lua_newtable(L);
+		lua_rawseti(L, 4, 2);
+		p->nslow = 0;
+	}
+	lua_settop(L, 2);
+	return 1;
+}
+
+/*
+ * Query phase spans
+ *
+ * pgsql.setSpans(f [, size]) records for every exec(), execParams(),
+ * execPrepared() and statement execution when its parameters were
+ * encoded, it was sent, the first response arrived and the last result
+ * was received, plus the time spent converting the result with res:copy()
+ * or res:rows().  The spans are passed to f in batches of size spans,
+ * as a table of arrays that is reused for every batch:
+ *
+ *	{ n = count, name = {}, start = {}, encoded = {}, sent = {},
+ *	  first = {}, done = {}, decode = {}, rows = {}, failed = {} }
+ *
+ * Timestamps are Unix time in microseconds, decode is a duration in
+ * microseconds.  Queries executed by f itself are not recorded.
+ */
+#define SPANS_KEY	"pgsql spans"
+
+static const char *const span_fields[] = {
+	"start", "encoded", "sent", "first", "done", "decode", "rows",
+	"failed", NULL
+};
+
+/* Hand the collected spans to the callback, sidx is the spans object */
+static void
+spans_flush(lua_State *L, spans *s, int sidx)
+{
+	qspan *sp;
+	int64_t v;
+	int n, f;
+
+	if (s->count == 0 || s->size == 0)
+		return;
+	luaL_checkstack(L, 6, "out of stack space");
+	lua_getuservalue(L, sidx);
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, -2, 2);
+	for (f = 0; span_fields[f] != NULL; f++) {
+		lua_getfield(L, -1, span_fields[f]);
+		for (n = 0; n < s->count; n++) {
+			sp = &s->ents[n];
+			switch (f) {
+			case 0:
+				v = sp->start + s->offset;
+				break;
+			case 1:
+				v = sp->encoded + s->offset;
+				break;
+			case 2:
+				v = sp->sent + s->offset;
+				break;
+			case 3:
+				v = sp->first + s->offset;
+				break;
+			case 4:
+				v = sp->done + s->offset;
+				break;
+			case 5:
+				v = sp->decode;
+				break;
+			case 6:
+				v = sp->rows;
+				break;
+			default:
+				lua_pushboolean(L, sp->failed);
+				lua_rawseti(L, -2, n + 1);
+				continue;
+			}
+			lua_pushinteger(L, v);
+			lua_rawseti(L, -2, n + 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushinteger(L, s->count);
+	lua_setfield(L, -2, "n");
+	s->count = 0;
+	s->size = -s->size;	/* no spans while the callback runs */
+	if (lua_pcall(L, 1, 0, 0)) {
+		s->size = -s->size;
+		lua_error(L);
+	}
+	s->size = -s->size;
+	lua_pop(L, 1);
+}
+
+/*
+ * Start a span for a query named by the string at index name, that
+ * started at start as returned by span_clock().  Return NULL if spans are
+ * not recorded.  Call this once the parameters are encoded, so that a
+ * failure to encode them does not leave an unfinished span.
+ */
+static qspan *
+span_begin(lua_State *L, int name, int64_t start)
+{
+	spans *s;
+	qspan *sp;
+
+	if (start < 0)
+		return NULL;
+	name = lua_absindex(L, name);
+	lua_getfield(L, LUA_REGISTRYINDEX, SPANS_KEY);
+	s = lua_touserdata(L, -1);
+	if (s == NULL || s->size <= 0) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	if (s->count == s->size)
+		spans_flush(L, s, lua_gettop(L));
+	sp = &s->ents[s->count++];
+	memset(sp, 0, sizeof(qspan));
+	sp->start = start;
+
+	lua_getuservalue(L, -1);
+	lua_rawgeti(L, -1, 2);
+	lua_getfield(L, -1, "name");
+	lua_pushvalue(L, name);
+	lua_rawseti(L, -2, s->count);
+	lua_pop(L, 4);
+	return sp;
+}
+
+/* Complete a span, phases that were not reached take no time */
+static void
+span_end(qspan *sp, const PGresult *r)
+{
+	int64_t now = clock_us();
+
+	if (sp->encoded == 0)
+		sp->encoded = now;
+	if (sp->sent == 0)
+		sp->sent = now;
+	if (sp->first == 0)
+		sp->first = now;
+	if (sp->done == 0)
+		sp->done = now;
+	sp->res = r;
+	if (r != NULL) {
+		sp->rows = profile_rows((PGresult *)r);
+		sp->failed = profile_failed((PGresult *)r);
+	} else
+		sp->failed = 1;
+}
+
+/* Return the time if spans are recorded, -1 otherwise */
+static int64_t
+span_clock(lua_State *L)
+{
+	spans *s;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, SPANS_KEY);
+	s = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return s != NULL && s->size > 0 ? clock_us() : -1;
+}
+
+/* Add the time since start to the span of a result not yet handed out */
+static void
+span_decoded(lua_State *L, const PGresult *r, int64_t start)
+{
+	spans *s;
+	int n;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, SPANS_KEY);
+	if ((s = lua_touserdata(L, -1)) != NULL)
+		for (n = s->count - 1; n >= 0; n--)
+			if (s->ents[n].res == r) {
+				s->ents[n].decode += clock_us() - start;
+				break;
+			}
+	lua_pop(L, 1);
+}
+
+/* pgsql.setSpans(f [, size]) or pgsql.setSpans(nil) to stop */
+static int
+pgsql_setSpans(lua_State *L)
+{
+	struct timespec ts;
+	spans *s;
+	lua_Integer size;
+	int f;
+
+	size = luaL_optinteger(L, 2, 256);
+	luaL_argcheck(L, size > 0 && size <= INT_MAX / (lua_Integer)
+	    sizeof(qspan), 2, "invalid batch size");
+	lua_getfield(L, LUA_REGISTRYINDEX, SPANS_KEY);
+	if ((s = lua_touserdata(L, -1)) != NULL && s->size > 0)
+		spans_flush(L, s, lua_gettop(L));
+	lua_pop(L, 1);
+	if (lua_isnoneornil(L, 1)) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, SPANS_KEY);
+		return 0;
+	}
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	s = lua_newuserdata(L, sizeof(spans) + size * sizeof(qspan));
+	s->size = size;
+	s->count = 0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s->offset = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 -
+	    clock_us();
+	luaL_setmetatable(L, SPANS_METATABLE);
+
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_createtable(L, 0, 10);
+	lua_createtable(L, size, 0);
+	lua_setfield(L, -2, "name");
+	for (f = 0; span_fields[f] != NULL; f++) {
+		lua_createtable(L, size, 0);
+		lua_setfield(L, -2, span_fields[f]);
+	}
+	lua_rawseti(L, -2, 2);
+	lua_setuservalue(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, SPANS_KEY);
+	return 0;
+}
+
+/* pgsql.flushSpans() passes the spans collected so far to the callback */
+static int
+pgsql_flushSpans(lua_State *L)
+{
+	spans *s;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, SPANS_KEY);
+	if ((s = lua_touserdata(L, -1)) != NULL && s->size > 0)
+		spans_flush(L, s, lua_gettop(L));
+	return 0;
+}
+
+/*
+ * Command Execution Functions
+ */
+static int
+conn_exec(lua_State *L)
+{
+	PGconn *conn;
+	PGresult **res;
+	const char *command;
+	qspan *sp;
+	int64_t start;
+	int timeout, timedout;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	timeout = query_timeout(L, 1);
+	start = profile_start(L);
+	if ((sp = span_begin(L, 2, span_clock(L))) != NULL)
+		sp->encoded = sp->start;
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	if (timeout > 0 || sp != NULL)
+		*res = query_wait(conn, PQsendQuery(conn, command), timeout,
+		    &timedout, sp);
+	else
+		*res = PQexec(conn, command);
+	if (sp != NULL)
+		span_end(sp, *res);
+	if (start >= 0)
+		profile_query(L, command, 0, *res, 3, 0, start);
+	if ((timeout > 0 || sp != NULL) && timedout)
+		return query_failed(L, conn, timedout);
+	if (*res == NULL)
+		lua_pushnil(L);
+	else {
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, 1);
+	}
+	return 1;
+}
+
+static void
+get_param(lua_State *L, int t, int n, Oid *paramTypes, char **paramValues,
+    int *paramLengths, int *paramFormats)
+{
+	record *r;
+
+	switch (lua_type(L, t)) {
+	case LUA_TBOOLEAN:
+		if (paramTypes != NULL)
+			paramTypes[n] = BOOLOID;
+		if (paramValues != NULL) {
+			paramValues[n] = lua_newuserdata(L, sizeof(char));
+			*(char *)paramValues[n] = lua_toboolean(L, t);
+			paramLengths[n] = 1;
+		}
+		if (paramFormats != NULL)
+			paramFormats[n] = 1;
+		break;
+	case LUA_TNUMBER:
+		if (paramTypes != NULL) {
+			if (lua_isinteger(L, t))
+				paramTypes[n] = INT8OID;
+			else
+				paramTypes[n] = FLOAT8OID;
+		}
+		if (paramValues != NULL) {
+			union {
+				double v;
+				uint64_t i;
+			} swap;
+
+			if (lua_isinteger(L, t))
+				swap.i = lua_tointeger(L, t);
+			else
+				swap.v = lua_tonumber(L, t);
+			paramValues[n] = lua_newuserdata(L, sizeof(uint64_t));
+			*(uint64_t *)paramValues[n] = htobe64(swap.i);
+			paramLengths[n] = sizeof(uint64_t);
+		}
+		if (paramFormats != NULL)
+			paramFormats[n] = 1;
+		break;
+	case LUA_TSTRING:
+		if (paramTypes != NULL)
+			paramTypes[n] = TEXTOID;
+		if (paramValues != NULL) {
+			const char *s;
+			size_t len;
+
+			s = lua_tolstring(L, t, &len);
+			paramValues[n] = lua_newuserdata(L, len + 1);
+			/*
+			 * lua_tolstring returns a string with '\0' after
+			 * the last character.
+			 */
+			memcpy(paramValues[n], s, len + 1);
+		}
+		if (paramFormats != NULL)
+			paramFormats[n] = 0;
+		break;
+	case LUA_TNIL:
+		if (paramTypes != NULL)
+			paramTypes[n] = 0;
+		if (paramValues != NULL)
+			paramValues[n] = NULL;
+		if (paramFormats != NULL)
+			paramFormats[n] = 0;
+		break;
+	case LUA_TUSERDATA:
+		if ((r = luaL_testudata(L, t, RECORD_METATABLE)) != NULL) {
+			if (paramTypes != NULL)
+				paramTypes[n] = r->oid;
+			if (paramValues != NULL) {
+				paramValues[n] = r->data;
+				paramLengths[n] = r->len;
+			}
+			if (paramFormats != NULL)
+				paramFormats[n] = 1;
+			break;
+		}
+		/* FALLTHROUGH */
+	default:
+		luaL_error(L, "unsupported PostgreSQL parameter type %s ("
+		    "use table.unpack() or conn:record() for table types)",
+		    luaL_typename(L, t));
+		/* NOTREACHED */
+	}
+}
+
+static int
+conn_execParams(lua_State *L)
+{
+	PGconn *conn;
+	PGresult **res;
+	Oid *paramTypes;
+	char **paramValues;
+	const char *command;
+	qspan *sp;
+	int64_t start;
+	int64_t spstart;
+	int n, nParams, *paramLengths, *paramFormats, timeout, timedout;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	start = profile_start(L);
+	spstart = span_clock(L);
+
+	nParams = lua_gettop(L) - 2;	/* subtract connection and command */
+
+	if (nParams > 65535)
+		luaL_error(L, "number of parameters must not exceed 65535");
+
+	if (nParams) {
+		luaL_checkstack(L, 4 + nParams, "out of stack space");
+
+		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
+		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
+		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
+		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+
+		for (n = 0; n < nParams; n++)
+			get_param(L, 3 + n, n, paramTypes, paramValues,
+			    paramLengths, paramFormats);
+	} else {
+		paramTypes = NULL;
+		paramValues = NULL;
+		paramLengths = NULL;
+		paramFormats = NULL;
+	}
+	if ((sp = span_begin(L, 2, spstart)) != NULL)
+		sp->encoded = clock_us();
+	luaL_checkstack(L, 2, "out of stack space");
+	timeout = query_timeout(L, 1);
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	if (timeout > 0 || sp != NULL)
+		*res = query_wait(conn, PQsendQueryParams(conn, command,
+		    nParams, paramTypes, (const char * const*)paramValues,
+		    paramLengths, paramFormats, 0), timeout, &timedout, sp);
+	else
+		*res = PQexecParams(conn, command, nParams, paramTypes,
+		    (const char * const*)paramValues, paramLengths,
+		    paramFormats, 0);
+	if (sp != NULL)
+		span_end(sp, *res);
+	if (start >= 0)
+		profile_query(L, command, 0, *res, 3, nParams, start);
+	if ((timeout > 0 || sp != NULL) && timedout)
+		return query_failed(L, conn, timedout);
+	if (*res == NULL)
+		lua_pushnil(L);
+	else {
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, 1);
+	}
+	return 1;
+}
+
+static int
+conn_prepare(lua_State *L)
+{
+	PGconn *conn;
+	PGresult **res;
+	Oid *paramTypes;
+	const char *command, *name;
+	int n, nParams;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	name = luaL_checkstring(L, 3);
+
+	nParams = lua_gettop(L) - 3;	/* subtract connection, name, command */
+
+	if (nParams > 65535)
+		luaL_error(L, "number of parameters must not exceed 65535");
+
+	if (nParams) {
+		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
+
+		for (n = 0; n < nParams; n++)
+			get_param(L, 4 + n, n, paramTypes, NULL, NULL, NULL);
+	} else
+		paramTypes = NULL;
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = PQprepare(conn, command, name, nParams, paramTypes);
+	if (*res == NULL)
+		lua_pushnil(L);
+	else {
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, 1);
+	}
+	return 1;
+}
+
+static int
+conn_execPrepared(lua_State *L)
+{
+	PGconn *conn;
+	PGresult **res;
+	char **paramValues;
+	const char *command;
+	qspan *sp;
+	int64_t start;
+	int64_t spstart;
+	int n, nParams, *paramLengths, *paramFormats, timeout, timedout;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	start = profile_start(L);
+	spstart = span_clock(L);
+
+	nParams = lua_gettop(L) - 2;	/* subtract connection and name */
+
+	if (nParams > 65535)
+		luaL_error(L, "number of parameters must not exceed 65535");
+
+	if (nParams) {
+		luaL_checkstack(L, 3 + nParams, "out of stack space");
+
+		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
+		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
+		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+
+		for (n = 0; n < nParams; n++)
+			get_param(L, 3 + n, n, NULL, paramValues, paramLengths,
+			    paramFormats);
+	} else {
+		paramValues = NULL;
+		paramLengths = NULL;
+		paramFormats = NULL;
+	}
+	if ((sp = span_begin(L, 2, spstart)) != NULL)
+		sp->encoded = clock_us();
+	luaL_checkstack(L, 2, "out of stack space");
+
+	timeout = query_timeout(L, 1);
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	if (timeout > 0 || sp != NULL)
+		*res = query_wait(conn, PQsendQueryPrepared(conn, command,
+		    nParams, (const char * const*)paramValues, paramLengths,
+		    paramFormats, 0), timeout, &timedout, sp);
+	else
+		*res = PQexecPrepared(conn, command, nParams,
+		    (const char * const*)paramValues, paramLengths,
+		    paramFormats, 0);
+	if (sp != NULL)
+		span_end(sp, *res);
+	if (start >= 0)
+		profile_query(L, command, 1, *res, 3, nParams, start);
+	if ((timeout > 0 || sp != NULL) && timedout)
+		return query_failed(L, conn, timedout);
+	if (*res == NULL)
+		lua_pushnil(L);
+	else {
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, 1);
+	}
+	return 1;
+}
+
+static int
+conn_describePrepared(lua_State *L)
+{
+	PGconn *conn;
+	PGresult **res;
+	const char *name;
+
+	conn = pgsql_conn(L, 1);
+	name = luaL_checkstring(L, 2);
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = PQdescribePrepared(conn, name);
+	if (*res == NULL)
+		lua_pushnil(L);
+	else {
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, 1);
+	}
+	return 1;
+}
+
+static int
+conn_describePortal(lua_State *L)
+{
+	PGconn *conn;
+	PGresult **res;
+	const char *name;
+
+	conn = pgsql_conn(L, 1);
+	name = luaL_checkstring(L, 2);
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = PQdescribePortal(conn, name);
+	if (*res == NULL)
+		lua_pushnil(L);
+	else {
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, 1);
+	}
+	return 1;
+}
+
+static int
+conn_escapeString(lua_State *L)
+{
+	PGconn *d;
+	size_t len;
+	char *buf;
+	const char *str;
+	int error;
+
+	d = pgsql_conn(L, 1);
+
+	str = lua_tolstring(L, 2, &len);
+	if (str == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	buf = lua_newuserdata(L, 2 * (len + 1));
+
+	PQescapeStringConn(d, buf, str, len, &error);
+	if (!error)
+		lua_pushstring(L, buf);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int
+conn_escapeLiteral(lua_State *L)
+{
+	const char *s;
+	char **p;
+	PGconn *d;
+	size_t len;
+
+	d = pgsql_conn(L, 1);
+	s = luaL_checklstring(L, 2, &len);
+	p = gcmalloc(L, sizeof(char *));
+	*p = PQescapeLiteral(d, s, len);
+	lua_pushstring(L, *p);
+	gcfree(p);
+	return 1;
+}
+
+static int
+conn_escapeIdentifier(lua_State *L)
+{
+	const char *s;
+	char  **p;
+	PGconn *d;
+	size_t len;
+
+	d = pgsql_conn(L, 1);
+	s = luaL_checklstring(L, 2, &len);
+	p = gcmalloc(L, sizeof(char *));
+	*p = PQescapeIdentifier(d, s, len);
+	lua_pushstring(L, *p);
+	gcfree(p);
+	return 1;
+}
+
+static int
+conn_escapeBytea(lua_State *L)
+{
+	unsigned char **p;
+	const unsigned char *s;
+	PGconn *d;
+	size_t from_length, to_length;
+
+	d = pgsql_conn(L, 1);
+	s = (const unsigned char *)luaL_checklstring(L, 2, &from_length);
+	p = gcmalloc(L, sizeof(char *));
+	*p = PQescapeByteaConn(d, s, from_length, &to_length);
+	if (*p) {
+		lua_pushlstring(L, (const char *)*p, to_length - 1);
+		gcfree(p);
+	} else
+		lua_pushnil(L);
+	return 1;
+}
+
+/*
+ * Asynchronous Command Execution Functions
+ */
+static int
+conn_sendQuery(lua_State *L)
+{
+	PGconn *conn;
+	const char *command;
+	int64_t start;
+	int r;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	start = profile_start(L);
+	r = PQsendQuery(conn, command);
+	if (r && start >= 0)
+		profile_send(L, conn, command, 0, 3, 0, start);
+	lua_pushboolean(L, r);
+	return 1;
+}
+
+static int
+conn_sendQueryParams(lua_State *L)
+{
+	PGconn *conn;
+	Oid *paramTypes;
+	char **paramValues;
+	const char *command;
+	int64_t start;
+	int n, nParams, *paramLengths, *paramFormats, r;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	start = profile_start(L);
+
+	nParams = lua_gettop(L) - 2;	/* subtract connection and command */
+
+	if (nParams) {
+		luaL_checkstack(L, 4 + nParams, "out of stack space");
+
+		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
+		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
+		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
+		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+
+		for (n = 0; n < nParams; n++)
+			get_param(L, 3 + n, n, paramTypes, paramValues,
+			   paramLengths, paramFormats);
+	} else {
+		paramTypes = NULL;
+		paramValues = NULL;
+		paramLengths = NULL;
+		paramFormats = NULL;
+	}
+	r = PQsendQueryParams(conn, command, nParams, paramTypes,
+	    (const char * const*)paramValues, paramLengths, paramFormats, 0);
+	if (r && start >= 0)
+		profile_send(L, conn, command, 0, 3, nParams, start);
+	lua_pushboolean(L, r);
+	return 1;
+}
+
+static int
+conn_sendPrepare(lua_State *L)
+{
+	PGconn *conn;
+	Oid *paramTypes;
+	const char *command, *name;
+	int n, nParams;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	name = luaL_checkstring(L, 3);
+
+	nParams = lua_gettop(L) - 3;	/* subtract connection, name, command */
+
+	if (nParams) {
+		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
+
+		for (n = 0; n < nParams; n++)
+			get_param(L, 4 + n, n, paramTypes, NULL, NULL, NULL);
+	} else
+		paramTypes = NULL;
+	lua_pushboolean(L,
+	    PQsendPrepare(conn, command, name, nParams, paramTypes));
+	return 1;
+}
+
+static int
+conn_sendQueryPrepared(lua_State *L)
+{
+	PGconn *conn;
+	char **paramValues;
+	const char *name;
+	int64_t start;
+	int n, nParams, *paramLengths, *paramFormats, r;
+
+	conn = pgsql_conn(L, 1);
+	name = luaL_checkstring(L, 2);
+	start = profile_start(L);
+
+	nParams = lua_gettop(L) - 2;	/* subtract connection and name */
+
+	if (nParams) {
+		luaL_checkstack(L, 3 + nParams, "out of stack space");
+
+		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
+		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
+		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+
+		for (n = 0; n < nParams; n++)
+			get_param(L, 3 + n, n, NULL, paramValues, paramLengths,
+			    paramFormats);
+	} else {
+		paramValues = NULL;
+		paramLengths = NULL;
+		paramFormats = NULL;
+	}
+	r = PQsendQueryPrepared(conn, name, nParams,
+	    (const char * const*)paramValues, paramLengths, paramFormats, 0);
+	if (r && start >= 0)
+		profile_send(L, conn, name, 1, 3, nParams, start);
+	lua_pushboolean(L, r);
+	return 1;
+}
+
+static int
+conn_sendDescribePrepared(lua_State *L)
+{
+	lua_pushboolean(L,
+	    PQsendDescribePrepared(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
+	return 1;
+}
+
+static int
+conn_sendDescribePortal(lua_State *L)
+{
+	lua_pushboolean(L,
+	    PQsendDescribePortal(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
+	return 1;
+}
+
+static int
+conn_getResult(lua_State *L)
+{
+	PGresult *r, **res;
+
+	r = PQgetResult(pgsql_conn(L, 1));
+	profile_result(L, r);
+	if (r == NULL)
+		lua_pushnil(L);
+	else {
+		res = lua_newuserdata(L, sizeof(PGresult *));
+		*res = r;
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, 1);
+	}
+	return 1;
+}
+
+/*
+ * conn:cancel([timeout]) asks the server to abandon the current command.
+ * With libpq 17 or later, the request is sent over a non-blocking
+ * connection and given up after timeout milliseconds.
+ */
+static int
+conn_cancel(lua_State *L)
+{
+	PGconn *d;
+#if PG_VERSION_NUM >= 170000
+	PGcancelConn *cconn;
+	lua_Integer timeout;
+	int res;
+
+	d = pgsql_conn(L, 1);
+	timeout = luaL_optinteger(L, 2, -1);
+	cconn = PQcancelCreate(d);
+	if (cconn == NULL) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(d));
+		return 2;
+	}
+	if (timeout < 0)
+		res = PQcancelBlocking(cconn);
+	else if (!PQcancelStart(cconn))
+		res = 0;
+	else
+		res = cancel_wait(cconn, clock_ms() + timeout);
+	lua_pushboolean(L, res == 1);
+	if (res == 1) {
+		PQcancelFinish(cconn);
+		return 1;
+	}
+	if (res == -1)
+		lua_pushliteral(L, "timeout");
+	else
+		lua_pushstring(L, PQcancelErrorMessage(cconn));
+	PQcancelFinish(cconn);
+	return 2;
+#else
+	PGcancel *cancel;
+	char errbuf[256];
+	int res = 1;
+
+	d = pgsql_conn(L, 1);
+	cancel = PQgetCancel(d);
+	if (cancel != NULL) {
+		res = PQcancel(cancel, errbuf, sizeof errbuf);
+		if (!res) {
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, errbuf);
+		} else
+			lua_pushboolean(L, 1);
+		PQfreeCancel(cancel);
+	} else
+		lua_pushboolean(L, 0);
+	return res == 1 ? 1 : 2;
+#endif
+}
+
+/*
+ * conn:cancelStart() starts a cancel request and returns a cancel object
+ * which is driven with poll() from an event loop, like connectPoll().  On
+ * failure nil and an error message are returned.  libpq before version 17
+ * has no non-blocking cancel, there the request is sent with PQcancel(),
+ * which blocks until the server has received it, and the object returned
+ * is already complete.
+ */
+static int
+conn_cancelStart(lua_State *L)
+{
+	PGconn *d;
+	cancel *c;
+#if PG_VERSION_NUM < 170000
+	PGcancel *pgcancel;
+#endif
+
+	d = pgsql_conn(L, 1);
+	c = lua_newuserdata(L, sizeof(cancel));
+#if PG_VERSION_NUM >= 170000
+	c->cconn = PQcancelCreate(d);
+	if (c->cconn == NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(d));
+		return 2;
+	}
+	luaL_setmetatable(L, CANCEL_METATABLE);
+	if (!PQcancelStart(c->cconn)) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQcancelErrorMessage(c->cconn));
+		PQcancelFinish(c->cconn);
+		c->cconn = NULL;
+		return 2;
+	}
+#else
+	c->finished = 0;
+	c->ok = 0;
+	*c->errbuf = '\0';
+	luaL_setmetatable(L, CANCEL_METATABLE);
+	pgcancel = PQgetCancel(d);
+	if (pgcancel == NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(d));
+		return 2;
+	}
+	c->ok = PQcancel(pgcancel, c->errbuf, sizeof c->errbuf);
+	PQfreeCancel(pgcancel);
+#endif
+	return 1;
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * Pipeline mode
+ */
+static int
+conn_pipelineStatus(lua_State *L)
+{
+	lua_pushinteger(L, PQpipelineStatus(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_enterPipelineMode(lua_State *L)
+{
+	lua_pushboolean(L, PQenterPipelineMode(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_exitPipelineMode(lua_State *L)
+{
+	lua_pushboolean(L, PQexitPipelineMode(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_pipelineSync(lua_State *L)
+{
+	lua_pushboolean(L, PQpipelineSync(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_sendFlushRequest(lua_State *L)
+{
+	lua_pushboolean(L, PQsendFlushRequest(pgsql_conn(L, 1)));
+	return 1;
+}
+#endif
+
+#if PG_VERSION_NUM >= 90200
+static int
+conn_setSingleRowMode(lua_State *L)
+{
+	lua_pushboolean(L, PQsetSingleRowMode(pgsql_conn(L, 1)));
+	return 1;
+}
+#endif
+
+#if PG_VERSION_NUM >= 170000
+static int
+conn_setChunkedRowsMode(lua_State *L)
+{
+	lua_pushboolean(L, PQsetChunkedRowsMode(pgsql_conn(L, 1),
+	    luaL_checkinteger(L, 2)));
+	return 1;
+}
+#endif
+
+/*
+ * Asynchronous Notification Functions
+ */
+static int
+conn_notifies(lua_State *L)
+{
+	PGnotify **notify, *n;
+
+	n = PQnotifies(pgsql_conn(L, 1));
+	if (n == NULL)
+		lua_pushnil(L);
+	else {
+		notify = lua_newuserdata(L, sizeof(PGnotify *));
+		*notify = n;
+		luaL_setmetatable(L, NOTIFY_METATABLE);
+	}
+	return 1;
+}
+
+/*
+ * Commands associated with the COPY command
+ */
+static int
+conn_putCopyData(lua_State *L)
+{
+	const char *data;
+	size_t len;
+	int r;
+
+	data = luaL_checklstring(L, 2, &len);
+	r = PQputCopyData(pgsql_conn(L, 1), data, len);
+
+	if (r != -1)
+		lua_pushboolean(L, r);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int
+conn_putCopyEnd(lua_State *L)
+{
+	PGconn *conn;
+	int r;
+
+	conn = pgsql_conn(L, 1);
+	r = PQputCopyEnd(conn, luaL_optstring(L, 2, NULL));
+
+	if (r != -1)
+		lua_pushboolean(L, r);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int
+conn_getCopyData(lua_State *L)
+{
+	PGconn *conn;
+	int async, len;
+	char **data;
+
+	conn = pgsql_conn(L, 1);
+	async = lua_toboolean(L, 2);
+	data = gcmalloc(L, sizeof(char *));
+	len = PQgetCopyData(conn, data, async);
+	if (len > 0)
+		lua_pushlstring(L, *data, len);
+	else if (len == 0)	/* no data yet */
+		lua_pushboolean(L, 0);
+	else if (len == -1)	/* copy done */
+		lua_pushboolean(L, 1);
+	else			/* an error occurred */
+		lua_pushnil(L);
+	gcfree(data);
+	return 1;
+}
+
+/*
+ * Streaming between COPY and Lua file handles, the data never passes
+ * through Lua.
+ */
+#define COPY_BUFSIZE	65536
+
+/*
+ * Collect the results of a COPY, push the row count or nil and a message.
+ * errmsg must not point into the connection, collecting may overwrite it.
+ */
+static int
+copy_finish(lua_State *L, PGconn *conn, const char *errmsg)
+{
+	PGresult *res;
+	long long count = 0;
+	int failed = 0;
+
+	while ((res = PQgetResult(conn)) != NULL) {
+		if (PQresultStatus(res) == PGRES_COMMAND_OK)
+			count += strtoll(PQcmdTuples(res), NULL, 10);
+		else if (!failed) {
+			failed = 1;
+			lua_pushstring(L, PQresultErrorMessage(res));
+		}
+		PQclear(res);
+	}
+	if (errmsg != NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, errmsg);
+		return 2;
+	}
+	if (failed) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+/* Start a COPY, push nil and a message if it did not enter status */
+static int
+copy_start(lua_State *L, PGconn *conn, const char *command,
+    ExecStatusType status)
+{
+	PGresult *res;
+	ExecStatusType s;
+
+	res = PQexec(conn, command);
+	s = PQresultStatus(res);
+	if (s == status) {
+		PQclear(res);
+		return 0;
+	}
+	lua_pushnil(L);
+	if (res == NULL)
+		lua_pushstring(L, PQerrorMessage(conn));
+	else if (s == PGRES_FATAL_ERROR)
+		lua_pushstring(L, PQresultErrorMessage(res));
+	else
+		lua_pushstring(L, "command is not a matching COPY");
+	PQclear(res);
+
+	/* a COPY in the wrong direction must still be terminated */
+	if (s == PGRES_COPY_IN)
+		PQputCopyEnd(conn, "wrong COPY direction");
+	else if (s == PGRES_COPY_OUT) {
+		char *data;
+
+		while (PQgetCopyData(conn, &data, 0) > 0)
+			PQfreemem(data);
+	}
+	while ((res = PQgetResult(conn)) != NULL)
+		PQclear(res);
+	return 2;
+}
+
+static int
+conn_copyToFile(lua_State *L)
+{
+	PGconn *conn;
+	luaL_Stream *stream;
+	char *buf, *data;
+	const char *errmsg = NULL;
+	size_t fill = 0;
+	int len;
+
+	conn = pgsql_conn(L, 1);
+	stream = luaL_checkudata(L, 3, LUA_FILEHANDLE);
+	luaL_argcheck(L, stream->closef != NULL, 3, "file is closed");
+	buf = lua_newuserdata(L, COPY_BUFSIZE);
+
+	if (copy_start(L, conn, luaL_checkstring(L, 2), PGRES_COPY_OUT))
+		return 2;
+
+	/* rows are collected and written in large blocks */
+	while ((len = PQgetCopyData(conn, &data, 0)) > 0) {
+		if (errmsg == NULL && fill + len > COPY_BUFSIZE) {
+			if (fwrite(buf, 1, fill, stream->f) != fill)
+				errmsg = lua_pushstring(L, strerror(errno));
+			fill = 0;
+		}
+		if (errmsg != NULL)
+			;	/* drain the remaining rows */
+		else if (len > COPY_BUFSIZE) {
+			if (fwrite(data, 1, len, stream->f) != (size_t)len)
+				errmsg = lua_pushstring(L, strerror(errno));
+		} else {
+			memcpy(buf + fill, data, len);
+			fill += len;
+		}
+		PQfreemem(data);
+	}
+	if (errmsg == NULL && fill > 0 &&
+	    fwrite(buf, 1, fill, stream->f) != fill)
+		errmsg = lua_pushstring(L, strerror(errno));
+	if (len == -2 && errmsg == NULL)
+		errmsg = lua_pushstring(L, PQerrorMessage(conn));
+	return copy_finish(L, conn, errmsg);
+}
+
+static int
+conn_copyFromFile(lua_State *L)
+{
+	PGconn *conn;
+	luaL_Stream *stream;
+	lua_Integer bufsize;
+	const char *errmsg = NULL;
+	char *buf;
+	size_t len;
+	int r;
+
+	conn = pgsql_conn(L, 1);
+	stream = luaL_checkudata(L, 3, LUA_FILEHANDLE);
+	luaL_argcheck(L, stream->closef != NULL, 3, "file is closed");
+	bufsize = luaL_optinteger(L, 4, COPY_BUFSIZE);
+	luaL_argcheck(L, bufsize > 0 && bufsize <= INT_MAX, 4,
+	    "invalid buffer size");
+	buf = lua_newuserdata(L, bufsize);
+
+	if (copy_start(L, conn, luaL_checkstring(L, 2), PGRES_COPY_IN))
+		return 2;
+
+	while ((len = fread(buf, 1, bufsize, stream->f)) > 0) {
+		/* on a nonblocking connection, wait until the socket drains */
+		while ((r = PQputCopyData(conn, buf, len)) == 0)
+			if (wait_socket(PQsocket(conn), POLLOUT, -1) == -1)
+				break;
+		if (r != 1) {
+			errmsg = lua_pushstring(L, PQerrorMessage(conn));
+			break;
+		}
+	}
+	if (errmsg == NULL && ferror(stream->f))
+		errmsg = lua_pushstring(L, strerror(errno));
+	while ((r = PQputCopyEnd(conn, errmsg)) == 0)
+		if (wait_socket(PQsocket(conn), POLLOUT, -1) == -1)
+			break;
+	while (r == 1 && PQisnonblocking(conn) && PQflush(conn) == 1)
+		if (wait_socket(PQsocket(conn), POLLOUT, -1) == -1)
+			break;
+	if (r != 1 && errmsg == NULL)
+		errmsg = lua_pushstring(L, PQerrorMessage(conn));
+	return copy_finish(L, conn, errmsg);
+}
+
+/*
+ * Logical replication, the connection must have been opened with
+ * replication=database.
+ */
+#define PG_EPOCH_OFFSET	946684800	/* seconds from 1970 to 2000 */
+
+/* Convert a server timestamp, microseconds since 2000, to Unix time */
+static lua_Number
+pgsql_time(int64_t t)
+{
+	return (lua_Number)t / 1000000 + PG_EPOCH_OFFSET;
+}
+
+/* An LSN as integer or in the 'XXX/XXX' notation */
+static uint64_t
+pgsql_lsn(lua_State *L, int n)
+{
+	unsigned int hi, lo;
+
+	if (lua_type(L, n) == LUA_TNUMBER)
+		return (uint64_t)luaL_checkinteger(L, n);
+	if (sscanf(luaL_checkstring(L, n), "%X/%X", &hi, &lo) != 2)
+		luaL_argerror(L, n, "invalid LSN");
+	return (uint64_t)hi << 32 | lo;
+}
+
+/* Replace the string on top of the stack by its escaped form */
+static void
+repl_escape(lua_State *L, PGconn *conn, int identifier)
+{
+	const char *v;
+	char *s;
+	size_t len;
+
+	v = lua_tolstring(L, -1, &len);
+	s = identifier ? PQescapeIdentifier(conn, v, len) :
+	    PQescapeLiteral(conn, v, len);
+	if (s == NULL)
+		luaL_error(L, "%s", PQerrorMessage(conn));
+	lua_pop(L, 1);
+	lua_pushstring(L, s);
+	PQfreemem(s);
+}
+
+/* conn:startReplication(slot, lsn [, opts]) */
+static int
+conn_startReplication(lua_State *L)
+{
+	PGconn *conn;
+	replication *r;
+	uint64_t lsn;
+	char pos[32];
+	int cmd, first = 1, interval = 10000, confirm = 0;
+
+	conn = pgsql_conn(L, 1);
+	luaL_checkstring(L, 2);
+	lsn = pgsql_lsn(L, 3);
+	lua_settop(L, 4);
+	if (!lua_isnil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		if (lua_getfield(L, 4, "feedback") != LUA_TNIL)
+			interval = luaL_checkinteger(L, -1);
+		lua_getfield(L, 4, "confirm");
+		confirm = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+
+	lua_pushvalue(L, 2);
+	repl_escape(L, conn, 1);
+	snprintf(pos, sizeof pos, "%X/%X", (unsigned int)(lsn >> 32),
+	    (unsigned int)lsn);
+	lua_pushfstring(L, "START_REPLICATION SLOT %s LOGICAL %s",
+	    lua_tostring(L, -1), pos);
+	lua_remove(L, -2);
+	cmd = lua_gettop(L);
+
+	/* plugin options, e.g. proto_version and publication_names */
+	if (lua_istable(L, 4) &&
+	    lua_getfield(L, 4, "options") != LUA_TNIL) {
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			if (lua_type(L, -2) != LUA_TSTRING)
+				return luaL_error(L, "option names must be "
+				    "strings");
+			lua_pushvalue(L, cmd);
+			lua_pushstring(L, first ? " (" : ", ");
+			lua_pushvalue(L, -4);
+			repl_escape(L, conn, 1);
+			lua_pushliteral(L, " ");
+			luaL_tolstring(L, -5, NULL);
+			repl_escape(L, conn, 0);
+			lua_concat(L, 5);
+			lua_replace(L, cmd);
+			lua_pop(L, 1);
+			first = 0;
+		}
+		if (!first) {
+			lua_pushvalue(L, cmd);
+			lua_pushliteral(L, ")");
+			lua_concat(L, 2);
+			lua_replace(L, cmd);
+		}
+	}
+	lua_settop(L, cmd);
+
+	if (copy_start(L, conn, lua_tostring(L, cmd), PGRES_COPY_BOTH))
+		return 2;
+
+	r = lua_newuserdata(L, sizeof(replication));
+	r->received = r->flushed = lsn;
+	r->feedback = clock_ms();
+	r->interval = interval;
+	r->confirm = confirm;
+	r->done = 0;
+	res_setconn(L, 1);
+	luaL_setmetatable(L, REPL_METATABLE);
+	return 1;
+}
+
+/*
+ * Control functions
+ */
+static int
+conn_clientEncoding(lua_State *L)
+{
+	lua_pushstring(L,
+	    pg_encoding_to_char(PQclientEncoding(pgsql_conn(L, 1))));
+	return 1;
+}
+
+static int
+conn_setClientEncoding(lua_State *L)
+{
+	if (PQsetClientEncoding(pgsql_conn(L, 1), luaL_checkstring(L, 2)))
+		lua_pushboolean(L, 0);
+	else
+		lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+conn_setErrorVerbosity(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQsetErrorVerbosity(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
+	return 1;
+}
+
+static int
+closef_untrace(lua_State *L)
+{
+	PGconn *conn;
+	lua_CFunction cf;
+
+	luaL_checkudata(L, 1, LUA_FILEHANDLE);
+
+	/* untrace so libpq doesn't segfault */
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "PGconn");
+	conn = pgsql_conn(L, -1);
+	lua_getfield(L, -2, "old_uservalue");
+	lua_getfield(L, -3, "old_closef");
+
+	cf = lua_tocfunction(L, -1);
+	lua_pop(L, 1);
+	lua_setuservalue(L, 1);
+
+	PQuntrace(conn);
+
+	/* let go of PGconn's reference to file handle */
+	lua_getuservalue(L, -1);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "trace_file");
+
+	/* pop stream uservalue, PGconn, PGconn uservalue */
+	lua_pop(L, 3);
+
+	/* call original close function */
+	return (*cf)(L);
+}
+
+static int
+conn_trace(lua_State *L)
+{
+	PGconn *conn;
+	luaL_Stream *stream;
+
+	conn = pgsql_conn(L, 1);
+	stream = luaL_checkudata(L, 2, LUA_FILEHANDLE);
+	luaL_argcheck(L, stream->f != NULL, 2, "invalid file handle");
+	lua_getuservalue(L, 1);
+	trace_release(L, lua_gettop(L));
+	lua_pop(L, 1);
+
+	/*
+	 * Keep a reference to the file object in uservalue of connection
+	 * so it doesn't get garbage collected.
+	 */
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, "trace_file");
+
+	/*
+	 * Swap out closef luaL_Stream member for our wrapper that will
+	 * untrace.
+	 */
+	lua_createtable(L, 0, 3);
+	lua_getuservalue(L, 2);
+	lua_setfield(L, -2, "old_uservalue");
+	lua_pushcfunction(L, stream->closef);
+	lua_setfield(L, -2, "old_closef");
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "PGconn");
+	lua_setuservalue(L, 2);
+	stream->closef = closef_untrace;
+
+	PQtrace(conn, stream->f);
+	return 0;
+}
+
+static int
+conn_untrace(lua_State *L)
+{
+	PQuntrace(pgsql_conn(L, 1));
+
+	/* Let go of PGconn's reference to file handle. */
+	lua_getuservalue(L, 1);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "trace_file");
+	trace_release(L, lua_gettop(L));
+
+	return 0;
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * In-memory protocol trace
+ *
+ * conn:traceRing([size]) records the direction, type, length and time
+ * of every protocol message in a ring of size entries, conn:traceSnapshot()
+ * returns the most recent ones.  The message names are those printed by
+ * PQtrace().
+ */
+static const struct {
+	char		 dir;
+	char		 type;
+	const char	*name;
+} trace_msgs[] = {
+	{ 0, 0, "Unknown" },
+	{ 'B', 'R', "Authentication" },
+	{ 'B', 'K', "BackendKeyData" },
+	{ 'B', '2', "BindComplete" },
+	{ 'B', '3', "CloseComplete" },
+	{ 'B', 'C', "CommandComplete" },
+	{ 'B', 'd', "CopyData" },
+	{ 'B', 'c', "CopyDone" },
+	{ 'B', 'G', "CopyInResponse" },
+	{ 'B', 'H', "CopyOutResponse" },
+	{ 'B', 'W', "CopyBothResponse" },
+	{ 'B', 'D', "DataRow" },
+	{ 'B', 'I', "EmptyQueryResponse" },
+	{ 'B', 'E', "ErrorResponse" },
+	{ 'B', 'V', "FunctionCallResponse" },
+	{ 'B', 'v', "NegotiateProtocolVersion" },
+	{ 'B', 'n', "NoData" },
+	{ 'B', 'N', "NoticeResponse" },
+	{ 'B', 'A', "NotificationResponse" },
+	{ 'B', 't', "ParameterDescription" },
+	{ 'B', 'S', "ParameterStatus" },
+	{ 'B', '1', "ParseComplete" },
+	{ 'B', 's', "PortalSuspended" },
+	{ 'B', 'Z', "ReadyForQuery" },
+	{ 'B', 'T', "RowDescription" },
+	{ 'F', 'B', "Bind" },
+	{ 'F', 'C', "Close" },
+	{ 'F', 'd', "CopyData" },
+	{ 'F', 'c', "CopyDone" },
+	{ 'F', 'f', "CopyFail" },
+	{ 'F', 'D', "Describe" },
+	{ 'F', 'E', "Execute" },
+	{ 'F', 'F', "FunctionCall" },
+	{ 'F', 'H', "Flush" },
+	{ 'F', 'p', "PasswordMessage" },
+	{ 'F', 'p', "SASLInitialResponse" },
+	{ 'F', 'p', "SASLResponse" },
+	{ 'F', 'p', "GSSResponse" },
+	{ 'F', 'P', "Parse" },
+	{ 'F', 'Q', "Query" },
+	{ 'F', 'S', "Sync" },
+	{ 'F', 'X', "Terminate" },
+	{ 'F', 0, "StartupMessage" },
+	{ 'F', 0, "SSLRequest" },
+	{ 'F', 0, "GSSENCRequest" },
+	{ 'F', 0, "CancelRequest" }
+};
+
+/* Record the message of a complete trace line, "F\t54\tQuery\t..." */
+static void
+trace_record(tracering *r)
+{
+	traceent *e;
+	char *p, *name;
+	size_t n, len;
+
+	r->head[r->headlen < (int)sizeof r->head ? r->headlen :
+	    (int)sizeof r->head - 1] = '\0';
+	e = &r->ents[r->total++ % r->size];
+	e->time = clock_us();
+	e->dir = r->head[0];
+	e->msg = 0;
+	e->length = strtol(r->head + 1, &p, 10);
+	if (*p != '\t')
+		return;
+	name = p + 1;
+	len = strcspn(name, "\t");
+	for (n = 1; n < sizeof trace_msgs / sizeof trace_msgs[0]; n++)
+		if (trace_msgs[n].dir == e->dir &&
+		    strlen(trace_msgs[n].name) == len &&
+		    !strncmp(trace_msgs[n].name, name, len)) {
+			e->msg = n;
+			break;
+		}
+}
+
+static size_t
+trace_append(tracering *r, const char *buf, size_t size)
+{
+	const char *p = buf, *end = buf + size, *nl;
+	size_t len;
+
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		len = (nl != NULL ? nl : end) - p;
+		if ((size_t)r->headlen < sizeof r->head) {
+			if (len > sizeof r->head - r->headlen)
+				len = sizeof r->head - r->headlen;
+			memcpy(r->head + r->headlen, p, len);
+			r->headlen += len;
+		}
+		if (nl == NULL)
+			break;
+		trace_record(r);
+		r->headlen = 0;
+		p = nl + 1;
+	}
+	return size;
+}
+
+#ifdef __linux__
+static ssize_t
+trace_write(void *cookie, const char *buf, size_t size)
+{
+	return trace_append(cookie, buf, size);
+}
+#else
+static int
+trace_write(void *cookie, const char *buf, int size)
+{
+	return trace_append(cookie, buf, size);
+}
+#endif
+
+/* Stop tracing into the ring, the connection may already be finished */
+static int
+tracering_close(lua_State *L)
+{
+	tracering *r = luaL_checkudata(L, 1, TRACERING_METATABLE);
+
+	if (r->conn != NULL && *r->conn != NULL)
+		PQuntrace(*r->conn);
+	r->conn = NULL;
+	if (r->fp != NULL) {
+		fclose(r->fp);
+		r->fp = NULL;
+	}
+	return 0;
+}
+
+static int
+conn_traceRing(lua_State *L)
+{
+	PGconn **conn;
+	tracering *r;
+	lua_Integer size;
+#ifdef __linux__
+	cookie_io_functions_t io = { NULL, trace_write, NULL, NULL };
+#endif
+
+	pgsql_conn(L, 1);
+	conn = lua_touserdata(L, 1);
+	size = luaL_optinteger(L, 2, 1024);
+	luaL_argcheck(L, size > 0 && size <= INT_MAX / (lua_Integer)
+	    sizeof(traceent), 2, "invalid ring size");
+	lua_getuservalue(L, 1);
+	trace_release(L, lua_gettop(L));
+
+	r = lua_newuserdata(L, sizeof(tracering) + size * sizeof(traceent));
+	r->conn = NULL;
+	r->total = 0;
+	r->size = size;
+	r->headlen = 0;
+#ifdef __linux__
+	r->fp = fopencookie(r, "w", io);
+#else
+	r->fp = funopen(r, NULL, trace_write, NULL, NULL);
+#endif
+	luaL_setmetatable(L, TRACERING_METATABLE);
+	if (r->fp == NULL)
+		return luaL_error(L, "%s", strerror(errno));
+
+	/* a line is passed on as soon as it is complete */
+	setvbuf(r->fp, NULL, _IOLBF, BUFSIZ);
+	lua_setfield(L, -2, "trace_ring");
+	r->conn = conn;
+	PQtrace(*conn, r->fp);
+	PQsetTraceFlags(*conn, PQTRACE_SUPPRESS_TIMESTAMPS);
+	return 0;
+}
+
+/* conn:traceSnapshot([n]) returns the last n entries, oldest first */
+static int
+conn_traceSnapshot(lua_State *L)
+{
+	tracering *r;
+	traceent *e;
+	lua_Integer n, count, i;
+
+	pgsql_conn(L, 1);
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "trace_ring");
+	r = luaL_testudata(L, -1, TRACERING_METATABLE);
+	count = r == NULL ? 0 : r->total < r->size ? r->total : r->size;
+	n = luaL_optinteger(L, 2, count);
+	if (n < 0 || n > count)
+		n = count;
+
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		e = &r->ents[(r->total - n + i) % r->size];
+		lua_createtable(L, 0, 5);
+		lua_pushlstring(L, &e->dir, 1);
+		lua_setfield(L, -2, "dir");
+		if (trace_msgs[e->msg].type) {
+			lua_pushlstring(L, &trace_msgs[e->msg].type, 1);
+			lua_setfield(L, -2, "type");
+		}
+		lua_pushstring(L, trace_msgs[e->msg].name);
+		lua_setfield(L, -2, "name");
+		lua_pushinteger(L, e->length);
+		lua_setfield(L, -2, "length");
+		lua_pushinteger(L, e->time);
+		lua_setfield(L, -2, "time");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushinteger(L, r == NULL ? 0 : r->total);
+	return 2;
+}
+#endif
+
+/* Stop tracing into the ring, if there is one */
+static void
+trace_release(lua_State *L, int uv)
+{
+#if PG_VERSION_NUM >= 140000
+	if (lua_getfield(L, uv, "trace_ring") == LUA_TUSERDATA) {
+		lua_pushcfunction(L, tracering_close);
+		lua_insert(L, -2);
+		lua_call(L, 1, 0);
+		lua_pushnil(L);
+		lua_setfield(L, uv, "trace_ring");
+	} else
+		lua_pop(L, 1);
+#endif
+}
+
+/*
+ * Miscellaneous Functions
+ */
+static int
+conn_consumeInput(lua_State *L)
+{
+	lua_pushboolean(L, PQconsumeInput(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_isBusy(lua_State *L)
+{
+	lua_pushboolean(L, PQisBusy(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_setnonblocking(lua_State *L)
+{
+	int r;
+
+	r = PQsetnonblocking(pgsql_conn(L, 1), lua_toboolean(L, 2));
+	lua_pushboolean(L, !r);
+	return 1;
+}
+
+static int
+conn_isnonblocking(lua_State *L)
+{
+	lua_pushboolean(L, PQisnonblocking(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_flush(lua_State *L)
+{
+	int r;
+
+	r = PQflush(pgsql_conn(L, 1));
+
+	if (r >= 0)
+		lua_pushboolean(L, r == 0);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+#if PG_VERSION_NUM >= 100000
+static int
+conn_encryptPassword(lua_State *L)
+{
+	const char *algorithm = NULL;
+	char **pw;
+
+	if (lua_isstring(L, 4))
+		algorithm = lua_tostring(L, 4);
+
+	pw = gcmalloc(L, sizeof(char *));
+	*pw = PQencryptPasswordConn(pgsql_conn(L, 1), luaL_checkstring(L, 2),
+	    luaL_checkstring(L, 3), algorithm);
+	if (*pw) {
+		lua_pushstring(L, *pw);
+		gcfree(pw);
+	} else
+		lua_pushnil(L);
+	return 1;
+}
+#endif
+
+/*
+ * Type catalogue cache
+ *
+ * The relevant parts of pg_type and pg_attribute are loaded once per
+ * connection and kept in the "types" field of the connection's uservalue.
+ * The table is indexed by type OID, by qualified type name and by
+ * unqualified type name.  Each entry is a table with the fields oid, name,
+ * namespace, type, category, elem, base, relid, array, len and, for
+ * composite types, attrs, an array of { name = ..., type = ... } tables.
+ * For domains, base is the OID of the ultimate base type.
+ */
+#define TYPES_QUERY \
+	"SELECT t.oid, t.typname, n.nspname, t.typtype, t.typcategory, " \
+	"t.typelem, t.typbasetype, t.typrelid, t.typarray, t.typlen " \
+	"FROM pg_catalog.pg_type t " \
+	"JOIN pg_catalog.pg_namespace n ON n.oid = t.typnamespace"
+
+#define ATTRS_QUERY \
+	"SELECT a.attrelid, a.attname, a.atttypid " \
+	"FROM pg_catalog.pg_attribute a " \
+	"JOIN pg_catalog.pg_type t ON t.typrelid = a.attrelid " \
+	"WHERE t.typtype = 'c' AND a.attnum > 0 AND NOT a.attisdropped " \
+	"ORDER BY a.attrelid, a.attnum"
+
+static PGresult **
+types_query(lua_State *L, PGconn *conn, const char *query)
+{
+	PGresult **res;
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = PQexec(conn, query);
+	luaL_setmetatable(L, RES_METATABLE);
+	if (PQresultStatus(*res) != PGRES_TUPLES_OK) {
+		lua_pushstring(L, *res != NULL ? PQresultErrorMessage(*res) :
+		    PQerrorMessage(conn));
+		return NULL;
+	}
+	return res;
+}
+
+/*
+ * Load the type catalogue and leave it on the stack.  On error, the error
+ * message is left on the stack and 0 is returned.
+ */
+static int
+types_load(lua_State *L, PGconn *conn)
+{
+	PGresult **res;
+	const char *name, *nspname;
+	Oid oid, base;
+	int row, types, rels, n;
+
+	lua_newtable(L);
+	types = lua_gettop(L);
+	lua_newtable(L);
+	rels = lua_gettop(L);
+
+	if ((res = types_query(L, conn, TYPES_QUERY)) == NULL)
+		return 0;
+
+	for (row = 0; row < PQntuples(*res); row++) {
+		oid = strtoul(PQgetvalue(*res, row, 0), NULL, 10);
+		name = PQgetvalue(*res, row, 1);
+		nspname = PQgetvalue(*res, row, 2);
+
+		lua_createtable(L, 0, 11);
+		lua_pushinteger(L, oid);
+		lua_setfield(L, -2, "oid");
+		lua_pushstring(L, name);
+		lua_setfield(L, -2, "name");
+		lua_pushstring(L, nspname);
+		lua_setfield(L, -2, "namespace");
+		lua_pushstring(L, PQgetvalue(*res, row, 3));
+		lua_setfield(L, -2, "type");
+		lua_pushstring(L, PQgetvalue(*res, row, 4));
+		lua_setfield(L, -2, "category");
+		lua_pushinteger(L, strtoul(PQgetvalue(*res, row, 5), NULL, 10));
+		lua_setfield(L, -2, "elem");
+		lua_pushinteger(L, strtoul(PQgetvalue(*res, row, 6), NULL, 10));
+		lua_setfield(L, -2, "base");
+		lua_pushinteger(L, strtoul(PQgetvalue(*res, row, 7), NULL, 10));
+		lua_setfield(L, -2, "relid");
+		lua_pushinteger(L, strtoul(PQgetvalue(*res, row, 8), NULL, 10));
+		lua_setfield(L, -2, "array");
+		lua_pushinteger(L, atoi(PQgetvalue(*res, row, 9)));
+		lua_setfield(L, -2, "len");
+
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, types, oid);
+
+		lua_pushfstring(L, "%s.%s", nspname, name);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, types);
+
+		/*
+		 * Unqualified names resolve to pg_catalog, then public, then
+		 * whatever schema was seen first.
+		 */
+		lua_getfield(L, types, name);
+		if (lua_isnil(L, -1) || !strcmp(nspname, "pg_catalog") ||
+		    (!strcmp(nspname, "public") &&
+		    lua_getfield(L, -1, "namespace") == LUA_TSTRING &&
+		    strcmp(lua_tostring(L, -1), "pg_catalog"))) {
+			lua_settop(L, rels + 2);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, types, name);
+		}
+		lua_settop(L, rels + 2);
+
+		if (*PQgetvalue(*res, row, 3) == 'c')
+			lua_rawseti(L, rels,
+			    strtoul(PQgetvalue(*res, row, 7), NULL, 10));
+		else
+			lua_pop(L, 1);
+	}
+
+	/* Resolve domains over domains to their ultimate base type */
+	for (row = 0; row < PQntuples(*res); row++) {
+		base = strtoul(PQgetvalue(*res, row, 6), NULL, 10);
+		if (base == InvalidOid)
+			continue;
+		for (n = 0; n < 32; n++) {
+			lua_rawgeti(L, types, base);
+			if (!lua_istable(L, -1) ||
+			    lua_getfield(L, -1, "base") != LUA_TNUMBER ||
+			    lua_tointeger(L, -1) == 0) {
+				lua_pop(L, 2);
+				break;
+			}
+			base = lua_tointeger(L, -1);
+			lua_pop(L, 2);
+		}
+		lua_rawgeti(L, types, strtoul(PQgetvalue(*res, row, 0), NULL,
+		    10));
+		lua_pushinteger(L, base);
+		lua_setfield(L, -2, "base");
+		lua_pop(L, 1);
+	}
+	PQclear(*res);
+	*res = NULL;
+	lua_pop(L, 1);
+
+	if ((res = types_query(L, conn, ATTRS_QUERY)) == NULL)
+		return 0;
+
+	for (row = 0; row < PQntuples(*res); row++) {
+		if (lua_rawgeti(L, rels, strtoul(PQgetvalue(*res, row, 0),
+		    NULL, 10)) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			continue;
+		}
+		if (lua_getfield(L, -1, "attrs") != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, -3, "attrs");
+		}
+		lua_createtable(L, 0, 2);
+		lua_pushstring(L, PQgetvalue(*res, row, 1));
+		lua_setfield(L, -2, "name");
+		lua_pushinteger(L, strtoul(PQgetvalue(*res, row, 2), NULL, 10));
+		lua_setfield(L, -2, "type");
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_pop(L, 2);
+	}
+	PQclear(*res);
+	*res = NULL;
+	lua_settop(L, types);
+	return 1;
+}
+
+/*
+ * Push the type catalogue of the connection at index conn, loading it
+ * on first use.  On error, the error message is pushed and 0 is returned.
+ */
+static int
+pgsql_types(lua_State *L, int conn)
+{
+	PGconn *d;
+	PGTransactionStatusType status;
+
+	conn = lua_absindex(L, conn);
+	d = pgsql_conn(L, conn);
+
+	lua_getuservalue(L, conn);
+	if (lua_getfield(L, -1, "types") == LUA_TTABLE) {
+		lua_remove(L, -2);
+		return 1;
+	}
+	lua_pop(L, 2);
+
+	status = PQtransactionStatus(d);
+	if (status == PQTRANS_UNKNOWN) {
+		lua_pushstring(L, PQerrorMessage(d));
+		return 0;
+	} else if (status != PQTRANS_IDLE && status != PQTRANS_INTRANS) {
+		lua_pushliteral(L, "connection is busy, can not load types");
+		return 0;
+	}
+	if (!types_load(L, d))
+		return 0;
+
+	lua_getuservalue(L, conn);
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, "types");
+	lua_pop(L, 1);
+	return 1;
+}
+
+static void
+types_invalidate(lua_State *L, int conn)
+{
+	lua_getuservalue(L, conn);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "types");
+	lua_pop(L, 1);
+}
+
+static int
+conn_loadTypes(lua_State *L)
+{
+	pgsql_conn(L, 1);
+	types_invalidate(L, 1);
+	if (!pgsql_types(L, 1)) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+conn_typeInfo(lua_State *L)
+{
+	luaL_checkany(L, 2);
+	if (!pgsql_types(L, 1)) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+static int
+conn_clearTypes(lua_State *L)
+{
+	pgsql_conn(L, 1);
+	types_invalidate(L, 1);
+	return 0;
+}
+
+/*
+ * Value conversion
+ *
+ * Values are converted according to their kind, which is derived from the
+ * type OID, using the type catalogue for domains, enums, composite types
+ * and arrays.  Binary values are in network byte order.
+ */
+static uint16_t
+get16(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (uint16_t)u[0] << 8 | u[1];
+}
+
+static uint32_t
+get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 |
+	    (uint32_t)u[2] << 8 | u[3];
+}
+
+static uint64_t
+get64(const char *p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static void
+buf_reserve(lua_State *L, pgbuf *b, size_t n)
+{
+	size_t size;
+	char *data;
+
+	if (b->len + n <= b->size)
+		return;
+	size = b->size ? b->size * 2 : 256;
+	while (size < b->len + n)
+		size *= 2;
+	if ((data = realloc(b->data, size)) == NULL)
+		luaL_error(L, "out of memory");
+	b->data = data;
+	b->size = size;
+}
+
+static void
+buf_add(lua_State *L, pgbuf *b, const void *p, size_t n)
+{
+	buf_reserve(L, b, n);
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+static void
+buf_add16(lua_State *L, pgbuf *b, uint16_t v)
+{
+	unsigned char u[2] = { v >> 8, v };
+
+	buf_add(L, b, u, sizeof u);
+}
+
+static void
+buf_add32(lua_State *L, pgbuf *b, uint32_t v)
+{
+	unsigned char u[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	buf_add(L, b, u, sizeof u);
+}
+
+static void
+buf_add64(lua_State *L, pgbuf *b, uint64_t v)
+{
+	buf_add32(L, b, v >> 32);
+	buf_add32(L, b, v);
+}
+
+static void
+buf_set32(pgbuf *b, size_t off, uint32_t v)
+{
+	unsigned char *u = (unsigned char *)b->data + off;
+
+	u[0] = v >> 24;
+	u[1] = v >> 16;
+	u[2] = v >> 8;
+	u[3] = v;
+}
+
+/* The buffer memory is freed by the garbage collector */
+static pgbuf *
+buf_new(lua_State *L)
+{
+	pgbuf *b;
+
+	b = gcmalloc(L, sizeof(pgbuf));
+	b->len = b->size = 0;
+	return b;
+}
+
+/*
+ * Determine the kind of a type.  Domains are resolved to their base type,
+ * *oid is updated accordingly.  types is the stack index of the type
+ * catalogue or 0 if only built-in types are to be considered.
+ */
+static int
+type_kind(lua_State *L, int types, Oid *oid)
+{
+	int kind = KIND_OTHER;
+
+	switch (*oid) {
+	case BOOLOID:
+		return KIND_BOOL;
+	case INT2OID:
+		return KIND_INT2;
+	case INT4OID:
+		return KIND_INT4;
+	case INT8OID:
+		return KIND_INT8;
+	case OIDOID:
+		return KIND_OID;
+	case FLOAT4OID:
+		return KIND_FLOAT4;
+	case FLOAT8OID:
+		return KIND_FLOAT8;
+	case NUMERICOID:
+		return KIND_NUMERIC;
+	case TEXTOID:
+	case VARCHAROID:
+	case BPCHAROID:
+	case NAMEOID:
+	case CHAROID:
+	case JSONOID:
+	case XMLOID:
+	case UNKNOWNOID:
+		return KIND_TEXT;
+	case BYTEAOID:
+		return KIND_BYTEA;
+	case JSONBOID:
+		return KIND_JSONB;
+	case RECORDOID:
+		return KIND_RECORD;
+	}
+	if (types == 0)
+		return KIND_OTHER;
+
+	if (lua_rawgeti(L, types, *oid) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return KIND_OTHER;
+	}
+	lua_getfield(L, -1, "type");
+	switch (*lua_tostring(L, -1)) {
+	case 'c':
+		kind = KIND_RECORD;
+		break;
+	case 'e':
+		kind = KIND_TEXT;
+		break;
+	case 'd':
+		lua_getfield(L, -2, "base");
+		*oid = lua_tointeger(L, -1);
+		lua_pop(L, 3);
+		return type_kind(L, types, oid);
+	case 'b':
+		lua_getfield(L, -2, "category");
+		lua_getfield(L, -3, "elem");
+		if (*lua_tostring(L, -2) == 'A' && lua_tointeger(L, -1) != 0)
+			kind = KIND_ARRAY;
+		lua_pop(L, 2);
+		break;
+	}
+	lua_pop(L, 2);
+	return kind;
+}
+
+/* Push the attributes of a composite type, return 0 if there are none */
+static int
+type_attrs(lua_State *L, int types, Oid oid)
+{
+	if (types == 0 || oid == RECORDOID)
+		return 0;
+	if (lua_rawgeti(L, types, oid) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	if (lua_getfield(L, -1, "attrs") != LUA_TTABLE) {
+		lua_pop(L, 2);
+		return 0;
+	}
+	lua_remove(L, -2);
+	return 1;
+}
+
+static Oid
+type_elem(lua_State *L, int types, Oid oid)
+{
+	Oid elem = InvalidOid;
+
+	if (lua_rawgeti(L, types, oid) == LUA_TTABLE) {
+		lua_getfield(L, -1, "elem");
+		elem = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return elem;
+}
+
+static void decode_kind(lua_State *, int, int, Oid, int, const char *, int);
+
+static void
+pgsql_decode(lua_State *L, int types, Oid oid, int format, const char *value,
+    int len)
+{
+	int kind;
+
+	kind = type_kind(L, types, &oid);
+	decode_kind(L, types, kind, oid, format, value, len);
+}
+
+#define NUMERIC_POS	0x0000
+#define NUMERIC_NEG	0x4000
+#define NUMERIC_NAN	0xc000
+#define NUMERIC_PINF	0xd000
+#define NUMERIC_NINF	0xf000
+
+/* Convert a binary numeric to its decimal text representation */
+static void
+numeric_decode(lua_State *L, const char *p, int len)
+{
+	luaL_Buffer b;
+	char digits[8];
+	int ndigits, weight, sign, dscale, d, i, n;
+
+	if (len < 8)
+		luaL_error(L, "malformed numeric value");
+	ndigits = (int16_t)get16(p);
+	weight = (int16_t)get16(p + 2);
+	sign = get16(p + 4);
+	dscale = (int16_t)get16(p + 6);
+	if (ndigits < 0 || len < 8 + 2 * ndigits)
+		luaL_error(L, "malformed numeric value");
+	p += 8;
+
+	switch (sign) {
+	case NUMERIC_NAN:
+		lua_pushliteral(L, "NaN");
+		return;
+	case NUMERIC_PINF:
+		lua_pushliteral(L, "Infinity");
+		return;
+	case NUMERIC_NINF:
+		lua_pushliteral(L, "-Infinity");
+		return;
+	}
+
+	luaL_buffinit(L, &b);
+	if (sign == NUMERIC_NEG)
+		luaL_addchar(&b, '-');
+	if (weight < 0)
+		luaL_addchar(&b, '0');
+	for (d = 0; d <= weight; d++) {
+		n = d < ndigits ? get16(p + 2 * d) : 0;
+		snprintf(digits, sizeof digits, d > 0 ? "%04d" : "%d", n);
+		luaL_addstring(&b, digits);
+	}
+	if (dscale > 0) {
+		luaL_addchar(&b, '.');
+		for (d = weight + 1, i = 0; i < dscale; d++, i += 4) {
+			n = d >= 0 && d < ndigits ? get16(p + 2 * d) : 0;
+			snprintf(digits, sizeof digits, "%04d", n);
+			luaL_addlstring(&b, digits, dscale - i < 4 ?
+			    dscale - i : 4);
+		}
+	}
+	luaL_pushresult(&b);
+}
+
+/*
+ * Format a float with the fewest significant digits that read back as the
+ * same value, "%.17g" would turn 0.1 into 0.10000000000000001.
+ */
+static void
+format_number(char *num, size_t size, lua_Number n)
+{
+	int prec;
+
+	for (prec = 15; prec < 17; prec++) {
+		snprintf(num, size, "%.*g", prec, (double)n);
+		if (strtod(num, NULL) == (double)n)
+			return;
+	}
+	snprintf(num, size, "%.17g", (double)n);
+}
+
+/* Encode a Lua number or numeric string as binary numeric */
+static void
+numeric_encode(lua_State *L, int idx, pgbuf *b)
+{
+	char num[64], *digits;
+	const char *s;
+	size_t len;
+	int n, dp, neg, padl, ngroups, weight, dscale, first, last, g, k;
+	long e;
+
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		if (lua_isinteger(L, idx))
+			snprintf(num, sizeof num, LUA_INTEGER_FMT,
+			    lua_tointeger(L, idx));
+		else
+			format_number(num, sizeof num, lua_tonumber(L, idx));
+		s = num;
+		len = strlen(num);
+	} else if ((s = lua_tolstring(L, idx, &len)) == NULL)
+		luaL_error(L, "numeric value expected, got %s",
+		    luaL_typename(L, idx));
+
+	while (*s == ' ')
+		s++;
+	neg = 0;
+	if (*s == '-' || *s == '+')
+		neg = *s++ == '-';
+	if (!strcasecmp(s, "nan")) {
+		buf_add64(L, b, (uint64_t)NUMERIC_NAN << 16);
+		return;
+	}
+	if (!strcasecmp(s, "inf") || !strcasecmp(s, "infinity")) {
+		buf_add64(L, b,
+		    (uint64_t)(neg ? NUMERIC_NINF : NUMERIC_PINF) << 16);
+		return;
+	}
+
+	/* Collect the digits, dp is the position of the decimal point */
+	digits = lua_newuserdata(L, len + 8);
+	n = 0;
+	dp = -1;
+	for (; *s; s++) {
+		if (*s >= '0' && *s <= '9')
+			digits[n++] = *s - '0';
+		else if (*s == '.' && dp == -1)
+			dp = n;
+		else
+			break;
+	}
+	if (dp == -1)
+		dp = n;
+	if (*s == 'e' || *s == 'E') {
+		e = strtol(s + 1, (char **)&s, 10);
+		if (e > 1000 || e < -1000)
+			luaL_error(L, "numeric exponent out of range");
+		dp += e;
+	}
+	while (*s == ' ')
+		s++;
+	if (n == 0 || *s != '\0')
+		luaL_error(L, "invalid numeric value '%s'",
+		    lua_tostring(L, idx));
+	dscale = n - dp > 0 ? n - dp : 0;
+
+	/* Align the digits to base 10000 groups around the decimal point */
+	padl = (4 - ((dp % 4) + 4) % 4) % 4;
+	ngroups = (padl + n + 3) / 4;
+	weight = (dp + padl) / 4 - 1;
+
+	/* Strip leading and trailing zero groups */
+	for (first = 0; first < ngroups; first++) {
+		for (g = 0, k = 0; k < 4; k++) {
+			int i = first * 4 + k - padl;
+			g = g * 10 + (i >= 0 && i < n ? digits[i] : 0);
+		}
+		if (g)
+			break;
+		weight--;
+	}
+	for (last = ngroups - 1; last >= first; last--) {
+		for (g = 0, k = 0; k < 4; k++) {
+			int i = last * 4 + k - padl;
+			g = g * 10 + (i >= 0 && i < n ? digits[i] : 0);
+		}
+		if (g)
+			break;
+	}
+	if (first > last) {
+		weight = 0;
+		neg = 0;
+	}
+	buf_add16(L, b, first > last ? 0 : last - first + 1);
+	buf_add16(L, b, weight);
+	buf_add16(L, b, neg ? NUMERIC_NEG : NUMERIC_POS);
+	buf_add16(L, b, dscale);
+	for (; first <= last; first++) {
+		for (g = 0, k = 0; k < 4; k++) {
+			int i = first * 4 + k - padl;
+			g = g * 10 + (i >= 0 && i < n ? digits[i] : 0);
+		}
+		buf_add16(L, b, g);
+	}
+	lua_pop(L, 1);
+}
+
+static void
+record_decode_binary(lua_State *L, int types, Oid oid, const char *p,
+    int len)
+{
+	const char *end = p + len;
+	Oid aoid;
+	int attrs, n, i, alen;
+
+	if (len < 4)
+		luaL_error(L, "malformed record value");
+	n = get32(p);
+	p += 4;
+
+	luaL_checkstack(L, 6, "out of stack space");
+	attrs = type_attrs(L, types, oid) ? lua_gettop(L) : 0;
+	lua_createtable(L, attrs ? 0 : n, attrs ? n : 0);
+	for (i = 1; i <= n; i++) {
+		if (end - p < 8)
+			luaL_error(L, "malformed record value");
+		aoid = get32(p);
+		alen = (int32_t)get32(p + 4);
+		p += 8;
+		if (alen == -1)
+			continue;
+		if (alen < 0 || end - p < alen)
+			luaL_error(L, "malformed record value");
+		if (attrs && lua_rawgeti(L, attrs, i) == LUA_TTABLE) {
+			lua_getfield(L, -1, "name");
+			lua_remove(L, -2);
+		} else {
+			lua_pop(L, attrs ? 1 : 0);
+			lua_pushinteger(L, i);
+		}
+		pgsql_decode(L, types, aoid, 1, p, alen);
+		lua_rawset(L, -3);
+		p += alen;
+	}
+	if (attrs)
+		lua_remove(L, attrs);
+}
+
+static void
+array_decode_elems(lua_State *L, int types, Oid elem, int ndim,
+    const int *dims, const char **p, const char *end)
+{
+	int i, len;
+
+	luaL_checkstack(L, 4, "out of stack space");
+	lua_createtable(L, dims[0], 0);
+	for (i = 1; i <= dims[0]; i++) {
+		if (ndim > 1) {
+			array_decode_elems(L, types, elem, ndim - 1, dims + 1,
+			    p, end);
+			lua_rawseti(L, -2, i);
+			continue;
+		}
+		if (end - *p < 4)
+			luaL_error(L, "malformed array value");
+		len = (int32_t)get32(*p);
+		*p += 4;
+		if (len == -1)
+			continue;
+		if (len < 0 || end - *p < len)
+			luaL_error(L, "malformed array value");
+		pgsql_decode(L, types, elem, 1, *p, len);
+		lua_rawseti(L, -2, i);
+		*p += len;
+	}
+}
+
+static void
+array_decode_binary(lua_State *L, int types, const char *p, int len)
+{
+	const char *end = p + len;
+	Oid elem;
+	int ndim, n, dims[6];
+
+	if (len < 12)
+		luaL_error(L, "malformed array value");
+	ndim = get32(p);
+	elem = get32(p + 8);
+	p += 12;
+	if (ndim < 0 || ndim > 6 || end - p < ndim * 8)
+		luaL_error(L, "malformed array value");
+	if (ndim == 0) {
+		lua_newtable(L);
+		return;
+	}
+	for (n = 0; n < ndim; n++, p += 8)
+		dims[n] = get32(p);
+	array_decode_elems(L, types, elem, ndim, dims, &p, end);
+}
+
+/*
+ * Decode one element of a text representation of a composite value or an
+ * array, leave the decoded value on the stack (nothing if the element is
+ * NULL) and return a pointer to the delimiter following the element.
+ */
+static const char *
+text_element(lua_State *L, int types, Oid oid, const char *s, char close,
+    int *isnull)
+{
+	luaL_Buffer b;
+	const char *v;
+	size_t len;
+	int quoted = 0, inquote = 0;
+
+	luaL_buffinit(L, &b);
+	for (; *s; s++) {
+		if (*s == '\\' && s[1]) {
+			luaL_addchar(&b, *++s);
+		} else if (*s == '"') {
+			if (inquote && s[1] == '"')
+				luaL_addchar(&b, *++s);
+			else
+				inquote = !inquote;
+			quoted = 1;
+		} else if (!inquote && (*s == ',' || *s == close))
+			break;
+		else
+			luaL_addchar(&b, *s);
+	}
+	luaL_pushresult(&b);
+	v = lua_tolstring(L, -1, &len);
+
+	if (close == '}' && !quoted) {
+		while (len > 0 && (v[len - 1] == ' ' || v[len - 1] == '\n'))
+			len--;
+		*isnull = len == 4 && !strncasecmp(v, "NULL", 4);
+	} else
+		*isnull = len == 0 && !quoted;
+
+	if (*isnull)
+		lua_pop(L, 1);
+	else {
+		lua_pushlstring(L, v, len);
+		lua_remove(L, -2);
+		pgsql_decode(L, types, oid, 0, lua_tostring(L, -1), len);
+		lua_remove(L, -2);
+	}
+	return s;
+}
+
+static void
+record_decode_text(lua_State *L, int types, Oid oid, const char *s)
+{
+	Oid aoid;
+	int attrs, i, isnull;
+
+	luaL_checkstack(L, 8, "out of stack space");
+	attrs = type_attrs(L, types, oid) ? lua_gettop(L) : 0;
+	lua_newtable(L);
+	if (*s != '(')
+		luaL_error(L, "malformed record literal");
+	for (s++, i = 1; *s; i++) {
+		aoid = UNKNOWNOID;
+		if (attrs && lua_rawgeti(L, attrs, i) == LUA_TTABLE) {
+			lua_getfield(L, -1, "type");
+			aoid = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			lua_getfield(L, -1, "name");
+			lua_remove(L, -2);
+		} else {
+			lua_pop(L, attrs ? 1 : 0);
+			lua_pushinteger(L, i);
+		}
+		s = text_element(L, types, aoid, s, ')', &isnull);
+		if (isnull)
+			lua_pop(L, 1);
+		else
+			lua_rawset(L, -3);
+		if (*s++ != ',')
+			break;
+	}
+	if (attrs)
+		lua_remove(L, attrs);
+}
+
+static const char *
+array_decode_level(lua_State *L, int types, Oid elem, const char *s)
+{
+	int i, isnull;
+
+	luaL_checkstack(L, 4, "out of stack space");
+	lua_newtable(L);
+	if (*s++ != '{')
+		luaL_error(L, "malformed array literal");
+	for (i = 1; *s && *s != '}'; i++) {
+		while (*s == ' ' || *s == '\n')
+			s++;
+		if (*s == '{') {
+			s = array_decode_level(L, types, elem, s);
+			lua_rawseti(L, -2, i);
+		} else {
+			s = text_element(L, types, elem, s, '}', &isnull);
+			if (!isnull)
+				lua_rawseti(L, -2, i);
+		}
+		if (*s == ',')
+			s++;
+	}
+	return *s ? s + 1 : s;
+}
+
+static void
+array_decode_text(lua_State *L, int types, Oid oid, const char *s)
+{
+	/* Skip explicit dimensions, e.g. "[0:1]={1,2}" */
+	if (*s == '[' && (s = strchr(s, '=')) != NULL)
+		s++;
+	if (s == NULL || *s != '{')
+		luaL_error(L, "malformed array literal");
+	array_decode_level(L, types, type_elem(L, types, oid), s);
+}
+
+/*
+ * Push the Lua representation of a value of the given kind.  Text values
+ * must be '\0' terminated.
+ */
+static void
+decode_kind(lua_State *L, int types, int kind, Oid oid, int format,
+    const char *value, int len)
+{
+	union {
+		uint32_t i;
+		float v;
+	} swap4;
+	union {
+		uint64_t i;
+		double v;
+	} swap8;
+
+	if (format == 0) {
+		switch (kind) {
+		case KIND_BOOL:
+			lua_pushboolean(L, *value == 't');
+			break;
+		case KIND_INT2:
+		case KIND_INT4:
+		case KIND_INT8:
+		case KIND_OID:
+			lua_pushinteger(L, strtoll(value, NULL, 10));
+			break;
+		case KIND_FLOAT4:
+		case KIND_FLOAT8:
+		case KIND_NUMERIC:
+			lua_pushnumber(L, strtod(value, NULL));
+			break;
+		case KIND_RECORD:
+			record_decode_text(L, types, oid, value);
+			break;
+		case KIND_ARRAY:
+			array_decode_text(L, types, oid, value);
+			break;
+		default:
+			lua_pushlstring(L, value, len);
+		}
+		return;
+	}
+
+	switch (kind) {
+	case KIND_BOOL:
+		if (len < 1)
+			luaL_error(L, "malformed boolean value");
+		lua_pushboolean(L, *value);
+		break;
+	case KIND_INT2:
+		if (len < 2)
+			luaL_error(L, "malformed int2 value");
+		lua_pushinteger(L, (int16_t)get16(value));
+		break;
+	case KIND_INT4:
+		if (len < 4)
+			luaL_error(L, "malformed int4 value");
+		lua_pushinteger(L, (int32_t)get32(value));
+		break;
+	case KIND_OID:
+		if (len < 4)
+			luaL_error(L, "malformed oid value");
+		lua_pushinteger(L, get32(value));
+		break;
+	case KIND_INT8:
+		if (len < 8)
+			luaL_error(L, "malformed int8 value");
+		lua_pushinteger(L, (int64_t)get64(value));
+		break;
+	case KIND_FLOAT4:
+		if (len < 4)
+			luaL_error(L, "malformed float4 value");
+		swap4.i = get32(value);
+		lua_pushnumber(L, swap4.v);
+		break;
+	case KIND_FLOAT8:
+		if (len < 8)
+			luaL_error(L, "malformed float8 value");
+		swap8.i = get64(value);
+		lua_pushnumber(L, swap8.v);
+		break;
+	case KIND_NUMERIC:
+		numeric_decode(L, value, len);
+		lua_pushnumber(L, strtod(lua_tostring(L, -1), NULL));
+		lua_remove(L, -2);
+		break;
+	case KIND_JSONB:
+		/* Skip the version byte */
+		if (len < 1)
+			luaL_error(L, "malformed jsonb value");
+		lua_pushlstring(L, value + 1, len - 1);
+		break;
+	case KIND_RECORD:
+		record_decode_binary(L, types, oid, value, len);
+		break;
+	case KIND_ARRAY:
+		array_decode_binary(L, types, value, len);
+		break;
+	default:
+		lua_pushlstring(L, value, len);
+	}
+}
+
+static void pgsql_encode(lua_State *, int, int, Oid, pgbuf *);
+
+/* Encode a value with a four byte length prefix, NULL for nil */
+static void
+encode_value(lua_State *L, int idx, int types, Oid oid, pgbuf *b)
+{
+	size_t off;
+
+	if (lua_isnil(L, idx)) {
+		buf_add32(L, b, -1);
+		return;
+	}
+	off = b->len;
+	buf_add32(L, b, 0);
+	pgsql_encode(L, idx, types, oid, b);
+	buf_set32(b, off, b->len - off - 4);
+}
+
+static void
+record_encode(lua_State *L, int idx, int types, Oid oid, pgbuf *b)
+{
+	Oid aoid;
+	int attrs, n, i;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	luaL_checkstack(L, 6, "out of stack space");
+	if (!type_attrs(L, types, oid))
+		luaL_error(L, "no attributes known for type %d", oid);
+	attrs = lua_gettop(L);
+	n = lua_rawlen(L, attrs);
+	buf_add32(L, b, n);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, attrs, i);
+		lua_getfield(L, -1, "type");
+		aoid = lua_tointeger(L, -1);
+		lua_getfield(L, -2, "name");
+
+		/* Attributes are looked up by name, then by position */
+		if (lua_gettable(L, idx) == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_rawgeti(L, idx, i);
+		}
+		buf_add32(L, b, aoid);
+		encode_value(L, lua_gettop(L), types, aoid, b);
+		lua_pop(L, 3);
+	}
+	lua_pop(L, 1);
+}
+
+static void
+array_encode(lua_State *L, int idx, int types, Oid oid, pgbuf *b)
+{
+	Oid elem;
+	int n, i, hasnull;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	luaL_checkstack(L, 4, "out of stack space");
+	elem = type_elem(L, types, oid);
+	n = lua_rawlen(L, idx);
+	for (hasnull = 0, i = 1; i <= n && !hasnull; i++) {
+		hasnull = lua_rawgeti(L, idx, i) == LUA_TNIL;
+		lua_pop(L, 1);
+	}
+	buf_add32(L, b, n > 0 ? 1 : 0);
+	buf_add32(L, b, hasnull);
+	buf_add32(L, b, elem);
+	if (n == 0)
+		return;
+	buf_add32(L, b, n);
+	buf_add32(L, b, 1);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, i);
+		encode_value(L, lua_gettop(L), types, elem, b);
+		lua_pop(L, 1);
+	}
+}
+
+/* Booleans and the strings PostgreSQL accepts as boolean input */
+static char
+encode_boolean(lua_State *L, int idx)
+{
+	static const char *const names[] = {
+		"t", "true", "y", "yes", "on", "1",
+		"f", "false", "n", "no", "off", "0", NULL
+	};
+	const char *s;
+	int n;
+
+	if (lua_type(L, idx) == LUA_TBOOLEAN)
+		return lua_toboolean(L, idx);
+	if (lua_type(L, idx) != LUA_TSTRING)
+		luaL_error(L, "boolean expected, got %s",
+		    luaL_typename(L, idx));
+	s = lua_tostring(L, idx);
+	for (n = 0; names[n] != NULL; n++)
+		if (!strcasecmp(s, names[n]))
+			return n < 6;
+	return luaL_error(L, "invalid boolean value '%s'", s);
+}
+
+static lua_Integer
+encode_integer(lua_State *L, int idx, lua_Integer min, lua_Integer max)
+{
+	lua_Integer v;
+	int isnum;
+
+	v = lua_tointegerx(L, idx, &isnum);
+	if (!isnum)
+		luaL_error(L, "integer expected, got %s",
+		    luaL_typename(L, idx));
+	if (v < min || v > max)
+		luaL_error(L, "integer value %I out of range", v);
+	return v;
+}
+
+/*
+ * Append the binary representation of the Lua value at idx as a value of
+ * the given kind to the buffer.
+ */
+static void
+encode_kind(lua_State *L, int idx, int types, int kind, Oid oid, pgbuf *b)
+{
+	union {
+		uint32_t i;
+		float v;
+	} swap4;
+	union {
+		uint64_t i;
+		double v;
+	} swap8;
+	const char *s;
+	size_t len;
+	int isnum;
+	char c;
+
+	idx = lua_absindex(L, idx);
+	switch (kind) {
+	case KIND_BOOL:
+		c = encode_boolean(L, idx);
+		buf_add(L, b, &c, 1);
+		break;
+	case KIND_INT2:
+		buf_add16(L, b, encode_integer(L, idx, INT16_MIN, INT16_MAX));
+		break;
+	case KIND_INT4:
+		buf_add32(L, b, encode_integer(L, idx, INT32_MIN, INT32_MAX));
+		break;
+	case KIND_OID:
+		buf_add32(L, b, encode_integer(L, idx, 0, UINT32_MAX));
+		break;
+	case KIND_INT8:
+		buf_add64(L, b, encode_integer(L, idx, LUA_MININTEGER,
+		    LUA_MAXINTEGER));
+		break;
+	case KIND_FLOAT4:
+		swap4.v = lua_tonumberx(L, idx, &isnum);
+		if (!isnum)
+			luaL_error(L, "number expected, got %s",
+			    luaL_typename(L, idx));
+		buf_add32(L, b, swap4.i);
+		break;
+	case KIND_FLOAT8:
+		swap8.v = lua_tonumberx(L, idx, &isnum);
+		if (!isnum)
+			luaL_error(L, "number expected, got %s",
+			    luaL_typename(L, idx));
+		buf_add64(L, b, swap8.i);
+		break;
+	case KIND_NUMERIC:
+		numeric_encode(L, idx, b);
+		break;
+	case KIND_JSONB:
+		c = 1;
+		buf_add(L, b, &c, 1);
+		/* FALLTHROUGH */
+	case KIND_TEXT:
+	case KIND_BYTEA:
+		if ((s = lua_tolstring(L, idx, &len)) == NULL)
+			luaL_error(L, "string expected, got %s",
+			    luaL_typename(L, idx));
+		buf_add(L, b, s, len);
+		break;
+	case KIND_RECORD:
+		record_encode(L, idx, types, oid, b);
+		break;
+	case KIND_ARRAY:
+		array_encode(L, idx, types, oid, b);
+		break;
+	default:
+		luaL_error(L, "no binary encoding for type %d", oid);
+	}
+}
+
+static void
+pgsql_encode(lua_State *L, int idx, int types, Oid oid, pgbuf *b)
+{
+	int kind;
+
+	kind = type_kind(L, types, &oid);
+	encode_kind(L, idx, types, kind, oid, b);
+}
+
+/*
+ * Encode a Lua value as binary value of a given type, so that it can be
+ * passed as parameter, e.g. a table as composite type:
+ * conn:record('mytype', { a = 1, b = 'foo' })
+ */
+static int
+conn_record(lua_State *L)
+{
+	record *r;
+	pgbuf *b;
+	Oid oid;
+	int types;
+
+	luaL_checkany(L, 3);
+	if (!pgsql_types(L, 1))
+		return lua_error(L);
+	types = lua_gettop(L);
+
+	lua_pushvalue(L, 2);
+	if (lua_rawget(L, types) != LUA_TTABLE)
+		return luaL_argerror(L, 2, "unknown type");
+	lua_getfield(L, -1, "oid");
+	oid = lua_tointeger(L, -1);
+
+	b = buf_new(L);
+	pgsql_encode(L, 3, types, oid, b);
+
+	r = lua_newuserdata(L, sizeof(record) + b->len);
+	r->oid = oid;
+	r->len = b->len;
+	memcpy(r->data, b->data, b->len);
+	luaL_setmetatable(L, RECORD_METATABLE);
+	return 1;
+}
+
+/* Return 1 if values of a type can be converted in binary format */
+static int
+type_binary(lua_State *L, int types, Oid oid)
+{
+	int n, i, binary;
+
+	switch (type_kind(L, types, &oid)) {
+	case KIND_OTHER:
+		return 0;
+	case KIND_ARRAY:
+		return type_binary(L, types, type_elem(L, types, oid));
+	case KIND_RECORD:
+		if (!type_attrs(L, types, oid))
+			return 0;
+		n = lua_rawlen(L, -1);
+		for (binary = 1, i = 1; i <= n && binary; i++) {
+			lua_rawgeti(L, -1, i);
+			lua_getfield(L, -1, "type");
+			binary = type_binary(L, types, lua_tointeger(L, -1));
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+		return binary;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Statement handles
+ *
+ * conn:statement(command [, name]) prepares a statement once and uses
+ * describePrepared() to learn the parameter and result types.  The
+ * encoder for each parameter and the decoder for each result column are
+ * chosen at this time, so that executing the statement involves no type
+ * discovery.  Parameters and results use the binary format when all
+ * involved types can be converted in binary format.
+ */
+static int
+conn_statement(lua_State *L)
+{
+	PGconn *conn;
+	PGresult **res;
+	statement *stmt;
+	const char *command;
+	char name[64], *p;
+	Oid oid;
+	size_t size;
+	int n, nparams, nfields, kind, types, binary;
+
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+
+	if (lua_isnoneornil(L, 3)) {
+		lua_getuservalue(L, 1);
+		lua_getfield(L, -1, "statements");
+		n = lua_tointeger(L, -1) + 1;
+		lua_pushinteger(L, n);
+		lua_setfield(L, -3, "statements");
+		lua_pop(L, 2);
+		snprintf(name, sizeof name, "luapgsql_stmt_%d", n);
+	} else {
+		luaL_argcheck(L, strlen(luaL_checkstring(L, 3)) < sizeof name,
+		    3, "statement name too long");
+		snprintf(name, sizeof name, "%s", lua_tostring(L, 3));
+	}
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = PQprepare(conn, name, command, 0, NULL);
+	luaL_setmetatable(L, RES_METATABLE);
+	if (PQresultStatus(*res) == PGRES_COMMAND_OK) {
+		PQclear(*res);
+		*res = PQdescribePrepared(conn, name);
+	}
+	if (PQresultStatus(*res) != PGRES_COMMAND_OK) {
+		lua_pushnil(L);
+		lua_pushstring(L, *res != NULL ? PQresultErrorMessage(*res) :
+		    PQerrorMessage(conn));
+		return 2;
+	}
+	nparams = PQnparams(*res);
+	nfields = PQnfields(*res);
+
+	size = sizeof(statement) + nparams * (sizeof(char *) +
+	    sizeof(size_t) + sizeof(Oid) + 3 * sizeof(int)) +
+	    nfields * (sizeof(Oid) + sizeof(int));
+	stmt = lua_newuserdata(L, size);
+	memset(stmt, 0, sizeof(statement));
+	luaL_setmetatable(L, STMT_METATABLE);
+	snprintf(stmt->name, sizeof stmt->name, "%s", name);
+	stmt->nparams = nparams;
+	stmt->nfields = nfields;
+	p = (char *)(stmt + 1);
+	stmt->paramValues = (char **)p;
+	p += nparams * sizeof(char *);
+	stmt->paramOffsets = (size_t *)p;
+	p += nparams * sizeof(size_t);
+	stmt->paramTypes = (Oid *)p;
+	p += nparams * sizeof(Oid);
+	stmt->paramKinds = (int *)p;
+	p += nparams * sizeof(int);
+	stmt->paramLengths = (int *)p;
+	p += nparams * sizeof(int);
+	stmt->paramFormats = (int *)p;
+	p += nparams * sizeof(int);
+	stmt->colTypes = (Oid *)p;
+	p += nfields * sizeof(Oid);
+	stmt->colKinds = (int *)p;
+
+	/* The uservalue holds the connection and the field names */
+	lua_createtable(L, 0, 2);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_createtable(L, nfields, 0);
+	for (n = 0; n < nfields; n++) {
+		lua_pushstring(L, PQfname(*res, n));
+		lua_rawseti(L, -2, n + 1);
+	}
+	lua_setfield(L, -2, "names");
+	lua_setuservalue(L, -2);
+
+	/* Only load the type catalogue if there are non built-in types */
+	types = 0;
+	for (n = 0, kind = KIND_BOOL; n < nparams && kind != KIND_OTHER; n++) {
+		oid = PQparamtype(*res, n);
+		kind = type_kind(L, 0, &oid);
+	}
+	for (n = 0; n < nfields && kind != KIND_OTHER; n++) {
+		oid = PQftype(*res, n);
+		kind = type_kind(L, 0, &oid);
+	}
+	if (kind == KIND_OTHER) {
+		if (pgsql_types(L, 1))
+			types = lua_gettop(L);
+		else
+			lua_pop(L, 1);
+	}
+
+	for (n = 0; n < nparams; n++) {
+		oid = PQparamtype(*res, n);
+		stmt->paramKinds[n] = type_kind(L, types, &oid);
+		stmt->paramTypes[n] = oid;
+		stmt->paramFormats[n] = type_binary(L, types, oid);
+	}
+	for (n = 0, binary = 1; n < nfields; n++) {
+		oid = PQftype(*res, n);
+		stmt->colKinds[n] = type_kind(L, types, &oid);
+		stmt->colTypes[n] = oid;
+		binary = binary && type_binary(L, types, oid);
+	}
+	stmt->resultFormat = nfields > 0 && binary;
+
+	PQclear(*res);
+	*res = NULL;
+	if (types)
+		lua_pop(L, 1);
+	return 1;
+}
+
+/* Append the text representation of a parameter, '\0' terminated */
+static void
+stmt_text_param(lua_State *L, int idx, pgbuf *b)
+{
+	char num[64];
+	const char *s;
+	size_t len;
+
+	switch (lua_type(L, idx)) {
+	case LUA_TBOOLEAN:
+		buf_add(L, b, lua_toboolean(L, idx) ? "t" : "f", 2);
+		return;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx))
+			snprintf(num, sizeof num, LUA_INTEGER_FMT,
+			    lua_tointeger(L, idx));
+		else
+			format_number(num, sizeof num, lua_tonumber(L, idx));
+		buf_add(L, b, num, strlen(num) + 1);
+		return;
+	case LUA_TSTRING:
+		s = lua_tolstring(L, idx, &len);
+		buf_add(L, b, s, len + 1);
+		return;
+	default:
+		luaL_error(L, "unsupported PostgreSQL parameter type %s",
+		    luaL_typename(L, idx));
+	}
+}
+
+/*
+ * Execute a statement with the nparams parameters starting at stack index
+ * first.  Pushes the connection and returns the result, *timedout is set
+ * if the query timeout of the connection expired.
+ */
+static PGresult *
+stmt_execute(lua_State *L, statement *stmt, int first, int nparams,
+    int resultFormat, int *timedout)
+{
+	PGconn *conn;
+	PGresult *r;
+	qspan *sp;
+	int64_t spstart;
+	int n, types, timeout;
+
+	if (nparams != stmt->nparams)
+		luaL_error(L, "statement expects %d parameters, got %d",
+		    stmt->nparams, nparams);
+	spstart = span_clock(L);
+
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "conn");
+	lua_remove(L, -2);
+	conn = pgsql_conn(L, -1);
+	timeout = query_timeout(L, -1);
+
+	types = 0;
+	for (n = 0; n < nparams && !types; n++)
+		if ((stmt->paramKinds[n] == KIND_RECORD ||
+		    stmt->paramKinds[n] == KIND_ARRAY) &&
+		    !lua_isnil(L, first + n)) {
+			if (!pgsql_types(L, -1))
+				lua_error(L);
+			types = lua_gettop(L);
+		}
+
+	stmt->buf.len = 0;
+	for (n = 0; n < nparams; n++) {
+		if (lua_isnil(L, first + n)) {
+			stmt->paramOffsets[n] = (size_t)-1;
+			stmt->paramLengths[n] = 0;
+			continue;
+		}
+		stmt->paramOffsets[n] = stmt->buf.len;
+		if (stmt->paramFormats[n])
+			encode_kind(L, first + n, types, stmt->paramKinds[n],
+			    stmt->paramTypes[n], &stmt->buf);
+		else
+			stmt_text_param(L, first + n, &stmt->buf);
+		stmt->paramLengths[n] = stmt->buf.len - stmt->paramOffsets[n];
+	}
+	for (n = 0; n < nparams; n++)
+		stmt->paramValues[n] = stmt->paramOffsets[n] == (size_t)-1 ?
+		    NULL : stmt->buf.data + stmt->paramOffsets[n];
+	if (types)
+		lua_pop(L, 1);
+
+	sp = NULL;
+	if (spstart >= 0) {
+		lua_pushstring(L, stmt->name);
+		if ((sp = span_begin(L, -1, spstart)) != NULL)
+			sp->encoded = clock_us();
+		lua_pop(L, 1);
+	}
+
+	*timedout = 0;
+	if (timeout > 0 || sp != NULL)
+		r = query_wait(conn, PQsendQueryPrepared(conn, stmt->name,
+		    nparams, (const char * const*)stmt->paramValues,
+		    stmt->paramLengths, stmt->paramFormats, resultFormat),
+		    timeout, timedout, sp);
+	else
+		r = PQexecPrepared(conn, stmt->name, nparams,
+		    (const char * const*)stmt->paramValues, stmt->paramLengths,
+		    stmt->paramFormats, resultFormat);
+	if (sp != NULL)
+		span_end(sp, r);
+	return r;
+}
+
+static int
+stmt_result(lua_State *L, int resultFormat)
+{
+	statement *stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+	PGresult *r, **res;
+	int timedout;
+
+	r = stmt_execute(L, stmt, 2, lua_gettop(L) - 1, resultFormat,
+	    &timedout);
+	if (timedout)
+		return query_failed(L, pgsql_conn(L, -1), timedout);
+	if (r == NULL)
+		lua_pushnil(L);
+	else {
+		res = lua_newuserdata(L, sizeof(PGresult *));
+		*res = r;
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, -2);
+	}
+	return 1;
+}
+
+/* stmt:exec(...) returns a result object with text format values */
+static int
+stmt_exec(lua_State *L)
+{
+	return stmt_result(L, 0);
+}
+
+/*
+ * stmt:execBinary(...) returns a result object with binary format values,
+ * which res:decode(), res:vector() and res:serialize() convert.
+ */
+static int
+stmt_execBinary(lua_State *L)
+{
+	return stmt_result(L, 1);
+}
+
+/*
+ * stmt:rows(...) returns the decoded rows as tables keyed by field name,
+ * or nil and an error message.
+ */
+static int
+stmt_rows(lua_State *L)
+{
+	statement *stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+	PGresult **res;
+	int nparams, conn, types, names, row, col, ntuples, timedout;
+
+	nparams = lua_gettop(L) - 1;
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = NULL;
+	luaL_setmetatable(L, RES_METATABLE);
+
+	*res = stmt_execute(L, stmt, 2, nparams, stmt->resultFormat,
+	    &timedout);
+	if (timedout)
+		return query_failed(L, pgsql_conn(L, -1), timedout);
+	conn = lua_gettop(L);
+	switch (PQresultStatus(*res)) {
+	case PGRES_TUPLES_OK:
+	case PGRES_COMMAND_OK:
+		break;
+	default:
+		lua_pushnil(L);
+		lua_pushstring(L, *res != NULL ? PQresultErrorMessage(*res) :
+		    PQerrorMessage(pgsql_conn(L, conn)));
+		return 2;
+	}
+
+	types = 0;
+	for (col = 0; col < stmt->nfields && !types; col++)
+		if (stmt->colKinds[col] == KIND_RECORD ||
+		    stmt->colKinds[col] == KIND_ARRAY) {
+			if (!pgsql_types(L, conn))
+				return lua_error(L);
+			types = lua_gettop(L);
+		}
+
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "names");
+	names = lua_gettop(L);
+
+	ntuples = PQntuples(*res);
+	luaL_checkstack(L, 4, "out of stack space");
+	lua_createtable(L, ntuples, 0);
+	for (row = 0; row < ntuples; row++) {
+		lua_createtable(L, 0, stmt->nfields);
+		for (col = 0; col < stmt->nfields; col++) {
+			if (PQgetisnull(*res, row, col))
+				continue;
+			lua_rawgeti(L, names, col + 1);
+			decode_kind(L, types, stmt->colKinds[col],
+			    stmt->colTypes[col], stmt->resultFormat,
+			    PQgetvalue(*res, row, col),
+			    PQgetlength(*res, row, col));
+			lua_rawset(L, -3);
+		}
+		lua_rawseti(L, -2, row + 1);
+	}
+	PQclear(*res);
+	*res = NULL;
+	return 1;
+}
+
+static int
+stmt_close(lua_State *L)
+{
+	statement *stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+	PGconn *conn;
+	PGresult *res;
+#if PG_VERSION_NUM < 170000
+	char *ident, *command;
+#endif
+	int ok;
+
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "conn");
+	conn = pgsql_conn(L, -1);
+
+#if PG_VERSION_NUM >= 170000
+	res = PQclosePrepared(conn, stmt->name);
+#else
+	ident = PQescapeIdentifier(conn, stmt->name, strlen(stmt->name));
+	if (ident == NULL)
+		return luaL_error(L, "%s", PQerrorMessage(conn));
+	command = lua_newuserdata(L, strlen(ident) + 12);
+	snprintf(command, strlen(ident) + 12, "DEALLOCATE %s", ident);
+	PQfreemem(ident);
+	res = PQexec(conn, command);
+#endif
+	ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+	if (ok)
+		lua_pushboolean(L, 1);
+	else {
+		lua_pushnil(L);
+		lua_pushstring(L, res != NULL ? PQresultErrorMessage(res) :
+		    PQerrorMessage(conn));
+	}
+	PQclear(res);
+	return ok ? 1 : 2;
+}
+
+static int
+stmt_name(lua_State *L)
+{
+	statement *stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+
+	lua_pushstring(L, stmt->name);
+	return 1;
+}
+
+static int
+stmt_nparams(lua_State *L)
+{
+	statement *stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+
+	lua_pushinteger(L, stmt->nparams);
+	return 1;
+}
+
+static int
+stmt_nfields(lua_State *L)
+{
+	statement *stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+
+	lua_pushinteger(L, stmt->nfields);
+	return 1;
+}
+
+static int
+stmt_clear(lua_State *L)
+{
+	statement *stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+
+	free(stmt->buf.data);
+	stmt->buf.data = NULL;
+	stmt->buf.len = stmt->buf.size = 0;
+	return 0;
+}
+
+/* Bulk execution */
+#if PG_VERSION_NUM >= 140000
+/* State of a pipelined execPreparedMany() */
+struct many {
+	PGconn		*conn;
+	int		 sent;
+	int		 done;
+	int		 synced;
+	int		 gotsync;
+	int		 errrow;
+	int		 errmsg;	/* stack index of the first error */
+	int		 results;	/* stack index of the results or 0 */
+	lua_Integer	 count;
+};
+
+/* Process available results, or all outstanding results if wait is set */
+static int
+many_drain(lua_State *L, struct many *m, int wait)
+{
+	PGresult *r, **res;
+
+	while (m->done < m->sent || (m->synced && !m->gotsync)) {
+		if (PQisBusy(m->conn)) {
+			if (!wait)
+				return 1;
+			if (wait_socket(PQsocket(m->conn), POLLIN, -1) == -1 ||
+			    !PQconsumeInput(m->conn))
+				return 0;
+			continue;
+		}
+		if ((r = PQgetResult(m->conn)) == NULL) {
+			m->done++;
+			continue;
+		}
+		switch (PQresultStatus(r)) {
+		case PGRES_PIPELINE_SYNC:
+			m->gotsync = 1;
+			PQclear(r);
+			continue;
+		case PGRES_TUPLES_OK:
+		case PGRES_COMMAND_OK:
+			m->count += strtoll(PQcmdTuples(r), NULL, 10);
+			break;
+		case PGRES_PIPELINE_ABORTED:
+			break;
+		default:
+			if (!m->errrow) {
+				m->errrow = m->done + 1;
+				lua_pushstring(L, PQresultErrorMessage(r));
+				lua_replace(L, m->errmsg);
+			}
+		}
+		if (m->results) {
+			res = lua_newuserdata(L, sizeof(PGresult *));
+			*res = r;
+			luaL_setmetatable(L, RES_METATABLE);
+			res_setconn(L, 1);
+			lua_rawseti(L, m->results, m->done + 1);
+		} else
+			PQclear(r);
+	}
+	return 1;
+}
+
+/* Flush the output, consuming input meanwhile to avoid a deadlock */
+static int
+many_flush(lua_State *L, struct many *m)
+{
+	int r, events;
+
+	while ((r = PQflush(m->conn)) == 1) {
+		events = wait_socket(PQsocket(m->conn), POLLIN | POLLOUT, -1);
+		if (events == -1)
+			return 0;
+		if (events & POLLIN) {
+			if (!PQconsumeInput(m->conn) || !many_drain(L, m, 0))
+				return 0;
+		}
+	}
+	return r == 0;
+}
+#endif
+
+/*
+ * Bind the parameters of the row at the top of the stack.  Records are
+ * sent in binary format, all other values in text format so that the
+ * server converts them to the parameter types of the statement.  If b is
+ * NULL, the parameters are only checked.
+ */
+static int
+many_bind(lua_State *L, pgbuf *b, char **paramValues, int *paramLengths,
+    int *paramFormats)
+{
+	record *r;
+	size_t *offsets;
+	int n, nParams;
+
+	nParams = lua_rawlen(L, -1);
+	if (nParams > 65535)
+		luaL_error(L, "number of parameters must not exceed 65535");
+	offsets = b != NULL ? lua_newuserdata(L, nParams * sizeof(size_t)) :
+	    NULL;
+	if (b != NULL)
+		b->len = 0;
+	for (n = 0; n < nParams; n++) {
+		lua_rawgeti(L, b != NULL ? -2 : -1, n + 1);
+		r = luaL_testudata(L, -1, RECORD_METATABLE);
+		switch (lua_type(L, -1)) {
+		case LUA_TNIL:
+			break;
+		case LUA_TBOOLEAN:
+		case LUA_TNUMBER:
+		case LUA_TSTRING:
+			r = NULL;
+			break;
+		default:
+			if (r == NULL)
+				luaL_error(L, "unsupported PostgreSQL parameter "
+				    "type %s", luaL_typename(L, -1));
+		}
+		if (b != NULL) {
+			if (lua_isnil(L, -1)) {
+				offsets[n] = (size_t)-1;
+				paramLengths[n] = 0;
+				paramFormats[n] = 0;
+			} else {
+				offsets[n] = b->len;
+				if (r != NULL)
+					buf_add(L, b, r->data, r->len);
+				else
+					stmt_text_param(L, lua_gettop(L), b);
+				paramLengths[n] = b->len - offsets[n];
+				paramFormats[n] = r != NULL;
+			}
+		}
+		lua_pop(L, 1);
+	}
+	if (b != NULL) {
+		for (n = 0; n < nParams; n++)
+			paramValues[n] = offsets[n] == (size_t)-1 ? NULL :
+			    b->data + offsets[n];
+		lua_pop(L, 1);
+	}
+	return nParams;
+}
+
+/*
+ * conn:execPreparedMany(name, rows [, opts]) executes a prepared statement
+ * once for every array of parameters in rows.  All executions are sent in
+ * one pipeline with a single sync and so run in one transaction.  By
+ * default, the total number of affected rows is returned, if opts.results
+ * is true, a table with one result per row is returned instead.  If an
+ * execution fails, the following executions are aborted, the preceding
+ * ones are rolled back and 0 affected rows, the error message and the
+ * number of the failed row are returned.  If sending fails, nil and an
+ * error message are returned, rows sent before may have been executed.
+ */
+static int
+conn_execPreparedMany(lua_State *L)
+{
+	PGconn *conn;
+	char **paramValues;
+	const char *name;
+	pgbuf *b;
+	int i, nrows, nParams, top, *paramLengths, *paramFormats;
+#if PG_VERSION_NUM >= 140000
+	struct many m;
+	int msg, nonblocking;
+#else
+	PGresult *r, **res;
+	lua_Integer count = 0;
+	int errrow = 0, begun = 0;
+#endif
+
+	conn = pgsql_conn(L, 1);
+	name = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	nrows = lua_rawlen(L, 3);
+
+	/* Check all parameters before anything is sent */
+	for (i = 1; i <= nrows; i++) {
+		if (lua_rawgeti(L, 3, i) != LUA_TTABLE)
+			return luaL_error(L, "row %d is not a table", i);
+		many_bind(L, NULL, NULL, NULL, NULL);
+		lua_pop(L, 1);
+	}
+
+	lua_settop(L, 4);
+	lua_pushnil(L);		/* first error message */
+	if (lua_istable(L, 4) && lua_getfield(L, 4, "results") != LUA_TNIL &&
+	    lua_toboolean(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, nrows, 0);
+	} else {
+		lua_settop(L, 5);
+		lua_pushnil(L);
+	}
+	b = buf_new(L);
+	top = lua_gettop(L);
+
+#if PG_VERSION_NUM >= 140000
+	memset(&m, 0, sizeof m);
+	m.conn = conn;
+	m.errmsg = 5;
+	m.results = lua_istable(L, 6) ? 6 : 0;
+
+	nonblocking = PQisnonblocking(conn);
+	if (!PQenterPipelineMode(conn) || PQsetnonblocking(conn, 1))
+		goto failed;
+
+	for (i = 1; i <= nrows; i++) {
+		lua_rawgeti(L, 3, i);
+		nParams = lua_rawlen(L, -1);
+		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
+		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
+		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+		lua_pushvalue(L, top + 1);
+		many_bind(L, b, paramValues, paramLengths, paramFormats);
+		if (!PQsendQueryPrepared(conn, name, nParams,
+		    (const char * const*)paramValues, paramLengths,
+		    paramFormats, 0))
+			goto failed;
+		m.sent++;
+		lua_settop(L, top);
+		if (!many_flush(L, &m))
+			goto failed;
+	}
+	if (!PQpipelineSync(conn))
+		goto failed;
+	m.synced = 1;
+	if (!many_flush(L, &m) || !many_drain(L, &m, 1))
+		goto failed;
+	PQexitPipelineMode(conn);
+	PQsetnonblocking(conn, nonblocking);
+
+	if (m.results)
+		lua_pushvalue(L, m.results);
+	else
+		lua_pushinteger(L, m.errrow ? 0 : m.count);
+	if (!m.errrow)
+		return 1;
+	lua_pushvalue(L, m.errmsg);
+	lua_pushinteger(L, m.errrow);
+	return 3;
+
+failed:
+	/*
+	 * Pipeline mode can only be left once all results are consumed, so
+	 * sync what was sent and drain it before giving the connection back.
+	 */
+	lua_pushstring(L, PQerrorMessage(conn));
+	msg = lua_gettop(L);
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+		if (!m.synced && PQpipelineSync(conn))
+			m.synced = 1;
+		if (!m.synced || !many_flush(L, &m) || !many_drain(L, &m, 1) ||
+		    !PQexitPipelineMode(conn)) {
+			PQsetnonblocking(conn, nonblocking);
+			lua_pushnil(L);
+			lua_pushfstring(L, "%sconnection left in pipeline mode "
+			    "and unusable", lua_tostring(L, msg));
+			return 2;
+		}
+	}
+	PQsetnonblocking(conn, nonblocking);
+	lua_pushnil(L);
+	lua_pushvalue(L, msg);
+	return 2;
+#else
+	/*
+	 * Without pipeline mode, the statement is executed row by row, in a
+	 * transaction of its own unless one is already open.
+	 */
+	if (PQtransactionStatus(conn) == PQTRANS_IDLE) {
+		r = PQexec(conn, "BEGIN");
+		begun = PQresultStatus(r) == PGRES_COMMAND_OK;
+		PQclear(r);
+		if (!begun) {
+			lua_pushnil(L);
+			lua_pushstring(L, PQerrorMessage(conn));
+			return 2;
+		}
+	}
+	for (i = 1; i <= nrows && !errrow; i++) {
+		lua_rawgeti(L, 3, i);
+		nParams = lua_rawlen(L, -1);
+		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
+		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
+		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+		lua_pushvalue(L, top + 1);
+		many_bind(L, b, paramValues, paramLengths, paramFormats);
+		r = PQexecPrepared(conn, name, nParams,
+		    (const char * const*)paramValues, paramLengths,
+		    paramFormats, 0);
+		lua_settop(L, top);
+		switch (PQresultStatus(r)) {
+		case PGRES_TUPLES_OK:
+		case PGRES_COMMAND_OK:
+			count += strtoll(PQcmdTuples(r), NULL, 10);
+			break;
+		default:
+			errrow = i;
+			lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+			    PQerrorMessage(conn));
+			lua_replace(L, 5);
+		}
+		if (lua_istable(L, 6) && r != NULL) {
+			res = lua_newuserdata(L, sizeof(PGresult *));
+			*res = r;
+			luaL_setmetatable(L, RES_METATABLE);
+			res_setconn(L, 1);
+			lua_rawseti(L, 6, i);
+		} else
+			PQclear(r);
+	}
+	if (begun) {
+		r = PQexec(conn, errrow ? "ROLLBACK" : "COMMIT");
+		if (!errrow && PQresultStatus(r) != PGRES_COMMAND_OK) {
+			errrow = nrows;
+			lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+			    PQerrorMessage(conn));
+			lua_replace(L, 5);
+		}
+		PQclear(r);
+	}
+	if (lua_istable(L, 6))
+		lua_pushvalue(L, 6);
+	else
+		lua_pushinteger(L, errrow ? 0 : count);
+	if (!errrow)
+		return 1;
+	lua_pushvalue(L, 5);
+	lua_pushinteger(L, errrow);
+	return 3;
+#endif
+}
+
+/* Notice processing */
+/* Queue a notice raised while a query is offloaded to a worker thread */
+static void
+future_notice(future *f, const char *message)
+{
+	char **notices, *msg;
+
+	notices = realloc(f->notices, (f->nnotices + 1) * sizeof(char *));
+	if (notices == NULL)
+		return;
+	f->notices = notices;
+	if ((msg = strdup(message)) != NULL)
+		f->notices[f->nnotices++] = msg;
+}
+
+static void
+noticeReceiver(void *arg, const PGresult *r)
+{
+	notice *n = arg;
+	PGresult **res;
+
+	if (n->future != NULL || n->f == LUA_NOREF)
+		return;		/* no result object outside the query */
+	lua_rawgeti(n->L, LUA_REGISTRYINDEX, n->f);
+	res = lua_newuserdata(n->L, sizeof(PGresult *));
+
+	*res = (PGresult *)r;
+	luaL_setmetatable(n->L, RES_METATABLE);
+
+	if (lua_pcall(n->L, 1, 0, 0))
+		luaL_error(n->L, "%s", lua_tostring(n->L, -1));
+	*res = NULL;	/* avoid double free */
+}
+
+static void
+noticeProcessor(void *arg, const char *message)
+{
+	notice *n = arg;
+
+	if (n->future != NULL) {
+		future_notice(n->future, message);
+		return;
+	}
+	if (n->f == LUA_NOREF)
+		return;
+	lua_rawgeti(n->L, LUA_REGISTRYINDEX, n->f);
+	lua_pushstring(n->L, message);
+	if (lua_pcall(n->L, 1, 0, 0))
+		luaL_error(n->L, "%s", lua_tostring(n->L, -1));
+}
+
+/*
+ * The notice structure is a userdata kept in the connection's uservalue
+ * for as long as it is installed, the function is released with it.
+ */
+static notice *
+notice_new(lua_State *L, const char *field)
+{
+	notice *n;
+	int f;
+
+	if (!lua_isfunction(L, -1))
+		luaL_argerror(L, -1, "function expected");
+
+	pgsql_conn(L, 1);
+	f = luaL_ref(L, LUA_REGISTRYINDEX);
+	n = lua_newuserdata(L, sizeof(notice));
+	n->L = L;
+	n->f = f;
+	n->future = NULL;
+	luaL_setmetatable(L, NOTICE_METATABLE);
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, field);
+	lua_pop(L, 2);
+	return n;
+}
+
+static int
+notice_clear(lua_State *L)
+{
+	notice *n = luaL_checkudata(L, 1, NOTICE_METATABLE);
+
+	luaL_unref(L, LUA_REGISTRYINDEX, n->f);
+	n->f = LUA_NOREF;
+	return 0;
+}
+
+static int
+conn_setNoticeReceiver(lua_State *L)
+{
+	notice *n;
+
+	n = notice_new(L, "notice_receiver");
+	PQsetNoticeReceiver(pgsql_conn(L, 1), noticeReceiver, n);
+	return 0;
+}
+
+static int
+conn_setNoticeProcessor(lua_State *L)
+{
+	notice *n;
+
+	n = notice_new(L, "notice_processor");
+	PQsetNoticeProcessor(pgsql_conn(L, 1), noticeProcessor, n);
+	return 0;
+}
+
+/*
+ * Queued notices
+ *
+ * Instead of calling a Lua function for every notice, conn:setNoticeQueue()
+ * installs a notice processor that collects the messages in C, to be
+ * fetched in bulk by conn:notices().  A notice receiver set with
+ * conn:setNoticeReceiver() takes precedence over the queue.
+ */
+static void
+noticeQueue(void *arg, const char *message)
+{
+	noticeq *q = arg;
+	char *msg;
+
+	if (q->msgs == NULL || (msg = strdup(message)) == NULL) {
+		q->dropped++;
+		return;
+	}
+	if (q->count == q->limit) {
+		free(q->msgs[q->first]);
+		q->first = (q->first + 1) % q->limit;
+		q->count--;
+		q->dropped++;
+	}
+	q->msgs[(q->first + q->count++) % q->limit] = msg;
+}
+
+static int
+noticeq_clear(lua_State *L)
+{
+	noticeq *q = luaL_checkudata(L, 1, NOTICEQ_METATABLE);
+
+	while (q->count > 0) {
+		free(q->msgs[q->first]);
+		q->first = (q->first + 1) % q->limit;
+		q->count--;
+	}
+	free(q->msgs);
+	q->msgs = NULL;
+	return 0;
+}
+
+/* Release notice handlers and queue of a finished connection */
+static void
+notice_release(lua_State *L, int uv)
+{
+	static const char *fields[] = {
+		"notice_receiver", "notice_processor", "notice_queue"
+	};
+	size_t n;
+
+	for (n = 0; n < sizeof fields / sizeof fields[0]; n++) {
+		if (lua_getfield(L, uv, fields[n]) == LUA_TUSERDATA) {
+			lua_pushcfunction(L, n < 2 ? notice_clear :
+			    noticeq_clear);
+			lua_insert(L, -2);
+			lua_call(L, 1, 0);
+		} else
+			lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_setfield(L, uv, fields[n]);
+	}
+}
+
+/*
+ * conn:setNoticeQueue([limit]), a limit of 0 removes the queue.  libpq
+ * does not return the argument of the processor replaced, it is the
+ * notice userdata for noticeProcessor, the queue in the uservalue for
+ * noticeQueue and unused for the default processor.
+ */
+static int
+conn_setNoticeQueue(lua_State *L)
+{
+	PGconn *conn;
+	PQnoticeProcessor fn;
+	noticeq *q, *old;
+	lua_Integer limit;
+
+	conn = pgsql_conn(L, 1);
+	limit = luaL_optinteger(L, 2, 1000);
+	luaL_argcheck(L, limit >= 0 && limit <= INT_MAX / (lua_Integer)
+	    sizeof(char *), 2, "invalid queue limit");
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, 3, "notice_queue");
+	old = luaL_testudata(L, 4, NOTICEQ_METATABLE);
+
+	if (limit == 0) {
+		if (old == NULL)
+			return 0;
+
+		/* a NULL function does not change the processor */
+		if (PQsetNoticeProcessor(conn, NULL, NULL) == noticeQueue)
+			PQsetNoticeProcessor(conn, old->prevfn, old->prevarg);
+		lua_pushcfunction(L, noticeq_clear);
+		lua_pushvalue(L, 4);
+		lua_call(L, 1, 0);
+		lua_pushnil(L);
+		lua_setfield(L, 3, "notice_queue");
+		return 0;
+	}
+
+	q = lua_newuserdata(L, sizeof(noticeq));
+	q->msgs = NULL;
+	q->limit = limit;
+	q->first = q->count = 0;
+	q->dropped = 0;
+	luaL_setmetatable(L, NOTICEQ_METATABLE);
+	if ((q->msgs = malloc(limit * sizeof(char *))) == NULL)
+		return luaL_error(L, "out of memory");
+
+	/* pending notices are carried over */
+	if (old != NULL) {
+		while (old->count > 0) {
+			noticeQueue(q, old->msgs[old->first]);
+			free(old->msgs[old->first]);
+			old->first = (old->first + 1) % old->limit;
+			old->count--;
+		}
+		q->dropped += old->dropped;
+	}
+	lua_setfield(L, 3, "notice_queue");
+
+	fn = PQsetNoticeProcessor(conn, noticeQueue, q);
+	if (fn == noticeQueue && old != NULL) {
+		q->prevfn = old->prevfn;
+		q->prevarg = old->prevarg;
+	} else {
+		q->prevfn = fn;
+		q->prevarg = NULL;
+		if (fn == noticeProcessor) {
+			lua_getfield(L, 3, "notice_processor");
+			q->prevarg = lua_touserdata(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+	return 0;
+}
+
+/* conn:notices() returns the queued notices and the number dropped */
+static int
+conn_notices(lua_State *L)
+{
+	noticeq *q;
+	int n;
+
+	pgsql_conn(L, 1);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "notice_queue");
+	q = luaL_testudata(L, -1, NOTICEQ_METATABLE);
+	lua_createtable(L, q != NULL ? q->count : 0, 0);
+	if (q == NULL) {
+		lua_pushinteger(L, 0);
+		return 2;
+	}
+	for (n = 1; q->count > 0; n++) {
+		lua_pushstring(L, q->msgs[q->first]);
+		lua_rawseti(L, -2, n);
+		free(q->msgs[q->first]);
+		q->first = (q->first + 1) % q->limit;
+		q->count--;
+	}
+	lua_pushinteger(L, q->dropped);
+	q->dropped = 0;
+	return 2;
+}
+
+/*
+ * Offloaded queries
+ *
+ * conn:offload(command, ...) executes a query on a worker thread and
+ * returns a future.  Lua functions are only ever called on the thread
+ * that owns the Lua state; notices for Lua notice processors are queued
+ * while the query runs and delivered when the future is joined, Lua
+ * notice receivers don't see them.
+ */
+static void *
+future_run(void *arg)
+{
+	future *f = arg;
+	PGresult *r;
+
+	if (f->nparams)
+		r = PQexecParams(f->conn, f->command, f->nparams,
+		    f->paramTypes, (const char * const*)f->paramValues,
+		    f->paramLengths, f->paramFormats, 0);
+	else
+		r = PQexec(f->conn, f->command);
+
+	pthread_mutex_lock(&f->lock);
+	f->res = r;
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+	return NULL;
+}
+
+/* Wait for the worker and give the connection back to its Lua object */
+static void
+future_join(lua_State *L, future *f, int idx)
+{
+	int n;
+
+	if (f->joined)
+		return;
+	f->joined = 1;
+	if (f->started) {
+		pthread_join(f->thread, NULL);
+		*f->slot = f->conn;
+		lua_getuservalue(L, idx);
+		lua_getfield(L, -1, "conn");
+		lua_getuservalue(L, -1);
+		lua_pushnil(L);
+		lua_setfield(L, -2, "busy");
+		lua_pop(L, 3);
+	}
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->lock);
+	PQfreeCancel(f->cancel);
+	f->cancel = NULL;
+	free(f->mem);
+	f->mem = NULL;
+	if (f->receiver != NULL)
+		f->receiver->future = NULL;
+	if (f->processor != NULL)
+		f->processor->future = NULL;
+	for (n = 0; n < f->nnotices; n++) {
+		if (f->processor != NULL)
+			noticeProcessor(f->processor, f->notices[n]);
+		free(f->notices[n]);
+	}
+	free(f->notices);
+	f->notices = NULL;
+	f->nnotices = 0;
+}
+
+static int
+conn_offload(lua_State *L)
+{
+	PGconn **slot;
+	future *f;
+	Oid *paramTypes;
+	char **paramValues, *p;
+	const char *command;
+	size_t len, size;
+	int n, nParams, *paramLengths, *paramFormats;
+
+	pgsql_conn(L, 1);
+	slot = luaL_checkudata(L, 1, CONN_METATABLE);
+	command = luaL_checkstring(L, 2);
+
+	nParams = lua_gettop(L) - 2;	/* subtract connection and command */
+	if (nParams > 65535)
+		luaL_error(L, "number of parameters must not exceed 65535");
+
+	luaL_checkstack(L, 6 + nParams, "out of stack space");
+	paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
+	paramValues = lua_newuserdata(L, nParams * sizeof(char *));
+	paramLengths = lua_newuserdata(L, nParams * sizeof(int));
+	paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+	for (n = 0; n < nParams; n++)
+		get_param(L, 3 + n, n, paramTypes, paramValues, paramLengths,
+		    paramFormats);
+
+	/* Copy command and parameters, the worker must not touch Lua */
+	size = nParams * (sizeof(char *) + sizeof(Oid) + 2 * sizeof(int)) +
+	    strlen(command) + 1;
+	for (n = 0; n < nParams; n++) {
+		if (paramValues[n] != NULL && paramFormats[n] == 0)
+			paramLengths[n] = strlen(paramValues[n]) + 1;
+		if (paramValues[n] != NULL)
+			size += paramLengths[n];
+	}
+
+	f = lua_newuserdata(L, sizeof(future));
+	memset(f, 0, sizeof(future));
+	f->joined = 1;
+	luaL_setmetatable(L, FUTURE_METATABLE);
+	if ((f->mem = malloc(size)) == NULL)
+		return luaL_error(L, "out of memory");
+
+	f->nparams = nParams;
+	f->paramValues = f->mem;
+	f->paramTypes = (Oid *)(f->paramValues + nParams);
+	f->paramLengths = (int *)(f->paramTypes + nParams);
+	f->paramFormats = f->paramLengths + nParams;
+	p = (char *)(f->paramFormats + nParams);
+	for (n = 0; n < nParams; n++) {
+		f->paramTypes[n] = paramTypes[n];
+		f->paramFormats[n] = paramFormats[n];
+		f->paramLengths[n] = paramLengths[n];
+		if (paramValues[n] == NULL) {
+			f->paramValues[n] = NULL;
+			continue;
+		}
+		f->paramValues[n] = p;
+		memcpy(p, paramValues[n], paramLengths[n]);
+		p += paramLengths[n];
+	}
+	len = strlen(command) + 1;
+	memcpy(p, command, len);
+	f->command = p;
+
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_setuservalue(L, -2);
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	f->joined = 0;
+	f->conn = *slot;
+	f->slot = slot;
+	f->cancel = PQgetCancel(f->conn);
+
+	/* Lua notice callbacks must not run on the worker */
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "notice_receiver");
+	lua_getfield(L, -2, "notice_processor");
+	f->receiver = lua_touserdata(L, -2);
+	f->processor = lua_touserdata(L, -1);
+	lua_pop(L, 3);
+	if (f->receiver != NULL)
+		f->receiver->future = f;
+	if (f->processor != NULL)
+		f->processor->future = f;
+
+	if (pthread_create(&f->thread, NULL, future_run, f)) {
+		future_join(L, f, -1);
+		return luaL_error(L, "can't create thread");
+	}
+	f->started = 1;
+	*slot = NULL;
+	lua_getuservalue(L, 1);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "busy");
+	lua_pop(L, 1);
+	return 1;
+}
+
+/* future:ready() returns true if the query has completed */
+static int
+future_ready(lua_State *L)
+{
+	future *f = luaL_checkudata(L, 1, FUTURE_METATABLE);
+	int done;
+
+	if (f->joined)
+		done = 1;
+	else {
+		pthread_mutex_lock(&f->lock);
+		done = f->done;
+		pthread_mutex_unlock(&f->lock);
+	}
+	lua_pushboolean(L, done);
+	return 1;
+}
+
+/*
+ * future:wait([timeout]) waits at most timeout milliseconds, or forever,
+ * for the query to complete.  Returns true if it has completed.
+ */
+static int
+future_wait(lua_State *L)
+{
+	future *f = luaL_checkudata(L, 1, FUTURE_METATABLE);
+	struct timespec ts;
+	lua_Integer timeout;
+	int done;
+
+	timeout = luaL_optinteger(L, 2, -1);
+	if (f->joined) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+	pthread_mutex_lock(&f->lock);
+	while (!f->done)
+		if (timeout < 0)
+			pthread_cond_wait(&f->cond, &f->lock);
+		else if (pthread_cond_timedwait(&f->cond, &f->lock, &ts) ==
+		    ETIMEDOUT)
+			break;
+	done = f->done;
+	pthread_mutex_unlock(&f->lock);
+	lua_pushboolean(L, done);
+	return 1;
+}
+
+/*
+ * future:result() waits for the query to complete, hands the connection
+ * back to its Lua object and returns the result.
+ */
+static int
+future_result(lua_State *L)
+{
+	future *f = luaL_checkudata(L, 1, FUTURE_METATABLE);
+	PGresult **res;
+
+	future_join(L, f, 1);
+	lua_getuservalue(L, 1);
+	if (f->res != NULL) {
+		lua_getfield(L, -1, "conn");
+		res = lua_newuserdata(L, sizeof(PGresult *));
+		*res = f->res;
+		f->res = NULL;
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, -2);
+		lua_setfield(L, -3, "result");
+		lua_pop(L, 1);
+	}
+	lua_getfield(L, -1, "result");
+	return 1;
+}
+
+/* Cancel the query if it is still running, wait for it and clean up */
+static int
+future_clear(lua_State *L)
+{
+	future *f = luaL_checkudata(L, 1, FUTURE_METATABLE);
+	char errbuf[256];
+	int done;
+
+	if (!f->joined && f->started) {
+		pthread_mutex_lock(&f->lock);
+		done = f->done;
+		pthread_mutex_unlock(&f->lock);
+		if (!done && f->cancel != NULL)
+			PQcancel(f->cancel, errbuf, sizeof errbuf);
+	}
+	future_join(L, f, 1);
+	PQclear(f->res);
+	f->res = NULL;
+	return 0;
+}
+
+/* Large objects */
+static int
+conn_lo_create(lua_State *L)
+{
+	Oid oid;
+
+	if (lua_gettop(L) == 2)
+		oid = luaL_checkinteger(L, 2);
+	else
+		oid = 0;
+	lua_pushinteger(L, lo_create(pgsql_conn(L, 1), oid));
+	return 1;
+}
+
+static int
+conn_lo_import(lua_State *L)
+{
+	lua_pushinteger(L, lo_import(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
+	return 1;
+}
+
+static int
+conn_lo_import_with_oid(lua_State *L)
+{
+	lua_pushinteger(L,
+	    lo_import_with_oid(pgsql_conn(L, 1), luaL_checkstring(L, 2),
+	    luaL_checkinteger(L, 3)));
+	return 1;
+}
+
+static int
+conn_lo_export(lua_State *L)
+{
+	int r;
+
+	r = lo_export(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
+	    luaL_checkstring(L, 3));
+
+	lua_pushboolean(L, r == 1);
+	return 1;
+}
+
+static int
+conn_lo_open(lua_State *L)
+{
+	int fd;
+
+	fd = lo_open(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
+	    luaL_checkinteger(L, 3));
+	if (fd == -1)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, fd);
+	return 1;
+}
+
+static int
+conn_lo_write(lua_State *L)
+{
+	const char *s;
+	size_t len;
+
+	s = lua_tolstring(L, 3, &len);
+	lua_pushinteger(L, lo_write(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
+	    s, len));
+	return 1;
+}
+
+static int
+conn_lo_read(lua_State *L)
+{
+	char *buf;
+	size_t len;
+
+	len = luaL_checkinteger(L, 3);
+	buf = lua_newuserdata(L, len);
+	len = lo_read(pgsql_conn(L, 1), luaL_checkinteger(L, 2), buf, len);
+	lua_pushlstring(L, buf, len);
+	lua_pushinteger(L, len);
+	return 2;
+}
+
+static int
+conn_lo_lseek(lua_State *L)
+{
+	lua_pushinteger(L, lo_lseek(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
+	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4)));
+	return 1;
+}
+
+static int
+conn_lo_tell(lua_State *L)
+{
+	lua_pushinteger(L, lo_tell(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
+	return 1;
+}
+
+static int
+conn_lo_truncate(lua_State *L)
+{
+	lua_pushinteger(L, lo_truncate(pgsql_conn(L, 1),
+	    luaL_checkinteger(L, 2), luaL_checkinteger(L, 3)));
+	return 1;
+}
+
+static int
+conn_lo_close(lua_State *L)
+{
+	lua_pushboolean(L,
+	    lo_close(pgsql_conn(L, 1), luaL_checkinteger(L, 2)) == 0);
+	return 1;
+}
+
+static int
+conn_lo_unlink(lua_State *L)
+{
+	lua_pushboolean(L,
+	    lo_unlink(pgsql_conn(L, 1), luaL_checkinteger(L, 2)) == 1);
+	return 1;
+}
+
+#if PG_VERSION_NUM >= 90300
+static int
+conn_lo_lseek64(lua_State *L)
+{
+	lua_pushinteger(L, lo_lseek64(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
+	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4)));
+	return 1;
+}
+
+static int
+conn_lo_tell64(lua_State *L)
+{
+	lua_pushinteger(L,
+	    lo_tell64(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
+	return 1;
+}
+
+static int
+conn_lo_truncate64(lua_State *L)
+{
+	lua_pushinteger(L, lo_truncate64(pgsql_conn(L, 1),
+	    luaL_checkinteger(L, 2), luaL_checkinteger(L, 3)));
+	return 1;
+}
+#endif
+
+/*
+ * Read/write routing
+ *
+ * pgsql.router(nodes [, opts]) routes queries over a primary and its
+ * replicas, nodes being a list of conninfo strings or connection objects.
+ * The role of each node is determined with pg_is_in_recovery().
+ * router:exec(command, ...) sends read-only queries to a replica, chosen
+ * at random weighted by the inverse of its latency average and the
+ * queries it has in flight, and everything else to the primary, like all
+ * queries while the primary is in a transaction.  router:read() and
+ * router:write() force the choice.  A node whose connection went bad is
+ * reset and, if that fails, retried every opts.retry milliseconds (default
+ * 5000).  A read that failed because its connection was lost is repeated
+ * on another node; if there is no primary, the replicas are checked for
+ * one that has been promoted.
+ *
+ * With opts.hedge set to a percentile, a read that got no result within
+ * that percentile of the recent read latencies, but at least
+ * opts.hedgeMin milliseconds (default 1), is also sent to a second
+ * replica.  The first result wins, the other query is cancelled and its
+ * results are discarded before the node is used again.
+ */
+enum { NODE_DOWN, NODE_PRIMARY, NODE_REPLICA };
+enum { ROUTE_AUTO, ROUTE_READ, ROUTE_WRITE };
+
+/* The connection of node i, NULL if it is busy or finished */
+static PGconn *
+router_conn(lua_State *L, int uv, int i)
+{
+	PGconn **data;
+
+	lua_rawgeti(L, uv, i + 1);
+	data = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return *data;
+}
+
+static void
+router_latency(router *r, rnode *node, int64_t us)
+{
+	double ms = us / 1000.0;
+
+	if (node->latency == 0)
+		node->latency = ms;
+	else
+		node->latency += r->alpha * (ms - node->latency);
+}
+
+/* Determine the role of a node, resetting its connection if it is bad */
+static void
+router_detect(router *r, rnode *node, PGconn *conn)
+{
+	PGresult *res;
+	int64_t t;
+
+	node->state = NODE_DOWN;
+	if (PQstatus(conn) == CONNECTION_BAD)
+		PQreset(conn);
+	if (PQstatus(conn) == CONNECTION_OK) {
+		t = clock_us();
+		res = PQexec(conn, "select pg_is_in_recovery()");
+		if (PQresultStatus(res) == PGRES_TUPLES_OK &&
+		    PQntuples(res) == 1) {
+			node->state = *PQgetvalue(res, 0, 0) == 't' ?
+			    NODE_REPLICA : NODE_PRIMARY;
+			router_latency(r, node, clock_us() - t);
+		}
+		PQclear(res);
+	}
+	if (node->state == NODE_DOWN)
+		node->retry = clock_ms() + r->retry;
+}
+
+/* Discard the results of a cancelled query, without blocking */
+static void
+router_drain(rnode *node, PGconn *conn)
+{
+	PGresult *res;
+
+	if (!PQconsumeInput(conn)) {
+		node->draining = 0;
+		return;
+	}
+	while (!PQisBusy(conn)) {
+		if ((res = PQgetResult(conn)) == NULL) {
+			node->draining = 0;
+			break;
+		}
+		PQclear(res);
+	}
+}
+
+/* Detect bad connections and retry failed nodes when it is time */
+static void
+router_check(lua_State *L, router *r, int uv)
+{
+	PGconn *conn;
+	rnode *node;
+	int64_t now = -1;
+	int i;
+
+	for (i = 0; i < r->n; i++) {
+		node = &r->nodes[i];
+		if ((conn = router_conn(L, uv, i)) == NULL)
+			continue;
+		if (node->draining)
+			router_drain(node, conn);
+		if (node->state != NODE_DOWN) {
+			if (PQstatus(conn) == CONNECTION_BAD)
+				router_detect(r, node, conn);
+			continue;
+		}
+		if (now == -1)
+			now = clock_ms();
+		if (now >= node->retry)
+			router_detect(r, node, conn);
+	}
+}
+
+/* Whether node i is in the given state and ready for a query */
+static int
+router_ready(lua_State *L, router *r, int uv, int i, int state)
+{
+	return r->nodes[i].state == state && !r->nodes[i].draining &&
+	    router_conn(L, uv, i) != NULL;
+}
+
+static int
+router_primary(lua_State *L, router *r, int uv)
+{
+	int i;
+
+	for (i = 0; i < r->n; i++)
+		if (router_ready(L, r, uv, i, NODE_PRIMARY))
+			return i;
+	return -1;
+}
+
+/*
+ * Pick a node for a query, other than node exclude, -1 if none is
+ * available.
+ */
+static int
+router_pick(lua_State *L, router *r, int uv, int mode, int exclude)
+{
+	PGconn *conn;
+	rnode *node;
+	double sum, w;
+	int i, primary;
+
+	primary = router_primary(L, r, uv);
+	if (mode == ROUTE_AUTO && primary != -1 &&
+	    PQtransactionStatus(router_conn(L, uv, primary)) != PQTRANS_IDLE)
+		mode = ROUTE_WRITE;
+	if (mode == ROUTE_WRITE) {
+		if (primary != -1)
+			return primary;
+		/* Look for a promoted replica */
+		for (i = 0; i < r->n; i++)
+			if (router_ready(L, r, uv, i, NODE_REPLICA)) {
+				conn = router_conn(L, uv, i);
+				router_detect(r, &r->nodes[i], conn);
+			}
+		return router_primary(L, r, uv);
+	}
+
+	for (sum = 0, i = 0; i < r->n; i++) {
+		node = &r->nodes[i];
+		if (i != exclude && router_ready(L, r, uv, i, NODE_REPLICA))
+			sum += 1 / ((node->latency + 0.001) *
+			    (node->inflight + 1));
+	}
+	if (sum == 0)
+		return exclude == -1 ? primary : -1;
+
+	/* xorshift64 */
+	r->rand ^= r->rand << 13;
+	r->rand ^= r->rand >> 7;
+	r->rand ^= r->rand << 17;
+	w = (r->rand >> 11) * (1.0 / 9007199254740992.0) * sum;
+	for (i = 0; i < r->n; i++) {
+		node = &r->nodes[i];
+		if (i == exclude || !router_ready(L, r, uv, i, NODE_REPLICA))
+			continue;
+		primary = i;
+		w -= 1 / ((node->latency + 0.001) * (node->inflight + 1));
+		if (w < 0)
+			break;
+	}
+	return primary;
+}
+
+/*
+ * Whether a command is a single SELECT without FOR UPDATE/SHARE or INTO,
+ * VALUES, TABLE or SHOW statement.
+ */
+static int
+router_readonly(const char *s)
+{
+	static const char *const reads[] = {
+		"select", "values", "table", "show", NULL
+	};
+	char word[8], q;
+	int n, first = 1, select = 0, lockclause = 0;
+
+	while (*s) {
+		if (isspace((unsigned char)*s))
+			s++;
+		else if (s[0] == '-' && s[1] == '-') {
+			while (*s && *s != '\n')
+				s++;
+		} else if (s[0] == '/' && s[1] == '*') {
+			if ((s = strstr(s + 2, "*/")) == NULL)
+				return 0;
+			s += 2;
+		} else if (*s == '\'' || *s == '"') {
+			for (q = *s++; *s && *s != q; s++)
+				;
+			if (*s)
+				s++;
+			lockclause = 0;
+		} else if (isalpha((unsigned char)*s) || *s == '_') {
+			for (n = 0; isalnum((unsigned char)*s) || *s == '_';
+			    s++)
+				if (n < (int)sizeof(word) - 1)
+					word[n++] = tolower((unsigned char)*s);
+			word[n] = '\0';
+			if (first) {
+				for (n = 0; reads[n] != NULL; n++)
+					if (!strcmp(word, reads[n]))
+						break;
+				if (reads[n] == NULL)
+					return 0;
+				select = n == 0;
+				first = 0;
+			} else if (select && !strcmp(word, "into"))
+				return 0;
+			else if (lockclause && (!strcmp(word, "update") ||
+			    !strcmp(word, "share") || !strcmp(word, "no") ||
+			    !strcmp(word, "key")))
+				return 0;
+			lockclause = !strcmp(word, "for");
+		} else if (*s == ';') {
+			for (s++; isspace((unsigned char)*s); s++)
+				;
+			if (*s)
+				return 0;
+		} else {
+			s++;
+			lockclause = 0;
+		}
+	}
+	return !first;
+}
+
+static int
+int64_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The hedging delay in milliseconds, -1 if there are too few samples */
+static int
+router_delay(router *r)
+{
+	int64_t s[HEDGE_SAMPLES], d;
+	int n;
+
+	n = r->nsamples < HEDGE_SAMPLES ? r->nsamples : HEDGE_SAMPLES;
+	if (r->hedge == 0 || n < 16)
+		return -1;
+	memcpy(s, r->samples, n * sizeof(int64_t));
+	qsort(s, n, sizeof(int64_t), int64_cmp);
+	d = (s[(n - 1) * r->hedge / 100] + 999) / 1000;
+	return d < r->hedgemin ? r->hedgemin : d > INT_MAX ? INT_MAX : d;
+}
+
+static void
+router_sample(router *r, int64_t us)
+{
+	r->samples[r->nsamples % HEDGE_SAMPLES] = us;
+	if (++r->nsamples == 2 * HEDGE_SAMPLES)
+		r->nsamples = HEDGE_SAMPLES;
+}
+
+/*
+ * Send the read with the arguments from index 2 to top to replica a and,
+ * if it takes longer than delay milliseconds, to a second replica.
+ * Pushes the first result and returns 1, returns 0 if the query could not
+ * be sent or both connections failed.
+ */
+static int
+router_hedged(lua_State *L, router *r, int uv, int top, int a, int delay)
+{
+	struct pollfd pfd[2];
+	PGconn *conn[2];
+	PGresult *res[2] = { NULL, NULL }, *rr, **rp;
+	Oid *paramTypes = NULL;
+	char **paramValues = NULL;
+	const char *command;
+	int64_t sent[2], deadline;
+	int *paramLengths = NULL, *paramFormats = NULL;
+	int node[2], busy[2], live[2], nparams, n, k, nfds, map[2], left;
+	int c, winner;
+
+	command = lua_tostring(L, 2);
+	nparams = top - 2;
+	if (nparams > 65535)
+		luaL_error(L, "number of parameters must not exceed 65535");
+	if (nparams) {
+		luaL_checkstack(L, 4 + nparams, "out of stack space");
+		paramTypes = lua_newuserdata(L, nparams * sizeof(Oid));
+		paramValues = lua_newuserdata(L, nparams * sizeof(char *));
+		paramLengths = lua_newuserdata(L, nparams * sizeof(int));
+		paramFormats = lua_newuserdata(L, nparams * sizeof(int));
+		for (n = 0; n < nparams; n++)
+			get_param(L, 3 + n, n, paramTypes, paramValues,
+			    paramLengths, paramFormats);
+	}
+
+	node[0] = a;
+	conn[0] = router_conn(L, uv, a);
+	if (!(nparams ? PQsendQueryParams(conn[0], command, nparams,
+	    paramTypes, (const char * const*)paramValues, paramLengths,
+	    paramFormats, 0) : PQsendQuery(conn[0], command)))
+		return 0;
+	sent[0] = clock_us();
+	r->nodes[a].inflight++;
+	busy[0] = live[0] = 1;
+	busy[1] = live[1] = 0;
+	n = 1;
+	deadline = clock_ms() + delay;
+	winner = -1;
+
+	while (winner == -1) {
+		left = n == 1 ? time_left(deadline) : -1;
+		if (left == 0 || (n == 1 && !live[0])) {
+			/* Send the second request */
+			deadline = -1;
+			node[1] = router_pick(L, r, uv, ROUTE_READ, a);
+			if (node[1] == -1) {
+				if (!live[0])
+					break;
+				continue;
+			}
+			conn[1] = router_conn(L, uv, node[1]);
+			n = 2;
+			if (!(nparams ? PQsendQueryParams(conn[1], command,
+			    nparams, paramTypes,
+			    (const char * const*)paramValues, paramLengths,
+			    paramFormats, 0) : PQsendQuery(conn[1], command))) {
+				if (!live[0])
+					break;
+				continue;
+			}
+			sent[1] = clock_us();
+			r->nodes[node[1]].inflight++;
+			busy[1] = live[1] = 1;
+			r->hedged++;
+			continue;
+		}
+		for (k = nfds = 0; k < n; k++)
+			if (live[k]) {
+				pfd[nfds].fd = PQsocket(conn[k]);
+				pfd[nfds].events = POLLIN;
+				pfd[nfds].revents = 0;
+				map[nfds++] = k;
+			}
+		if (nfds == 0)
+			break;
+		if (poll(pfd, nfds, left) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (k = 0; k < nfds && winner == -1; k++) {
+			if (!pfd[k].revents)
+				continue;
+			c = map[k];
+			if (!PQconsumeInput(conn[c])) {
+				live[c] = 0;
+				continue;
+			}
+			while (!PQisBusy(conn[c])) {
+				if ((rr = PQgetResult(conn[c])) == NULL) {
+					winner = c;
+					break;
+				}
+				PQclear(res[c]);
+				res[c] = rr;
+			}
+		}
+	}
+
+	for (k = 0; k < n; k++) {
+		if (busy[k])
+			r->nodes[node[k]].inflight--;
+		if (!live[k] && PQstatus(conn[k]) == CONNECTION_BAD) {
+			r->nodes[node[k]].state = NODE_DOWN;
+			r->nodes[node[k]].retry = 0;
+		} else if (live[k] && k != winner) {
+			query_cancel(conn[k], 1000);
+			r->nodes[node[k]].draining = 1;
+		}
+		if (k != winner)
+			PQclear(res[k]);
+	}
+	if (winner == -1)
+		return 0;
+	router_latency(r, &r->nodes[node[winner]], clock_us() - sent[winner]);
+	router_sample(r, clock_us() - sent[0]);
+	if (winner == 1)
+		r->hedgewins++;
+
+	lua_rawgeti(L, uv, node[winner] + 1);
+	rp = lua_newuserdata(L, sizeof(PGresult *));
+	*rp = res[winner];
+	if (*rp == NULL)
+		lua_pushnil(L);
+	else {
+		luaL_setmetatable(L, RES_METATABLE);
+		res_setconn(L, -2);
+	}
+	return 1;
+}
+
+static int
+router_run(lua_State *L, int mode)
+{
+	router *r;
+	rnode *node;
+	PGconn *conn;
+	int64_t t;
+	int top, uv, i, n, tries, status, delay;
+
+	r = luaL_checkudata(L, 1, ROUTER_METATABLE);
+	if (mode == ROUTE_AUTO && !router_readonly(luaL_checkstring(L, 2)))
+		mode = ROUTE_WRITE;
+	top = lua_gettop(L);
+	luaL_checkstack(L, top + 4, "out of stack space");
+	lua_getuservalue(L, 1);
+	uv = top + 1;
+
+	for (tries = 0; ; tries++) {
+		router_check(L, r, uv);
+		if ((i = router_pick(L, r, uv, mode, -1)) == -1) {
+			lua_pushnil(L);
+			if (mode == ROUTE_WRITE)
+				lua_pushliteral(L, "no primary available");
+			else
+				lua_pushliteral(L, "no node available");
+			return 2;
+		}
+		node = &r->nodes[i];
+		conn = router_conn(L, uv, i);
+
+		if (tries == 0 && node->state == NODE_REPLICA &&
+		    (delay = router_delay(r)) != -1) {
+			if (router_hedged(L, r, uv, top, i, delay))
+				return 1;
+			lua_settop(L, uv);
+			continue;
+		}
+
+		lua_pushcfunction(L, top > 2 ? conn_execParams : conn_exec);
+		lua_rawgeti(L, uv, i + 1);
+		for (n = 2; n <= top; n++)
+			lua_pushvalue(L, n);
+		node->inflight++;
+		t = clock_us();
+		status = lua_pcall(L, top, LUA_MULTRET, 0);
+		node->inflight--;
+		if (status)
+			return lua_error(L);
+		if (PQstatus(conn) != CONNECTION_BAD) {
+			t = clock_us() - t;
+			if (!lua_isnil(L, uv + 1)) {
+				router_latency(r, node, t);
+				if (node->state == NODE_REPLICA)
+					router_sample(r, t);
+			}
+			break;
+		}
+		node->state = NODE_DOWN;
+		node->retry = 0;
+		if (mode == ROUTE_WRITE || tries == r->n)
+			break;
+		lua_settop(L, uv);
+	}
+	return lua_gettop(L) - uv;
+}
+
+static int
+router_exec(lua_State *L)
+{
+	return router_run(L, ROUTE_AUTO);
+}
+
+static int
+router_read(lua_State *L)
+{
+	return router_run(L, ROUTE_READ);
+}
 
-		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
-		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
-		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+static int
+router_write(lua_State *L)
+{
+	return router_run(L, ROUTE_WRITE);
+}
+
+static int
+pgsql_router(lua_State *L)
+{
+	router *r;
+	PGconn **data;
+	lua_Integer n, retry, hedge, hedgemin;
+	lua_Number alpha;
+	int i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = luaL_len(L, 1);
+	luaL_argcheck(L, n > 0 && n <= 1024, 1, "invalid number of nodes");
+	retry = 5000;
+	alpha = 0.2;
+	hedge = 0;
+	hedgemin = 1;
+	if (lua_istable(L, 2)) {
+		if (lua_getfield(L, 2, "retry") != LUA_TNIL)
+			retry = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 2, "alpha") != LUA_TNIL)
+			alpha = luaL_checknumber(L, -1);
+		if (lua_getfield(L, 2, "hedge") != LUA_TNIL)
+			hedge = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 2, "hedgeMin") != LUA_TNIL)
+			hedgemin = luaL_checkinteger(L, -1);
+		lua_pop(L, 4);
+	}
+	luaL_argcheck(L, retry >= 0 && retry <= INT_MAX, 2,
+	    "invalid retry interval");
+	luaL_argcheck(L, hedge >= 0 && hedge <= 100, 2, "invalid percentile");
+	luaL_argcheck(L, hedgemin >= 0 && hedgemin <= INT_MAX, 2,
+	    "invalid hedging delay");
+	luaL_argcheck(L, alpha > 0 && alpha <= 1, 2, "invalid alpha");
+	lua_settop(L, 1);
+
+	r = lua_newuserdata(L, sizeof(router) + n * sizeof(rnode));
+	memset(r, 0, sizeof(router) + n * sizeof(rnode));
+	r->n = n;
+	r->retry = retry;
+	r->alpha = alpha;
+	r->hedge = hedge;
+	r->hedgemin = hedgemin;
+	r->rand = clock_us() | 1;
+	luaL_setmetatable(L, ROUTER_METATABLE);
+
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		if (lua_rawgeti(L, 1, i + 1) == LUA_TSTRING) {
+			data = pgsql_conn_new(L);
+			if ((*data = PQconnectdb(lua_tostring(L, -2))) == NULL)
+				return luaL_error(L, "out of memory");
+			lua_remove(L, -2);
+		} else if (luaL_testudata(L, -1, CONN_METATABLE) == NULL)
+			return luaL_argerror(L, 1,
+			    "conninfo strings or connections expected");
+		lua_rawseti(L, -2, i + 1);
+	}
+	for (i = 0; i < n; i++)
+		if (router_conn(L, 3, i) != NULL)
+			router_detect(r, &r->nodes[i], router_conn(L, 3, i));
+	lua_setuservalue(L, 2);
+	return 1;
+}
+
+/* router:primary() returns the connection to the primary or nil */
+static int
+router_getPrimary(lua_State *L)
+{
+	router *r = luaL_checkudata(L, 1, ROUTER_METATABLE);
+	int i;
+
+	lua_getuservalue(L, 1);
+	router_check(L, r, 2);
+	if ((i = router_pick(L, r, 2, ROUTE_WRITE, -1)) == -1)
+		lua_pushnil(L);
+	else
+		lua_rawgeti(L, 2, i + 1);
+	return 1;
+}
+
+/* router:replica() returns the connection a read would be sent to */
+static int
+router_getReplica(lua_State *L)
+{
+	router *r = luaL_checkudata(L, 1, ROUTER_METATABLE);
+	int i;
+
+	lua_getuservalue(L, 1);
+	router_check(L, r, 2);
+	if ((i = router_pick(L, r, 2, ROUTE_READ, -1)) == -1)
+		lua_pushnil(L);
+	else
+		lua_rawgeti(L, 2, i + 1);
+	return 1;
+}
+
+/* router:nodes() returns the connection, role and statistics per node */
+static int
+router_nodes(lua_State *L)
+{
+	router *r = luaL_checkudata(L, 1, ROUTER_METATABLE);
+	static const char *const roles[] = { "down", "primary", "replica" };
+	rnode *node;
+	int i;
+
+	lua_getuservalue(L, 1);
+	lua_createtable(L, r->n, 0);
+	for (i = 0; i < r->n; i++) {
+		node = &r->nodes[i];
+		lua_createtable(L, 0, 4);
+		lua_rawgeti(L, 2, i + 1);
+		lua_setfield(L, -2, "conn");
+		lua_pushstring(L, roles[node->state]);
+		lua_setfield(L, -2, "role");
+		lua_pushnumber(L, node->latency);
+		lua_setfield(L, -2, "latency");
+		lua_pushinteger(L, node->inflight);
+		lua_setfield(L, -2, "inflight");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+/*
+ * router:hedging() returns the current hedging delay in milliseconds (nil
+ * if not hedging yet), the number of second requests sent and how many of
+ * them won.
+ */
+static int
+router_hedging(lua_State *L)
+{
+	router *r = luaL_checkudata(L, 1, ROUTER_METATABLE);
+	int delay;
+
+	if ((delay = router_delay(r)) == -1)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, delay);
+	lua_pushinteger(L, r->hedged);
+	lua_pushinteger(L, r->hedgewins);
+	return 3;
+}
+
+/* router:close() finishes the connections of all nodes */
+static int
+router_close(lua_State *L)
+{
+	router *r = luaL_checkudata(L, 1, ROUTER_METATABLE);
+	int i;
+
+	lua_getuservalue(L, 1);
+	for (i = 0; i < r->n; i++) {
+		lua_pushcfunction(L, conn_finish);
+		lua_rawgeti(L, 2, i + 1);
+		lua_call(L, 1, 0);
+		r->nodes[i].state = NODE_DOWN;
+	}
+	return 0;
+}
+
+/*
+ * Result cache
+ *
+ * pgsql.cache(conn [, opts]) caches the results of queries executed on
+ * conn, keyed by the command and the parameter values.  Entries expire
+ * after opts.ttl milliseconds (default 60000, 0 for never) and the least
+ * recently used entries are evicted when the results take more than
+ * opts.memory bytes (default 16 MB).  cache:exec(command, ...) returns a
+ * result object like conn:exec() does, a copy of the cached result on a
+ * hit; cache:execTagged(tags, command, ...) additionally tags the entry
+ * with a string or a list of strings.  A notification on a channel
+ * subscribed with cache:listen(channel) invalidates the entries tagged
+ * with its payload, or with the channel name if the payload is empty.
+ * The cache consumes all notifications arriving on conn.
+ *
+ * The uservalue holds the connection, the entries by key, the entries by
+ * tag (as weak tables), the subscribed channels and the metatable of the
+ * tag sets.
+ */
+enum { CACHE_CONN = 1, CACHE_ENTRIES, CACHE_TAGS, CACHE_CHANNELS, CACHE_WEAK };
+
+/* An estimate of the memory a result takes */
+static size_t
+cache_ressize(const PGresult *res)
+{
+	size_t size;
+	int row, col, ntuples, nfields;
+
+	ntuples = PQntuples(res);
+	nfields = PQnfields(res);
+	size = 256 + nfields * 64 + (size_t)ntuples * nfields * 16;
+	for (row = 0; row < ntuples; row++)
+		for (col = 0; col < nfields; col++)
+			size += PQgetlength(res, row, col) + 1;
+	return size;
+}
+
+/* Unlink an entry and free its result, the uservalue is at index uv */
+static void
+cache_remove(lua_State *L, cache *c, centry *e, int uv)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+	e->prev = e->next = NULL;
+
+	lua_rawgeti(L, uv, CACHE_ENTRIES);
+	lua_pushlstring(L, e->key, e->keylen);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+
+	PQclear(e->res);
+	e->res = NULL;
+	c->used -= e->size;
+	c->count--;
+}
+
+static int
+centry_clear(lua_State *L)
+{
+	centry *e = luaL_checkudata(L, 1, CENTRY_METATABLE);
+
+	if (e->res != NULL) {
+		PQclear(e->res);
+		e->res = NULL;
+	}
+	return 0;
+}
+
+/* Invalidate the entries with the tag on top of the stack, pop it */
+static lua_Integer
+cache_invalidate(lua_State *L, cache *c, int uv)
+{
+	centry *e;
+	lua_Integer n = 0;
+
+	lua_rawgeti(L, uv, CACHE_TAGS);
+	lua_pushvalue(L, -2);
+	if (lua_rawget(L, -2) == LUA_TTABLE) {
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			lua_pop(L, 1);
+			e = lua_touserdata(L, -1);
+			if (e->res != NULL) {
+				cache_remove(L, c, e, uv);
+				n++;
+			}
+		}
+		lua_pushvalue(L, -3);
+		lua_pushnil(L);
+		lua_rawset(L, -4);
+	}
+	lua_pop(L, 3);
+	c->invalidations += n;
+	c->generation++;
+	return n;
+}
+
+/* Process the notifications that arrived on the connection */
+static void
+cache_notify(lua_State *L, cache *c, int uv, PGconn *conn)
+{
+	PGnotify *n;
+
+	PQconsumeInput(conn);
+	while ((n = PQnotifies(conn)) != NULL) {
+		lua_rawgeti(L, uv, CACHE_CHANNELS);
+		lua_pushstring(L, n->relname);
+		if (lua_rawget(L, -2) != LUA_TNIL) {
+			lua_pushstring(L, *n->extra ? n->extra : n->relname);
+			cache_invalidate(L, c, uv);
+		}
+		lua_pop(L, 2);
+		PQfreemem(n);
+	}
+}
+
+/*
+ * Push the key of the command at index first and the parameters up to
+ * index top, return 0 and push nothing if a parameter can not be part of
+ * a key.
+ */
+static int
+cache_key(lua_State *L, int first, int top)
+{
+	luaL_Buffer b;
+	const char *s;
+	size_t len;
+	uint32_t l;
+	lua_Integer i;
+	lua_Number d;
+	int n;
+
+	for (n = first + 1; n <= top; n++)
+		switch (lua_type(L, n)) {
+		case LUA_TNIL:
+		case LUA_TBOOLEAN:
+		case LUA_TNUMBER:
+		case LUA_TSTRING:
+			break;
+		default:
+			return 0;
+		}
+	luaL_buffinit(L, &b);
+	s = lua_tolstring(L, first, &len);
+	luaL_addlstring(&b, s, len + 1);
+	for (n = first + 1; n <= top; n++)
+		switch (lua_type(L, n)) {
+		case LUA_TNIL:
+			luaL_addchar(&b, 'n');
+			break;
+		case LUA_TBOOLEAN:
+			luaL_addchar(&b, lua_toboolean(L, n) ? 't' : 'f');
+			break;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, n)) {
+				i = lua_tointeger(L, n);
+				luaL_addchar(&b, 'i');
+				luaL_addlstring(&b, (char *)&i, sizeof i);
+			} else {
+				d = lua_tonumber(L, n);
+				luaL_addchar(&b, 'd');
+				luaL_addlstring(&b, (char *)&d, sizeof d);
+			}
+			break;
+		default:
+			s = lua_tolstring(L, n, &len);
+			l = len;
+			luaL_addchar(&b, 's');
+			luaL_addlstring(&b, (char *)&l, sizeof l);
+			luaL_addlstring(&b, s, len);
+		}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/* Push a copy of a cached result, owned by the caller */
+static void
+cache_push(lua_State *L, const PGresult *r, int uv)
+{
+	PGresult **res;
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = PQcopyResult(r, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+	if (*res == NULL)
+		luaL_error(L, "out of memory");
+	luaL_setmetatable(L, RES_METATABLE);
+	lua_rawgeti(L, uv, CACHE_CONN);
+	lua_setuservalue(L, -2);
+}
+
+/* Store a result under the key at index key, with the tags at index tags */
+static void
+cache_store(lua_State *L, cache *c, int uv, int key, int tags,
+    const PGresult *r)
+{
+	centry *e;
+	size_t keylen, size;
+	const char *k;
+	int n;
+
+	k = lua_tolstring(L, key, &keylen);
+	size = cache_ressize(r) + sizeof(centry) + 2 * keylen;
+	if (size > c->memory)
+		return;
+	while (c->used + size > c->memory && c->tail != NULL) {
+		cache_remove(L, c, c->tail, uv);
+		c->evictions++;
+	}
+
+	e = lua_newuserdata(L, sizeof(centry) + keylen);
+	memset(e, 0, sizeof(centry));
+	luaL_setmetatable(L, CENTRY_METATABLE);
+	if ((e->res = PQcopyResult(r, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES))
+	    == NULL)
+		luaL_error(L, "out of memory");
+	memcpy(e->key, k, keylen);
+	e->keylen = keylen;
+	e->size = size;
+	e->expires = c->ttl > 0 ? clock_ms() + c->ttl : -1;
+	if ((e->next = c->head) != NULL)
+		c->head->prev = e;
+	else
+		c->tail = e;
+	c->head = e;
+	c->used += size;
+	c->count++;
+
+	lua_rawgeti(L, uv, CACHE_ENTRIES);
+	lua_pushvalue(L, key);
+	lua_pushvalue(L, -3);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+
+	if (tags) {
+		lua_rawgeti(L, uv, CACHE_TAGS);
+		for (n = 1; ; n++) {
+			if (lua_type(L, tags) == LUA_TSTRING) {
+				if (n > 1)
+					break;
+				lua_pushvalue(L, tags);
+			} else if (lua_rawgeti(L, tags, n) == LUA_TNIL) {
+				lua_pop(L, 1);
+				break;
+			}
+			lua_pushvalue(L, -1);
+			if (lua_rawget(L, -3) == LUA_TNIL) {
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_rawgeti(L, uv, CACHE_WEAK);
+				lua_setmetatable(L, -2);
+				lua_pushvalue(L, -2);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, -5);
+			}
+			lua_pushvalue(L, -4);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -3);
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Execute the command at index first with the parameters up to the top of
+ * the stack, or return the cached result.
+ */
+static int
+cache_run(lua_State *L, int tags, int first)
+{
+	cache *c;
+	centry *e;
+	PGconn *conn;
+	lua_Integer generation;
+	int top, uv, key, n;
+
+	c = luaL_checkudata(L, 1, CACHE_METATABLE);
+	luaL_checkstring(L, first);
+	top = lua_gettop(L);
+	luaL_checkstack(L, top + 8, "out of stack space");
+	lua_getuservalue(L, 1);
+	uv = top + 1;
+	lua_rawgeti(L, uv, CACHE_CONN);
+	conn = pgsql_conn(L, -1);
+	lua_pop(L, 1);
+	cache_notify(L, c, uv, conn);
+
+	key = 0;
+	if (cache_key(L, first, top)) {
+		key = lua_gettop(L);
+		lua_rawgeti(L, uv, CACHE_ENTRIES);
+		lua_pushvalue(L, key);
+		e = lua_rawget(L, -2) == LUA_TNIL ? NULL : lua_touserdata(L, -1);
+		lua_pop(L, 2);
+		if (e != NULL && e->expires != -1 && clock_ms() >= e->expires) {
+			cache_remove(L, c, e, uv);
+			e = NULL;
+		}
+		if (e != NULL) {
+			/* Move to the front of the LRU list */
+			if (e != c->head) {
+				e->prev->next = e->next;
+				if (e->next != NULL)
+					e->next->prev = e->prev;
+				else
+					c->tail = e->prev;
+				e->prev = NULL;
+				e->next = c->head;
+				c->head->prev = e;
+				c->head = e;
+			}
+			c->hits++;
+			cache_push(L, e->res, uv);
+			return 1;
+		}
+	}
+	c->misses++;
+
+	generation = c->generation;
+	lua_pushcfunction(L, top > first ? conn_execParams : conn_exec);
+	lua_rawgeti(L, uv, CACHE_CONN);
+	for (n = first; n <= top; n++)
+		lua_pushvalue(L, n);
+	lua_call(L, top - first + 2, LUA_MULTRET);
+	n = lua_gettop(L) - (key ? key : uv);
+
+	/* Don't store results that may have been invalidated meanwhile */
+	cache_notify(L, c, uv, conn);
+	if (key && generation == c->generation && n == 1 &&
+	    luaL_testudata(L, -1, RES_METATABLE) != NULL &&
+	    PQresultStatus(*(PGresult **)lua_touserdata(L, -1)) ==
+	    PGRES_TUPLES_OK)
+		cache_store(L, c, uv, key, tags,
+		    *(PGresult **)lua_touserdata(L, -1));
+	return n;
+}
+
+static int
+cache_exec(lua_State *L)
+{
+	return cache_run(L, 0, 2);
+}
+
+static int
+cache_execTagged(lua_State *L)
+{
+	if (!lua_isstring(L, 2))
+		luaL_checktype(L, 2, LUA_TTABLE);
+	return cache_run(L, 2, 3);
+}
+
+/* cache:listen(channel) subscribes to invalidations on a channel */
+static int
+cache_listen(lua_State *L)
+{
+	PGconn *conn;
+	PGresult *res;
+	const char *channel;
+	char *ident;
+	int ok;
+
+	luaL_checkudata(L, 1, CACHE_METATABLE);
+	channel = luaL_checkstring(L, 2);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, 3, CACHE_CONN);
+	conn = pgsql_conn(L, -1);
+
+	if ((ident = PQescapeIdentifier(conn, channel, strlen(channel)))
+	    == NULL)
+		return luaL_error(L, "%s", PQerrorMessage(conn));
+	lua_pushfstring(L, "listen %s", ident);
+	PQfreemem(ident);
+	res = PQexec(conn, lua_tostring(L, -1));
+	ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+	if (!ok) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(conn));
+		return 2;
+	}
+	lua_rawgeti(L, 3, CACHE_CHANNELS);
+	lua_pushvalue(L, 2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * cache:invalidate(tag) removes the entries with a tag and returns their
+ * number, after processing pending notifications.
+ */
+static int
+cache_invalidateTag(lua_State *L)
+{
+	cache *c = luaL_checkudata(L, 1, CACHE_METATABLE);
+
+	luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, 3, CACHE_CONN);
+	cache_notify(L, c, 3, pgsql_conn(L, -1));
+	lua_pushvalue(L, 2);
+	lua_pushinteger(L, cache_invalidate(L, c, 3));
+	return 1;
+}
+
+/* cache:clear() removes all entries */
+static int
+cache_clear(lua_State *L)
+{
+	cache *c = luaL_checkudata(L, 1, CACHE_METATABLE);
+
+	lua_getuservalue(L, 1);
+	while (c->head != NULL)
+		cache_remove(L, c, c->head, 2);
+	lua_newtable(L);
+	lua_rawseti(L, 2, CACHE_TAGS);
+	c->generation++;
+	return 0;
+}
+
+/* cache:stats() returns the number of entries, memory use and counters */
+static int
+cache_stats(lua_State *L)
+{
+	cache *c = luaL_checkudata(L, 1, CACHE_METATABLE);
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, c->count);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, c->used);
+	lua_setfield(L, -2, "memory");
+	lua_pushinteger(L, c->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, c->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, c->evictions);
+	lua_setfield(L, -2, "evictions");
+	lua_pushinteger(L, c->invalidations);
+	lua_setfield(L, -2, "invalidations");
+	return 1;
+}
+
+static int
+pgsql_cache(lua_State *L)
+{
+	cache *c;
+	lua_Integer ttl, memory;
+
+	pgsql_conn(L, 1);
+	ttl = 60000;
+	memory = 16 * 1024 * 1024;
+	if (lua_istable(L, 2)) {
+		if (lua_getfield(L, 2, "ttl") != LUA_TNIL)
+			ttl = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 2, "memory") != LUA_TNIL)
+			memory = luaL_checkinteger(L, -1);
+		lua_pop(L, 2);
+	}
+	luaL_argcheck(L, ttl >= 0, 2, "invalid ttl");
+	luaL_argcheck(L, memory > 0, 2, "invalid memory limit");
+
+	c = lua_newuserdata(L, sizeof(cache));
+	memset(c, 0, sizeof(cache));
+	c->ttl = ttl;
+	c->memory = memory;
+	luaL_setmetatable(L, CACHE_METATABLE);
+
+	lua_createtable(L, CACHE_WEAK, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, CACHE_CONN);
+	lua_newtable(L);
+	lua_rawseti(L, -2, CACHE_ENTRIES);
+	lua_newtable(L);
+	lua_rawseti(L, -2, CACHE_TAGS);
+	lua_newtable(L);
+	lua_rawseti(L, -2, CACHE_CHANNELS);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_rawseti(L, -2, CACHE_WEAK);
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+/*
+ * Result serialization
+ *
+ * A serialized result starts with "PGR" and a version byte, followed by
+ * the number of fields and tuples, the field attributes and the tuples.
+ * Each tuple has a bitmap of its null values followed by the other
+ * values.  Integers are big endian, string lengths are varints.
+ */
+#define SERIAL_VERSION	1
+
+static void
+buf_addvarint(lua_State *L, pgbuf *b, uint64_t v)
+{
+	unsigned char u[10];
+	int n = 0;
+
+	while (v >= 0x80) {
+		u[n++] = v | 0x80;
+		v >>= 7;
+	}
+	u[n++] = v;
+	buf_add(L, b, u, n);
+}
+
+static int
+get_varint(const char **p, const char *end, uint64_t *v)
+{
+	const unsigned char *u = (const unsigned char *)*p;
+	int shift;
+
+	for (*v = 0, shift = 0; (const char *)u < end && shift < 64;
+	    shift += 7) {
+		*v |= (uint64_t)(*u & 0x7f) << shift;
+		if (!(*u++ & 0x80)) {
+			*p = (const char *)u;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+serialize_result(lua_State *L, const PGresult *r, pgbuf *b)
+{
+	const char *name;
+	size_t off, len;
+	int row, col, ntuples, nfields, nb;
+
+	ntuples = PQntuples(r);
+	nfields = PQnfields(r);
+	buf_add(L, b, "PGR", 3);
+	buf_reserve(L, b, 1);
+	b->data[b->len++] = SERIAL_VERSION;
+	buf_add32(L, b, nfields);
+	buf_add32(L, b, ntuples);
+	for (col = 0; col < nfields; col++) {
+		name = PQfname(r, col);
+		len = strlen(name);
+		buf_addvarint(L, b, len);
+		buf_add(L, b, name, len);
+		buf_add32(L, b, PQftable(r, col));
+		buf_add16(L, b, PQftablecol(r, col));
+		buf_add16(L, b, PQfformat(r, col));
+		buf_add32(L, b, PQftype(r, col));
+		buf_add16(L, b, PQfsize(r, col));
+		buf_add32(L, b, PQfmod(r, col));
+	}
+
+	nb = (nfields + 7) / 8;
+	for (row = 0; row < ntuples; row++) {
+		buf_reserve(L, b, nb);
+		off = b->len;
+		memset(b->data + off, 0, nb);
+		b->len += nb;
+		for (col = 0; col < nfields; col++)
+			if (PQgetisnull(r, row, col))
+				b->data[off + col / 8] |= 1 << (col % 8);
+		for (col = 0; col < nfields; col++)
+			if (!PQgetisnull(r, row, col)) {
+				len = PQgetlength(r, row, col);
+				buf_addvarint(L, b, len);
+				buf_add(L, b, PQgetvalue(r, row, col), len);
+			}
+	}
+}
+
+/* Rebuild a serialized result, returns NULL and sets *err on failure */
+static PGresult *
+deserialize_result(const char *p, size_t len, const char **err)
+{
+	PGresAttDesc *attrs;
+	PGresult *r;
+	const char *end = p + len, *bitmap;
+	char *names;
+	uint64_t v;
+	uint32_t row, ntuples;
+	int col, nfields, nb;
+
+	*err = "invalid serialized result";
+	if (len < 12 || memcmp(p, "PGR", 3))
+		return NULL;
+	if (p[3] != SERIAL_VERSION) {
+		*err = "unsupported serialization version";
+		return NULL;
+	}
+	nfields = get32(p + 4);
+	ntuples = get32(p + 8);
+	p += 12;
+	if (nfields < 0 || nfields > 1664)
+		return NULL;
+
+	/* The attributes, followed by their names, which are at most len */
+	if ((attrs = malloc(nfields * sizeof(PGresAttDesc) + len + nfields))
+	    == NULL) {
+		*err = "out of memory";
+		return NULL;
+	}
+	names = (char *)(attrs + nfields);
+	r = NULL;
+	for (col = 0; col < nfields; col++) {
+		if (!get_varint(&p, end, &v) || v > (uint64_t)(end - p) ||
+		    (uint64_t)(end - p) - v < 16)
+			goto bad;
+		attrs[col].name = names;
+		memcpy(names, p, v);
+		names[v] = '\0';
+		names += v + 1;
+		p += v;
+		attrs[col].tableid = get32(p);
+		attrs[col].columnid = (int16_t)get16(p + 4);
+		attrs[col].format = (int16_t)get16(p + 6);
+		attrs[col].typid = get32(p + 8);
+		attrs[col].typlen = (int16_t)get16(p + 12);
+		attrs[col].atttypmod = (int32_t)get32(p + 14);
+		p += 18;
+	}
+	nb = (nfields + 7) / 8;
+	if (nfields == 0 ? ntuples != 0 : ntuples > (end - p) / nb)
+		goto bad;
+
+	*err = "out of memory";
+	if ((r = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK)) == NULL ||
+	    !PQsetResultAttrs(r, nfields, attrs))
+		goto bad;
+	*err = "invalid serialized result";
+	for (row = 0; row < ntuples; row++) {
+		if (end - p < nb)
+			goto bad;
+		bitmap = p;
+		p += nb;
+		for (col = 0; col < nfields; col++) {
+			if (bitmap[col / 8] & (1 << (col % 8))) {
+				if (col == 0 && !PQsetvalue(r, row, 0, NULL, -1))
+					goto bad;
+				continue;
+			}
+			if (!get_varint(&p, end, &v) ||
+			    v > (uint64_t)(end - p) || v > INT_MAX ||
+			    !PQsetvalue(r, row, col, (char *)p, v))
+				goto bad;
+			p += v;
+		}
+	}
+	if (p != end)
+		goto bad;
+	free(attrs);
+	return r;
+bad:
+	PQclear(r);
+	free(attrs);
+	return NULL;
+}
+
+/*
+ * Shared result cache
+ *
+ * pgsql.sharedCache(path [, opts]) maps the file at path, creating it
+ * with opts.size bytes (default 64 MB) divided into slots of opts.slot
+ * bytes (default 64 kB) if it does not exist, so that all processes
+ * mapping the same file share the cached results.  shc:exec(conn,
+ * command, ...) works like cache:exec() of the process local cache.
+ * Results are serialized into a slot chosen by the hash of the key among
+ * SHCACHE_PROBE consecutive slots, replacing an expired or the oldest
+ * entry; results larger than a slot are not cached.  Entries expire after
+ * opts.ttl milliseconds (default 60000).
+ *
+ * Readers don't take locks: a slot's sequence number is odd while it is
+ * written and readers retry or give up if it changed while they copied
+ * the entry.  Writers lock a slot with a compare and swap of its lock word,
+ * which holds the pid of the owner and the time it was taken.  A lock
+ * older than SHCACHE_LOCKTIME is considered left by a dead process and
+ * taken over, also by a compare and swap, so that only one process can
+ * win it.  Releasing is a compare and swap from the owned value as well;
+ * if it fails, the lock was taken over and the write is not counted.  A
+ * writer that was taken over may still be writing while the new owner
+ * publishes the slot, so readers verify the hash of the value they copied,
+ * which continues the hash of the key.
+ */
+#define SHCACHE_PROBE		8
+#define SHCACHE_HDRSIZE		64
+#define SHCACHE_LOCKTIME	1000
+#define SHCACHE_FNVBASIS	0xcbf29ce484222325ULL
+
+static int64_t
+clock_wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-		for (n = 0; n < nParams; n++)
-			get_param(L, 3 + n, n, NULL, paramValues, paramLengths,
-			    paramFormats);
-	} else {
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
+/* FNV-1a, continuing from h */
+static uint64_t
+shc_hash(uint64_t h, const char *p, size_t len)
+{
+	while (len--) {
+		h ^= (unsigned char)*p++;
+		h *= 0x100000001b3ULL;
 	}
-	luaL_checkstack(L, 2, "out of stack space");
+	return h;
+}
+
+static shslot *
+shc_slot(shcache *c, uint64_t n)
+{
+	return (shslot *)((char *)c->hdr + SHCACHE_HDRSIZE +
+	    (n % c->hdr->nslots) * c->hdr->slotsize);
+}
+
+/* Copy the value of a key to b, return 0 if it is not found */
+static int
+shc_lookup(lua_State *L, shcache *c, const char *key, size_t keylen,
+    uint64_t h, pgbuf *b)
+{
+	shslot *s;
+	size_t room;
+	uint64_t check;
+	uint32_t seq, vallen;
+	int64_t now;
+	int n, tries;
+
+	room = c->hdr->slotsize - sizeof(shslot);
+	if (keylen > room)
+		return 0;
+	now = clock_wall_ms();
+	for (n = 0; n < SHCACHE_PROBE; n++) {
+		s = shc_slot(c, h + n);
+		for (tries = 0; tries < 4; tries++) {
+			seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+			if ((seq & 1) || s->hash != h || s->keylen != keylen ||
+			    s->expires <= now)
+				break;
+			vallen = s->vallen;
+			check = s->check;
+			if (vallen > room - keylen ||
+			    memcmp(s->data, key, keylen) != 0)
+				break;
+			b->len = 0;
+			buf_add(L, b, s->data + keylen, vallen);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+				continue;
+			if (shc_hash(h, b->data, b->len) != check)
+				break;
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQexecPrepared(conn, command, nParams,
-	    (const char * const*)paramValues, paramLengths, paramFormats, 0);
-	if (*res == NULL)
-		lua_pushnil(L);
-	else
-		luaL_setmetatable(L, RES_METATABLE);
-	return 1;
+/* Lock a slot, return the lock word owned or 0 */
+static uint64_t
+shc_lock(shslot *s, int64_t now)
+{
+	uint64_t lock, mine;
+	uint32_t seq;
+
+	mine = (uint64_t)getpid() << 32 | (uint32_t)now;
+	lock = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+	if (lock != 0 && (int32_t)((uint32_t)now - (uint32_t)lock) <
+	    SHCACHE_LOCKTIME)
+		return 0;
+	if (!__atomic_compare_exchange_n(&s->lock, &lock, mine, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 0;
+
+	/* A dead owner may have left the sequence number odd */
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->seq, seq + (seq & 1 ? 2 : 1), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return mine;
 }
 
+/* Publish and unlock a slot, return 0 if the lock was taken over */
 static int
-conn_describePrepared(lua_State *L)
+shc_unlock(shslot *s, uint64_t mine)
 {
-	PGconn *conn;
-	PGresult **res;
-	const char *name;
+	uint32_t seq;
 
-	conn = pgsql_conn(L, 1);
-	name = luaL_checkstring(L, 2);
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&s->lock, __ATOMIC_ACQUIRE) != mine ||
+	    !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, 0,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return 0;
+	return __atomic_compare_exchange_n(&s->lock, &mine, 0, 0,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
 
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQdescribePrepared(conn, name);
-	if (*res == NULL)
-		lua_pushnil(L);
-	else
-		luaL_setmetatable(L, RES_METATABLE);
+/* Store a value, return 0 if it does not fit or the slot is locked */
+static int
+shc_store(shcache *c, const char *key, size_t keylen, uint64_t h,
+    const char *val, size_t vallen)
+{
+	shslot *s, *victim = NULL;
+	uint64_t lock;
+	int64_t now;
+	int n;
+
+	if (keylen + vallen > c->hdr->slotsize - sizeof(shslot))
+		return 0;
+	now = clock_wall_ms();
+	for (n = 0; n < SHCACHE_PROBE; n++) {
+		s = shc_slot(c, h + n);
+		if (s->hash == h && s->keylen == keylen &&
+		    !memcmp(s->data, key, keylen)) {
+			victim = s;
+			break;
+		}
+		if (s->expires <= now) {
+			if (victim == NULL || victim->expires > now)
+				victim = s;
+		} else if (victim == NULL || (victim->expires > now &&
+		    s->stamp < victim->stamp))
+			victim = s;
+	}
+	if ((lock = shc_lock(victim, now)) == 0)
+		return 0;
+	victim->hash = h;
+	victim->keylen = keylen;
+	victim->vallen = vallen;
+	victim->check = shc_hash(h, val, vallen);
+	victim->expires = now + c->ttl;
+	victim->stamp = now;
+	memcpy(victim->data, key, keylen);
+	memcpy(victim->data + keylen, val, vallen);
+	return shc_unlock(victim, lock);
+}
+
+static int
+pgsql_sharedCache(lua_State *L)
+{
+	struct stat st;
+	shcache *c;
+	shheader *hdr;
+	const char *path;
+	lua_Integer size, slot, ttl;
+	void *map;
+	int fd, err, created = 0;
+
+	path = luaL_checkstring(L, 1);
+	size = 64 * 1024 * 1024;
+	slot = 64 * 1024;
+	ttl = 60000;
+	if (lua_istable(L, 2)) {
+		if (lua_getfield(L, 2, "size") != LUA_TNIL)
+			size = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 2, "slot") != LUA_TNIL)
+			slot = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 2, "ttl") != LUA_TNIL)
+			ttl = luaL_checkinteger(L, -1);
+		lua_pop(L, 3);
+	}
+	luaL_argcheck(L, slot >= 256 && slot <= 1 << 30, 2, "invalid slot size");
+	slot = (slot + 63) & ~63;
+	luaL_argcheck(L, size >= SHCACHE_HDRSIZE + SHCACHE_PROBE * slot, 2,
+	    "invalid size");
+	luaL_argcheck(L, ttl > 0, 2, "invalid ttl");
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+		goto fail;
+	if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1)
+		goto failfd;
+	if (st.st_size == 0) {
+		size = SHCACHE_HDRSIZE + (size - SHCACHE_HDRSIZE) / slot * slot;
+		if (ftruncate(fd, size) == -1)
+			goto failfd;
+		st.st_size = size;
+		created = 1;
+	} else if (st.st_size < SHCACHE_HDRSIZE + SHCACHE_PROBE * 256)
+		goto invalid;
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0);
+	if (map == MAP_FAILED)
+		goto failfd;
+	hdr = map;
+	if (created) {
+		/* The lock keeps others out until the header is written */
+		hdr->slotsize = slot;
+		hdr->nslots = (st.st_size - SHCACHE_HDRSIZE) / slot;
+		hdr->version = SHCACHE_VERSION;
+		memcpy(hdr->magic, SHCACHE_MAGIC, sizeof hdr->magic);
+	} else if (memcmp(hdr->magic, SHCACHE_MAGIC, sizeof hdr->magic) ||
+	    hdr->version != SHCACHE_VERSION || hdr->slotsize < 256 ||
+	    hdr->slotsize % 64 || hdr->nslots < SHCACHE_PROBE ||
+	    hdr->nslots > (uint64_t)(st.st_size - SHCACHE_HDRSIZE) /
+	    hdr->slotsize) {
+		munmap(map, st.st_size);
+		goto invalid;
+	}
+	/* The mapping would keep the file locked */
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	c = lua_newuserdata(L, sizeof(shcache));
+	memset(c, 0, sizeof(shcache));
+	c->hdr = hdr;
+	c->maplen = st.st_size;
+	c->ttl = ttl;
+	luaL_setmetatable(L, SHCACHE_METATABLE);
 	return 1;
+
+invalid:
+	close(fd);
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: not a shared cache file", path);
+	return 2;
+failfd:
+	err = errno;
+	close(fd);
+	errno = err;
+fail:
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", path, strerror(errno));
+	return 2;
 }
 
-static int
-conn_describePortal(lua_State *L)
+static shcache *
+shc_check(lua_State *L, int n)
 {
-	PGconn *conn;
-	PGresult **res;
-	const char *name;
+	shcache *c = luaL_checkudata(L, n, SHCACHE_METATABLE);
 
-	conn = pgsql_conn(L, 1);
-	name = luaL_checkstring(L, 2);
+	if (c->hdr == NULL)
+		luaL_argerror(L, n, "shared cache is closed");
+	return c;
+}
 
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQdescribePortal(conn, name);
-	if (*res == NULL)
-		lua_pushnil(L);
-	else
+/* shc:exec(conn, command, ...) */
+static int
+shc_exec(lua_State *L)
+{
+	shcache *c;
+	PGconn *conn;
+	PGresult *r, **res;
+	pgbuf *b;
+	const char *key, *err;
+	size_t keylen;
+	uint64_t h;
+	int top, n;
+
+	c = shc_check(L, 1);
+	conn = pgsql_conn(L, 2);
+	luaL_checkstring(L, 3);
+	top = lua_gettop(L);
+	luaL_checkstack(L, top + 8, "out of stack space");
+
+	if (!cache_key(L, 3, top)) {
+		lua_pushcfunction(L, top > 3 ? conn_execParams : conn_exec);
+		lua_insert(L, 2);
+		lua_call(L, top - 1, LUA_MULTRET);
+		return lua_gettop(L) - 1;
+	}
+	/* Results depend on the database and role */
+	lua_pushfstring(L, "%s\n%s\n%s\n%s\n", PQhost(conn), PQport(conn),
+	    PQdb(conn), PQuser(conn));
+	lua_insert(L, -2);
+	lua_concat(L, 2);
+	key = lua_tolstring(L, -1, &keylen);
+	h = shc_hash(SHCACHE_FNVBASIS, key, keylen);
+	b = buf_new(L);
+
+	if (shc_lookup(L, c, key, keylen, h, b) &&
+	    (r = deserialize_result(b->data, b->len, &err)) != NULL) {
+		c->hits++;
+		res = lua_newuserdata(L, sizeof(PGresult *));
+		*res = r;
 		luaL_setmetatable(L, RES_METATABLE);
-	return 1;
+		res_setconn(L, 2);
+		return 1;
+	}
+	c->misses++;
+
+	lua_pushcfunction(L, top > 3 ? conn_execParams : conn_exec);
+	for (n = 2; n <= top; n++)
+		lua_pushvalue(L, n);
+	lua_call(L, top - 1, LUA_MULTRET);
+	n = lua_gettop(L) - (top + 2);
+	if (n == 1 && luaL_testudata(L, -1, RES_METATABLE) != NULL &&
+	    PQresultStatus(r = *(PGresult **)lua_touserdata(L, -1)) ==
+	    PGRES_TUPLES_OK) {
+		b->len = 0;
+		serialize_result(L, r, b);
+		if (shc_store(c, key, keylen, h, b->data, b->len))
+			c->stores++;
+	}
+	return n;
 }
 
+/* shc:clear() empties all slots */
 static int
-conn_escapeString(lua_State *L)
+shc_clear(lua_State *L)
 {
-	PGconn *d;
-	size_t len;
-	char *buf;
-	const char *str;
-	int error;
+	shcache *c = shc_check(L, 1);
+	shslot *s;
+	uint64_t n, lock;
+	int64_t now = clock_wall_ms();
 
-	d = pgsql_conn(L, 1);
-
-	str = lua_tolstring(L, 2, &len);
-	if (str == NULL) {
-		lua_pushnil(L);
-		return 1;
+	for (n = 0; n < c->hdr->nslots; n++) {
+		s = shc_slot(c, n);
+		if (s->expires != 0 && (lock = shc_lock(s, now)) != 0) {
+			s->expires = 0;
+			shc_unlock(s, lock);
+		}
 	}
-	buf = lua_newuserdata(L, 2 * (len + 1));
+	return 0;
+}
 
-	PQescapeStringConn(d, buf, str, len, &error);
-	if (!error)
-		lua_pushstring(L, buf);
-	else
-		lua_pushnil(L);
+/* shc:stats() returns the slot counts and the counters of this process */
+static int
+shc_stats(lua_State *L)
+{
+	shcache *c = shc_check(L, 1);
+	uint64_t n, used = 0;
+	int64_t now = clock_wall_ms();
+
+	for (n = 0; n < c->hdr->nslots; n++)
+		if (shc_slot(c, n)->expires > now)
+			used++;
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, c->hdr->nslots);
+	lua_setfield(L, -2, "slots");
+	lua_pushinteger(L, c->hdr->slotsize);
+	lua_setfield(L, -2, "slotSize");
+	lua_pushinteger(L, used);
+	lua_setfield(L, -2, "used");
+	lua_pushinteger(L, c->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, c->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, c->stores);
+	lua_setfield(L, -2, "stores");
 	return 1;
 }
 
 static int
-conn_escapeLiteral(lua_State *L)
+shc_close(lua_State *L)
 {
-	const char *s;
-	char **p;
-	PGconn *d;
-	size_t len;
+	shcache *c = luaL_checkudata(L, 1, SHCACHE_METATABLE);
 
-	d = pgsql_conn(L, 1);
-	s = luaL_checklstring(L, 2, &len);
-	p = gcmalloc(L, sizeof(char *));
-	*p = PQescapeLiteral(d, s, len);
-	lua_pushstring(L, *p);
-	gcfree(p);
+	if (c->hdr != NULL) {
+		munmap(c->hdr, c->maplen);
+		c->hdr = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Result set functions
+ */
+static int
+res_status(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQresultStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
 
 static int
-conn_escapeIdentifier(lua_State *L)
+res_resStatus(lua_State *L)
 {
-	const char *s;
-	char  **p;
-	PGconn *d;
-	size_t len;
+	lua_pushstring(L, PQresStatus(luaL_checkinteger(L, 2)));
+	return 1;
+}
 
-	d = pgsql_conn(L, 1);
-	s = luaL_checklstring(L, 2, &len);
-	p = gcmalloc(L, sizeof(char *));
-	*p = PQescapeIdentifier(d, s, len);
-	lua_pushstring(L, *p);
-	gcfree(p);
+static int
+res_errorMessage(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQresultErrorMessage(*(PGresult **)luaL_checkudata(L, 1,
+	    RES_METATABLE)));
 	return 1;
 }
 
 static int
-conn_escapeBytea(lua_State *L)
+res_errorField(lua_State *L)
 {
-	unsigned char **p;
-	const unsigned char *s;
-	PGconn *d;
-	size_t from_length, to_length;
+	char *field;
 
-	d = pgsql_conn(L, 1);
-	s = (const unsigned char *)luaL_checklstring(L, 2, &from_length);
-	p = gcmalloc(L, sizeof(char *));
-	*p = PQescapeByteaConn(d, s, from_length, &to_length);
-	if (*p) {
-		lua_pushlstring(L, (const char *)*p, to_length - 1);
-		gcfree(p);
-	} else
+	field = PQresultErrorField(
+	    *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    lua_tointeger(L, 2));
+	if (field == NULL)
 		lua_pushnil(L);
+	else
+		lua_pushstring(L, field);
 	return 1;
 }
 
-/*
- * Asynchronous Command Execution Functions
- */
 static int
-conn_sendQuery(lua_State *L)
+res_nfields(lua_State *L)
 {
-	lua_pushboolean(L, PQsendQuery(pgsql_conn(L, 1),
-	    luaL_checkstring(L, 2)));
+	lua_pushinteger(L,
+	    PQnfields(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
 
 static int
-conn_sendQueryParams(lua_State *L)
+res_ntuples(lua_State *L)
 {
-	PGconn *conn;
-	Oid *paramTypes;
-	char **paramValues;
-	const char *command;
-	int n, nParams, *paramLengths, *paramFormats;
-
-	conn = pgsql_conn(L, 1);
-	command = luaL_checkstring(L, 2);
-
-	nParams = lua_gettop(L) - 2;	/* subtract connection and command */
-
-	if (nParams) {
-		luaL_checkstack(L, 4 + nParams, "out of stack space");
-
-		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
-		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
-		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
-		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
+	lua_pushinteger(L,
+	    PQntuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
 
-		for (n = 0; n < nParams; n++)
-			get_param(L, 3 + n, n, paramTypes, paramValues,
-			   paramLengths, paramFormats);
-	} else {
-		paramTypes = NULL;
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
-	}
-	lua_pushboolean(L,
-	    PQsendQueryParams(conn, command, nParams, paramTypes,
-	    (const char * const*)paramValues, paramLengths, paramFormats, 0));
+static int
+res_fname(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQfname(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
 	return 1;
 }
 
 static int
-conn_sendPrepare(lua_State *L)
+res_fnumber(lua_State *L)
 {
-	PGconn *conn;
-	Oid *paramTypes;
-	const char *command, *name;
-	int n, nParams;
+	lua_pushinteger(L,
+	    PQfnumber(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkstring(L, 2)) + 1);
+	return 1;
+}
 
-	conn = pgsql_conn(L, 1);
-	command = luaL_checkstring(L, 2);
-	name = luaL_checkstring(L, 3);
+static int
+res_ftable(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQftable(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
 
-	nParams = lua_gettop(L) - 3;	/* subtract connection, name, command */
+static int
+res_ftablecol(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQftablecol(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
 
-	if (nParams) {
-		paramTypes = lua_newuserdata(L, nParams * sizeof(Oid));
+static int
+res_fformat(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQfformat(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
 
-		for (n = 0; n < nParams; n++)
-			get_param(L, 4 + n, n, paramTypes, NULL, NULL, NULL);
-	} else
-		paramTypes = NULL;
-	lua_pushboolean(L,
-	    PQsendPrepare(conn, command, name, nParams, paramTypes));
+static int
+res_ftype(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQftype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
 	return 1;
 }
 
 static int
-conn_sendQueryPrepared(lua_State *L)
+res_fmod(lua_State *L)
 {
-	PGconn *conn;
-	char **paramValues;
-	const char *name;
-	int n, nParams, *paramLengths, *paramFormats;
-
-	conn = pgsql_conn(L, 1);
-	name = luaL_checkstring(L, 2);
-
-	nParams = lua_gettop(L) - 2;	/* subtract connection and name */
-
-	if (nParams) {
-		luaL_checkstack(L, 3 + nParams, "out of stack space");
-
-		paramValues = lua_newuserdata(L, nParams * sizeof(char *));
-		paramLengths = lua_newuserdata(L, nParams * sizeof(int));
-		paramFormats = lua_newuserdata(L, nParams * sizeof(int));
-
-		for (n = 0; n < nParams; n++)
-			get_param(L, 3 + n, n, NULL, paramValues, paramLengths,
-			    paramFormats);
-	} else {
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
-	}
-	lua_pushboolean(L,
-	    PQsendQueryPrepared(conn, name, nParams,
-	    (const char * const*)paramValues, paramLengths, paramFormats, 0));
+	lua_pushinteger(L,
+	    PQfmod(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
 	return 1;
 }
 
 static int
-conn_sendDescribePrepared(lua_State *L)
+res_fsize(lua_State *L)
 {
-	lua_pushboolean(L,
-	    PQsendDescribePrepared(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
+	lua_pushinteger(L,
+	    PQfsize(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
 	return 1;
 }
 
 static int
-conn_sendDescribePortal(lua_State *L)
+res_binaryTuples(lua_State *L)
 {
 	lua_pushboolean(L,
-	    PQsendDescribePortal(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
+	    PQbinaryTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
 
 static int
-conn_getResult(lua_State *L)
+res_getvalue(lua_State *L)
 {
-	PGresult *r, **res;
-
-	r = PQgetResult(pgsql_conn(L, 1));
-	if (r == NULL)
-		lua_pushnil(L);
-	else {
-		res = lua_newuserdata(L, sizeof(PGresult *));
-		*res = r;
-		luaL_setmetatable(L, RES_METATABLE);
-	}
+	lua_pushstring(L,
+	    PQgetvalue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
 	return 1;
 }
 
 static int
-conn_cancel(lua_State *L)
+res_getisnull(lua_State *L)
 {
-	PGconn *d;
-	PGcancel *cancel;
-	char errbuf[256];
-	int res = 1;
+	lua_pushboolean(L,
+	    PQgetisnull(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
+	return 1;
+}
 
-	d = pgsql_conn(L, 1);
-	cancel = PQgetCancel(d);
-	if (cancel != NULL) {
-		res = PQcancel(cancel, errbuf, sizeof errbuf);
-		if (!res) {
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, errbuf);
-		} else
-			lua_pushboolean(L, 1);
-		PQfreeCancel(cancel);
-	} else
-		lua_pushboolean(L, 0);
-	return res == 1 ? 1 : 2;
+static int
+res_getlength(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQgetlength(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
+	return 1;
 }
 
-#if PG_VERSION_NUM >= 140000
-/*
- * Pipeline mode
- */
 static int
-conn_pipelineStatus(lua_State *L)
+res_nparams(lua_State *L)
 {
-	lua_pushinteger(L, PQpipelineStatus(pgsql_conn(L, 1)));
+	lua_pushinteger(L,
+	    PQnparams(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
 
 static int
-conn_enterPipelineMode(lua_State *L)
+res_paramtype(lua_State *L)
 {
-	lua_pushboolean(L, PQenterPipelineMode(pgsql_conn(L, 1)));
+	lua_pushinteger(L,
+	    PQparamtype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2)) - 1);
 	return 1;
 }
 
 static int
-conn_exitPipelineMode(lua_State *L)
+res_cmdStatus(lua_State *L)
 {
-	lua_pushboolean(L, PQexitPipelineMode(pgsql_conn(L, 1)));
+	lua_pushstring(L,
+	    PQcmdStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
 
 static int
-conn_pipelineSync(lua_State *L)
+res_cmdTuples(lua_State *L)
 {
-	lua_pushboolean(L, PQpipelineSync(pgsql_conn(L, 1)));
+	lua_pushstring(L,
+	    PQcmdTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
 
 static int
-conn_sendFlushRequest(lua_State *L)
+res_oidValue(lua_State *L)
 {
-	lua_pushboolean(L, PQsendFlushRequest(pgsql_conn(L, 1)));
+	lua_pushinteger(L,
+	    PQoidValue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
-#endif
 
-#if PG_VERSION_NUM >= 90200
 static int
-conn_setSingleRowMode(lua_State *L)
+res_oidStatus(lua_State *L)
 {
-	lua_pushboolean(L, PQsetSingleRowMode(pgsql_conn(L, 1)));
+	lua_pushstring(L,
+	    PQoidStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
 	return 1;
 }
-#endif
+
+/* Lua specific functions */
+static void
+copy_value(lua_State *L, PGresult *res, int row, int col, int convert)
+{
+	if (convert)
+		switch (PQftype(res, col)) {
+		case BOOLOID:
+			lua_pushboolean(L, strcmp(PQgetvalue(res, row, col), "f"));
+			return;
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+			lua_pushinteger(L, atol(PQgetvalue(res, row, col)));
+			return;
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			lua_pushnumber(L, atof(PQgetvalue(res, row, col)));
+			return;
+		}
+	lua_pushlstring(L, PQgetvalue(res, row, col),
+	    PQgetlength(res, row, col));
+}
+
+/* Minimum number of rows a decoding thread is started for */
+#define ROWS_PER_THREAD	1024
+#define MAX_THREADS	64
+
+/* Convert the values of a range of rows, run on a decoding thread */
+static void *
+rows_convert(void *arg)
+{
+	rowjob *j = arg;
+	cvalue *v;
+	const char *s;
+	int row, k;
+
+	for (row = j->lo; row < j->hi; row++) {
+		v = j->values + (size_t)row * j->nconv;
+		for (k = 0; k < j->nconv; k++) {
+			s = PQgetvalue(j->res, row, j->cols[k]);
+			switch (j->kinds[k]) {
+			case KIND_BOOL:
+				v[k].b = strcmp(s, "f") != 0;
+				break;
+			case KIND_INT8:
+				v[k].i = atol(s);
+				break;
+			default:
+				v[k].n = atof(s);
+			}
+		}
+	}
+	return NULL;
+}
 
 /*
- * Asynchronous Notification Functions
+ * Convert the numeric and boolean columns of a result on nthreads
+ * threads, each handling a range of rows.  Returns the garbage collected
+ * memory holding the converted values row by row, or NULL if there is
+ * nothing to convert.  conv[col] is set to the index of the column within
+ * a row of *nconvp values, or -1.
+ */
+static cvalue **
+rows_convert_threaded(lua_State *L, PGresult *res, int nthreads, int *conv,
+    int *nconvp)
+{
+	rowjob *jobs;
+	cvalue **values;
+	int *cols, *kinds;
+	int n, col, nconv, ntuples, nfields;
+
+	ntuples = PQntuples(res);
+	nfields = PQnfields(res);
+	cols = lua_newuserdata(L, nfields * sizeof(int));
+	kinds = lua_newuserdata(L, nfields * sizeof(int));
+	for (col = nconv = 0; col < nfields; col++) {
+		conv[col] = -1;
+		switch (PQftype(res, col)) {
+		case BOOLOID:
+			kinds[nconv] = KIND_BOOL;
+			break;
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+			kinds[nconv] = KIND_INT8;
+			break;
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			kinds[nconv] = KIND_FLOAT8;
+			break;
+		default:
+			continue;
+		}
+		conv[col] = nconv;
+		cols[nconv++] = col;
+	}
+	if ((*nconvp = nconv) == 0)
+		return NULL;
+
+	values = gcmalloc(L, sizeof(cvalue *));
+	if ((size_t)ntuples > SIZE_MAX / sizeof(cvalue) / nconv ||
+	    (*values = malloc((size_t)ntuples * nconv * sizeof(cvalue))) ==
+	    NULL)
+		luaL_error(L, "out of memory");
+
+	jobs = lua_newuserdata(L, nthreads * sizeof(rowjob));
+	for (n = 0; n < nthreads; n++) {
+		jobs[n].res = res;
+		jobs[n].cols = cols;
+		jobs[n].kinds = kinds;
+		jobs[n].nconv = nconv;
+		jobs[n].lo = (int)((int64_t)ntuples * n / nthreads);
+		jobs[n].hi = (int)((int64_t)ntuples * (n + 1) / nthreads);
+		jobs[n].values = *values;
+	}
+
+	/* The calling thread converts the first range itself */
+	for (n = 1; n < nthreads; n++)
+		if (pthread_create(&jobs[n].thread, NULL, rows_convert,
+		    &jobs[n])) {
+			rows_convert(&jobs[n]);
+			jobs[n].res = NULL;
+		}
+	rows_convert(&jobs[0]);
+	for (n = 1; n < nthreads; n++)
+		if (jobs[n].res != NULL)
+			pthread_join(jobs[n].thread, NULL);
+	lua_pop(L, 1);
+	return values;
+}
+
+/*
+ * Copy all rows of a result to a table of tables.  The row tables are
+ * presized and the field names are pushed once and then reused as keys.
+ * If nthreads is greater than one, the conversion of large results is
+ * split over as many threads.
  */
 static int
-conn_notifies(lua_State *L)
-{
-	PGnotify **notify, *n;
+copy_rows(lua_State *L, PGresult *res, int array, int convert, int nthreads)
+{
+	cvalue **values, *v;
+	int64_t start;
+	int row, col, ntuples, nfields, names = 0, nconv = 0, *conv;
+
+	start = span_clock(L);
+	ntuples = PQntuples(res);
+	nfields = PQnfields(res);
+
+	values = NULL;
+	conv = NULL;
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if (nthreads > ntuples / ROWS_PER_THREAD)
+		nthreads = ntuples / ROWS_PER_THREAD;
+	if (convert && nthreads > 1) {
+		conv = lua_newuserdata(L, nfields * sizeof(int));
+		values = rows_convert_threaded(L, res, nthreads, conv,
+		    &nconv);
+	}
 
-	n = PQnotifies(pgsql_conn(L, 1));
-	if (n == NULL)
-		lua_pushnil(L);
-	else {
-		notify = lua_newuserdata(L, sizeof(PGnotify *));
-		*notify = n;
-		luaL_setmetatable(L, NOTIFY_METATABLE);
+	lua_createtable(L, ntuples, 0);
+	if (!array) {
+		luaL_checkstack(L, nfields + 4, "out of stack space");
+		names = lua_gettop(L) + 1;
+		for (col = 0; col < nfields; col++)
+			lua_pushstring(L, PQfname(res, col));
+	}
+	for (row = 0; row < ntuples; row++) {
+		lua_createtable(L, array ? nfields : 0, array ? 0 : nfields);
+		v = values != NULL ? *values + (size_t)row * nconv : NULL;
+		for (col = 0; col < nfields; col++) {
+			if (!array)
+				lua_pushvalue(L, names + col);
+			if (v == NULL || conv[col] == -1)
+				copy_value(L, res, row, col, convert);
+			else
+				switch (PQftype(res, col)) {
+				case BOOLOID:
+					lua_pushboolean(L, v[conv[col]].b);
+					break;
+				case INT2OID:
+				case INT4OID:
+				case INT8OID:
+					lua_pushinteger(L, v[conv[col]].i);
+					break;
+				default:
+					lua_pushnumber(L, v[conv[col]].n);
+				}
+			if (array)
+				lua_rawseti(L, -2, col + 1);
+			else
+				lua_rawset(L, -3);
+		}
+		lua_rawseti(L, array ? -2 : names - 1, row + 1);
 	}
+	if (!array)
+		lua_pop(L, nfields);
+	if (values != NULL)
+		gcfree(values);
+	if (start >= 0)
+		span_decoded(L, res, start);
 	return 1;
 }
 
+static int
+res_copy(lua_State *L)
+{
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	int convert;
+
+	convert = 0;	/* Do not convert numeric types */
+
+	if (lua_gettop(L) >= 2)
+		convert = lua_toboolean(L, 2);
+
+	return copy_rows(L, res, 0, convert, luaL_optinteger(L, 3, 1));
+}
+
 /*
- * Commands associated with the COPY command
+ * res:rows([mode [, convert [, nthreads]]]) returns all rows as tables,
+ * keyed by field name (mode 'hash', the default) or by field number (mode
+ * 'array').  Converting large results can be spread over nthreads threads.
  */
 static int
-conn_putCopyData(lua_State *L)
+res_rows(lua_State *L)
 {
-	const char *data;
-	size_t len;
-	int r;
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	static const char *const modes[] = { "hash", "array", NULL };
 
-	data = luaL_checklstring(L, 2, &len);
-	r = PQputCopyData(pgsql_conn(L, 1), data, len);
+	return copy_rows(L, res, luaL_checkoption(L, 2, "hash", modes),
+	    lua_toboolean(L, 3), luaL_optinteger(L, 4, 1));
+}
 
-	if (r != -1)
-		lua_pushboolean(L, r);
-	else
-		lua_pushnil(L);
-	return 1;
+/*
+ * Push the type catalogue of the connection a result was obtained from,
+ * return its stack index or 0 if it is not available.
+ */
+static int
+res_types(lua_State *L, int res)
+{
+	PGconn **conn;
+
+	lua_getuservalue(L, res);
+	conn = luaL_testudata(L, -1, CONN_METATABLE);
+	if (conn != NULL && *conn != NULL) {
+		if (pgsql_types(L, -1)) {
+			lua_remove(L, -2);
+			return lua_gettop(L);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return 0;
 }
 
 static int
-conn_putCopyEnd(lua_State *L)
+res_decode(lua_State *L)
 {
-	PGconn *conn;
-	int r;
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	Oid oid;
+	int row, col, kind, types;
 
-	conn = pgsql_conn(L, 1);
-	r = PQputCopyEnd(conn, luaL_optstring(L, 2, NULL));
+	row = luaL_checkinteger(L, 2) - 1;
+	col = luaL_checkinteger(L, 3) - 1;
+	luaL_argcheck(L, row >= 0 && row < PQntuples(res), 2,
+	    "row out of range");
+	luaL_argcheck(L, col >= 0 && col < PQnfields(res), 3,
+	    "column out of range");
 
-	if (r != -1)
-		lua_pushboolean(L, r);
-	else
+	if (PQgetisnull(res, row, col)) {
 		lua_pushnil(L);
+		return 1;
+	}
+
+	/* Only consult the type catalogue for non built-in types */
+	oid = PQftype(res, col);
+	types = 0;
+	if ((kind = type_kind(L, 0, &oid)) == KIND_OTHER &&
+	    (types = res_types(L, 1)) != 0)
+		kind = type_kind(L, types, &oid);
+	decode_kind(L, types, kind, oid, PQfformat(res, col),
+	    PQgetvalue(res, row, col), PQgetlength(res, row, col));
 	return 1;
 }
 
+/*
+ * Typed column vectors
+ *
+ * res:vector(col) decodes a boolean or numeric column once into a vector
+ * userdata, which is indexed like an array and has no per value Lua
+ * objects.
+ */
 static int
-conn_getCopyData(lua_State *L)
+res_vector(lua_State *L)
 {
-	PGconn *conn;
-	int async, len;
-	char **data;
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	vector *v;
+	const char *value;
+	size_t size, width;
+	Oid oid;
+	int row, col, ntuples, kind, vkind, binary;
+
+	col = luaL_checkinteger(L, 2) - 1;
+	luaL_argcheck(L, col >= 0 && col < PQnfields(res), 2,
+	    "column out of range");
+	oid = PQftype(res, col);
+	switch (kind = type_kind(L, 0, &oid)) {
+	case KIND_BOOL:
+		vkind = KIND_BOOL;
+		width = 1;
+		break;
+	case KIND_INT2:
+	case KIND_INT4:
+	case KIND_INT8:
+	case KIND_OID:
+		vkind = KIND_INT8;
+		width = sizeof(int64_t);
+		break;
+	case KIND_FLOAT4:
+	case KIND_FLOAT8:
+	case KIND_NUMERIC:
+		vkind = KIND_FLOAT8;
+		width = sizeof(double);
+		break;
+	default:
+		return luaL_argerror(L, 2, "column is not boolean or numeric");
+	}
 
-	conn = pgsql_conn(L, 1);
-	async = lua_toboolean(L, 2);
-	data = gcmalloc(L, sizeof(char *));
-	len = PQgetCopyData(conn, data, async);
-	if (len > 0)
-		lua_pushlstring(L, *data, len);
-	else if (len == 0)	/* no data yet */
-		lua_pushboolean(L, 0);
-	else if (len == -1)	/* copy done */
-		lua_pushboolean(L, 1);
-	else			/* an error occurred */
-		lua_pushnil(L);
-	gcfree(data);
+	ntuples = PQntuples(res);
+	size = sizeof(vector) + ntuples * width + (ntuples + 7) / 8;
+	v = lua_newuserdata(L, size);
+	v->kind = vkind;
+	v->len = ntuples;
+	v->nulls = 0;
+	v->valid = (unsigned char *)v->data + ntuples * width;
+	memset(v->data, 0, ntuples * width + (ntuples + 7) / 8);
+	luaL_setmetatable(L, VECTOR_METATABLE);
+
+	binary = PQfformat(res, col);
+	for (row = 0; row < ntuples; row++) {
+		if (PQgetisnull(res, row, col)) {
+			v->nulls++;
+			continue;
+		}
+		v->valid[row / 8] |= 1 << row % 8;
+		value = PQgetvalue(res, row, col);
+		if (!binary) {
+			switch (v->kind) {
+			case KIND_BOOL:
+				((unsigned char *)v->data)[row] = *value == 't';
+				break;
+			case KIND_INT8:
+				v->data[row] = strtoll(value, NULL, 10);
+				break;
+			default:
+				((double *)v->data)[row] = strtod(value, NULL);
+			}
+			continue;
+		}
+		decode_kind(L, 0, kind, oid, binary, value,
+		    PQgetlength(res, row, col));
+		switch (v->kind) {
+		case KIND_BOOL:
+			((unsigned char *)v->data)[row] = lua_toboolean(L, -1);
+			break;
+		case KIND_INT8:
+			v->data[row] = lua_tointeger(L, -1);
+			break;
+		default:
+			((double *)v->data)[row] = lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+	}
 	return 1;
 }
 
-/*
- * Control functions
- */
 static int
-conn_clientEncoding(lua_State *L)
+vector_isnull(vector *v, int n)
 {
-	lua_pushstring(L,
-	    pg_encoding_to_char(PQclientEncoding(pgsql_conn(L, 1))));
-	return 1;
+	return !(v->valid[n / 8] & 1 << n % 8);
 }
 
-static int
-conn_setClientEncoding(lua_State *L)
+static void
+vector_push(lua_State *L, vector *v, int n)
 {
-	if (PQsetClientEncoding(pgsql_conn(L, 1), luaL_checkstring(L, 2)))
-		lua_pushboolean(L, 0);
-	else
-		lua_pushboolean(L, 1);
-	return 1;
+	switch (v->kind) {
+	case KIND_BOOL:
+		lua_pushboolean(L, ((unsigned char *)v->data)[n]);
+		break;
+	case KIND_INT8:
+		lua_pushinteger(L, v->data[n]);
+		break;
+	default:
+		lua_pushnumber(L, ((double *)v->data)[n]);
+	}
 }
 
 static int
-conn_setErrorVerbosity(lua_State *L)
+vector_index(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQsetErrorVerbosity(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
+	lua_Integer n;
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		n = luaL_checkinteger(L, 2) - 1;
+		if (n < 0 || n >= v->len || vector_isnull(v, n))
+			lua_pushnil(L);
+		else
+			vector_push(L, v, n);
+	} else if (lua_getmetatable(L, 1)) {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+	} else
+		lua_pushnil(L);
 	return 1;
 }
 
 static int
-closef_untrace(lua_State *L)
+vector_len(lua_State *L)
 {
-	PGconn *conn;
-	lua_CFunction cf;
-
-	luaL_checkudata(L, 1, LUA_FILEHANDLE);
-
-	/* untrace so libpq doesn't segfault */
-	lua_getuservalue(L, 1);
-	lua_getfield(L, -1, "PGconn");
-	conn = pgsql_conn(L, -1);
-	lua_getfield(L, -2, "old_uservalue");
-	lua_getfield(L, -3, "old_closef");
-
-	cf = lua_tocfunction(L, -1);
-	lua_pop(L, 1);
-	lua_setuservalue(L, 1);
-
-	PQuntrace(conn);
-
-	/* let go of PGconn's reference to file handle */
-	lua_getuservalue(L, -1);
-	lua_pushnil(L);
-	lua_setfield(L, -2, "trace_file");
-
-	/* pop stream uservalue, PGconn, PGconn uservalue */
-	lua_pop(L, 3);
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
 
-	/* call original close function */
-	return (*cf)(L);
+	lua_pushinteger(L, v->len);
+	return 1;
 }
 
+/* vector:type() returns 'boolean', 'integer' or 'number' */
 static int
-conn_trace(lua_State *L)
+vector_type(lua_State *L)
 {
-	PGconn *conn;
-	luaL_Stream *stream;
-
-	conn = pgsql_conn(L, 1);
-	stream = luaL_checkudata(L, 2, LUA_FILEHANDLE);
-	luaL_argcheck(L, stream->f != NULL, 2, "invalid file handle");
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
 
-	/*
-	 * Keep a reference to the file object in uservalue of connection
-	 * so it doesn't get garbage collected.
-	 */
-	lua_getuservalue(L, 1);
-	lua_pushvalue(L, 2);
-	lua_setfield(L, -2, "trace_file");
-
-	/*
-	 * Swap out closef luaL_Stream member for our wrapper that will
-	 * untrace.
-	 */
-	lua_createtable(L, 0, 3);
-	lua_getuservalue(L, 2);
-	lua_setfield(L, -2, "old_uservalue");
-	lua_pushcfunction(L, stream->closef);
-	lua_setfield(L, -2, "old_closef");
-	lua_pushvalue(L, 1);
-	lua_setfield(L, -2, "PGconn");
-	lua_setuservalue(L, 2);
-	stream->closef = closef_untrace;
-
-	PQtrace(conn, stream->f);
-	return 0;
+	switch (v->kind) {
+	case KIND_BOOL:
+		lua_pushliteral(L, "boolean");
+		break;
+	case KIND_INT8:
+		lua_pushliteral(L, "integer");
+		break;
+	default:
+		lua_pushliteral(L, "number");
+	}
+	return 1;
 }
 
 static int
-conn_untrace(lua_State *L)
+vector_nulls(lua_State *L)
 {
-	PQuntrace(pgsql_conn(L, 1));
-
-	/* Let go of PGconn's reference to file handle. */
-	lua_getuservalue(L, 1);
-	lua_pushnil(L);
-	lua_setfield(L, -2, "trace_file");
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
 
-	return 0;
+	lua_pushinteger(L, v->nulls);
+	return 1;
 }
 
 /*
- * Miscellaneous Functions
+ * The aggregates skip NULL values.  Booleans count as 0 and 1, the sum of
+ * an integer vector is an integer.  Without values the sum is 0, the other
+ * aggregates return nil.
  */
 static int
-conn_consumeInput(lua_State *L)
+vector_sum(lua_State *L)
 {
-	lua_pushboolean(L, PQconsumeInput(pgsql_conn(L, 1)));
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
+	lua_Integer isum = 0;
+	double dsum = 0.0;
+	int n;
+
+	for (n = 0; n < v->len; n++) {
+		if (vector_isnull(v, n))
+			continue;
+		switch (v->kind) {
+		case KIND_BOOL:
+			isum += ((unsigned char *)v->data)[n];
+			break;
+		case KIND_INT8:
+			isum = (lua_Integer)((lua_Unsigned)isum + v->data[n]);
+			break;
+		default:
+			dsum += ((double *)v->data)[n];
+		}
+	}
+	if (v->kind == KIND_FLOAT8)
+		lua_pushnumber(L, dsum);
+	else
+		lua_pushinteger(L, isum);
 	return 1;
 }
 
 static int
-conn_isBusy(lua_State *L)
+vector_mean(lua_State *L)
 {
-	lua_pushboolean(L, PQisBusy(pgsql_conn(L, 1)));
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
+	double sum = 0.0;
+	int n;
+
+	if (v->len == v->nulls) {
+		lua_pushnil(L);
+		return 1;
+	}
+	for (n = 0; n < v->len; n++) {
+		if (vector_isnull(v, n))
+			continue;
+		switch (v->kind) {
+		case KIND_BOOL:
+			sum += ((unsigned char *)v->data)[n];
+			break;
+		case KIND_INT8:
+			sum += v->data[n];
+			break;
+		default:
+			sum += ((double *)v->data)[n];
+		}
+	}
+	lua_pushnumber(L, sum / (v->len - v->nulls));
 	return 1;
 }
 
 static int
-conn_setnonblocking(lua_State *L)
-{
-	int r;
-
-	r = PQsetnonblocking(pgsql_conn(L, 1), lua_toboolean(L, 2));
-	lua_pushboolean(L, !r);
+vector_minmax(lua_State *L, int max)
+{
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
+	double d, dm = 0.0;
+	int64_t i, im = 0;
+	int n, found = 0;
+
+	for (n = 0; n < v->len; n++) {
+		if (vector_isnull(v, n))
+			continue;
+		switch (v->kind) {
+		case KIND_BOOL:
+		case KIND_INT8:
+			i = v->kind == KIND_BOOL ?
+			    ((unsigned char *)v->data)[n] : v->data[n];
+			if (!found || (max ? i > im : i < im))
+				im = i;
+			break;
+		default:
+			d = ((double *)v->data)[n];
+			if (!found || (max ? d > dm : d < dm))
+				dm = d;
+		}
+		found = 1;
+	}
+	if (!found)
+		lua_pushnil(L);
+	else if (v->kind == KIND_BOOL)
+		lua_pushboolean(L, im);
+	else if (v->kind == KIND_INT8)
+		lua_pushinteger(L, im);
+	else
+		lua_pushnumber(L, dm);
 	return 1;
 }
 
 static int
-conn_isnonblocking(lua_State *L)
+vector_min(lua_State *L)
 {
-	lua_pushboolean(L, PQisnonblocking(pgsql_conn(L, 1)));
-	return 1;
+	return vector_minmax(L, 0);
 }
 
 static int
-conn_flush(lua_State *L)
+vector_max(lua_State *L)
 {
-	int r;
+	return vector_minmax(L, 1);
+}
 
-	r = PQflush(pgsql_conn(L, 1));
+/*
+ * vector:pointer() returns the addresses of the values and of the
+ * validity bitmap as light userdata, for use by other C modules.  They
+ * are valid as long as the vector is referenced.
+ */
+static int
+vector_pointer(lua_State *L)
+{
+	vector *v = luaL_checkudata(L, 1, VECTOR_METATABLE);
 
-	if (r >= 0)
-		lua_pushboolean(L, r == 0);
-	else
-		lua_pushnil(L);
-	return 1;
+	lua_pushlightuserdata(L, v->data);
+	lua_pushlightuserdata(L, v->valid);
+	return 2;
 }
 
-#if PG_VERSION_NUM >= 100000
-static int
-conn_encryptPassword(lua_State *L)
+/*
+ * Apache Arrow IPC stream export
+ *
+ * The flatbuffers of the schema and record batch messages are written
+ * front to back: a table is followed by the objects it refers to and the
+ * offsets to these are patched in when they are written.  All numbers
+ * are little endian.
+ */
+static void
+le_put(char *p, uint64_t v, int n)
 {
-	const char *algorithm = NULL;
-	char **pw;
+	int i;
 
-	if (lua_isstring(L, 4))
-		algorithm = lua_tostring(L, 4);
+	for (i = 0; i < n; i++)
+		p[i] = v >> 8 * i;
+}
 
-	pw = gcmalloc(L, sizeof(char *));
-	*pw = PQencryptPasswordConn(pgsql_conn(L, 1), luaL_checkstring(L, 2),
-	    luaL_checkstring(L, 3), algorithm);
-	if (*pw) {
-		lua_pushstring(L, *pw);
-		gcfree(pw);
-	} else
-		lua_pushnil(L);
-	return 1;
+static void
+fb_add(lua_State *L, pgbuf *b, uint64_t v, int n)
+{
+	buf_reserve(L, b, n);
+	le_put(b->data + b->len, v, n);
+	b->len += n;
 }
-#endif
 
-/* Notice processing */
 static void
-noticeReceiver(void *arg, const PGresult *r)
+fb_pad(lua_State *L, pgbuf *b, size_t align)
 {
-	notice *n = arg;
-	PGresult **res;
+	while (b->len % align)
+		fb_add(L, b, 0, 1);
+}
 
-	lua_rawgeti(n->L, LUA_REGISTRYINDEX, n->f);
-	res = lua_newuserdata(n->L, sizeof(PGresult *));
+/* Let the offset at slot point to the current position */
+static void
+fb_patch(pgbuf *b, size_t slot)
+{
+	le_put(b->data + slot, b->len - slot, 4);
+}
 
-	*res = (PGresult *)r;
-	luaL_setmetatable(n->L, RES_METATABLE);
+/*
+ * Write a table referred to by the offset at slot.  sizes[n] is the size
+ * of scalar field n, 0 if it is absent, or -4 for an offset whose
+ * position is returned in slots[n].
+ */
+static void
+fb_table(lua_State *L, pgbuf *b, size_t slot, int nfields, const int *sizes,
+    const uint64_t *values, size_t *slots)
+{
+	size_t vtable, table;
+	int n, size, off, offs[8];
+
+	for (n = 0, off = 4; n < nfields; n++) {
+		if ((size = abs(sizes[n])) == 0)
+			continue;
+		off = (off + size - 1) & ~(size - 1);
+		offs[n] = off;
+		off += size;
+	}
+	fb_pad(L, b, 2);
+	vtable = b->len;
+	fb_add(L, b, 4 + 2 * nfields, 2);
+	fb_add(L, b, off, 2);
+	for (n = 0; n < nfields; n++)
+		fb_add(L, b, sizes[n] ? offs[n] : 0, 2);
+	fb_pad(L, b, 8);
+	table = b->len;
+	fb_patch(b, slot);
+	fb_add(L, b, table - vtable, 4);
+	for (n = 0; n < nfields; n++) {
+		if (sizes[n] == 0)
+			continue;
+		while (b->len - table < (size_t)offs[n])
+			fb_add(L, b, 0, 1);
+		if (sizes[n] < 0) {
+			slots[n] = b->len;
+			fb_add(L, b, 0, 4);
+		} else
+			fb_add(L, b, values[n], sizes[n]);
+	}
+}
 
-	if (lua_pcall(n->L, 1, 0, 0))
-		luaL_error(n->L, "%s", lua_tostring(n->L, -1));
-	*res = NULL;	/* avoid double free */
+static void
+fb_string(lua_State *L, pgbuf *b, size_t slot, const char *s)
+{
+	size_t len = strlen(s);
+
+	fb_pad(L, b, 4);
+	fb_patch(b, slot);
+	fb_add(L, b, len, 4);
+	buf_add(L, b, s, len + 1);
+}
+
+/* Start a vector of n elements aligned to align, return its first element */
+static size_t
+fb_vector(lua_State *L, pgbuf *b, size_t slot, int n, size_t align)
+{
+	fb_pad(L, b, 4);
+	while ((b->len + 4) % align)
+		fb_add(L, b, 0, 1);
+	fb_patch(b, slot);
+	fb_add(L, b, n, 4);
+	return b->len;
+}
+
+/* The Arrow type of a column, *bits is set for numeric types */
+static int
+arrow_type(PGresult *res, int col, int *bits)
+{
+	*bits = 0;
+	switch (PQftype(res, col)) {
+	case BOOLOID:
+		return ARROW_BOOL;
+	case INT2OID:
+		*bits = 16;
+		return ARROW_INT;
+	case INT4OID:
+		*bits = 32;
+		return ARROW_INT;
+	case INT8OID:
+	case OIDOID:
+		*bits = 64;
+		return ARROW_INT;
+	case FLOAT4OID:
+		*bits = 32;
+		return ARROW_FLOAT;
+	case FLOAT8OID:
+		*bits = 64;
+		return ARROW_FLOAT;
+	case BYTEAOID:
+		return ARROW_BINARY;
+	default:
+		return PQfformat(res, col) ? ARROW_BINARY : ARROW_UTF8;
+	}
 }
 
+/* Encapsulate a flatbuffer message and its body */
 static void
-noticeProcessor(void *arg, const char *message)
+arrow_message(lua_State *L, pgbuf *out, pgbuf *meta, pgbuf *body)
 {
-	notice *n = arg;
+	fb_pad(L, meta, 8);
+	fb_add(L, out, 0xffffffff, 4);
+	fb_add(L, out, meta->len, 4);
+	buf_add(L, out, meta->data, meta->len);
+	if (body != NULL)
+		buf_add(L, out, body->data, body->len);
+}
 
-	lua_rawgeti(n->L, LUA_REGISTRYINDEX, n->f);
-	lua_pushstring(n->L, message);
-	if (lua_pcall(n->L, 1, 0, 0))
-		luaL_error(n->L, "%s", lua_tostring(n->L, -1));
+static void
+arrow_schema(lua_State *L, PGresult *res, pgbuf *out)
+{
+	pgbuf *meta;
+	size_t slots[6], fields;
+	uint64_t values[6];
+	int sizes[6], col, nfields, type, bits;
+
+	meta = buf_new(L);
+	nfields = PQnfields(res);
+	fb_add(L, meta, 0, 4);
+
+	/* Message: version, header_type, header, bodyLength */
+	sizes[0] = 2, values[0] = ARROW_V5;
+	sizes[1] = 1, values[1] = ARROW_SCHEMA;
+	sizes[2] = -4;
+	sizes[3] = 8, values[3] = 0;
+	fb_table(L, meta, 0, 4, sizes, values, slots);
+
+	/* Schema: endianness, fields */
+	sizes[0] = 0;
+	sizes[1] = -4;
+	fb_table(L, meta, slots[2], 2, sizes, values, slots);
+	fields = fb_vector(L, meta, slots[1], nfields, 4);
+	for (col = 0; col < nfields; col++)
+		fb_add(L, meta, 0, 4);
+
+	for (col = 0; col < nfields; col++) {
+		type = arrow_type(res, col, &bits);
+
+		/* Field: name, nullable, type_type, type, dictionary, children */
+		sizes[0] = -4;
+		sizes[1] = 1, values[1] = 1;
+		sizes[2] = 1, values[2] = type;
+		sizes[3] = -4;
+		sizes[4] = 0;
+		sizes[5] = -4;
+		fb_table(L, meta, fields + 4 * col, 6, sizes, values, slots);
+		fb_string(L, meta, slots[0], PQfname(res, col));
+		fb_vector(L, meta, slots[5], 0, 4);
+
+		switch (type) {
+		case ARROW_INT:
+			/* Int: bitWidth, is_signed */
+			sizes[0] = 4, values[0] = bits;
+			sizes[1] = 1, values[1] = 1;
+			fb_table(L, meta, slots[3], 2, sizes, values, slots);
+			break;
+		case ARROW_FLOAT:
+			/* FloatingPoint: precision */
+			sizes[0] = 2, values[0] = bits == 32 ? 1 : 2;
+			fb_table(L, meta, slots[3], 1, sizes, values, slots);
+			break;
+		default:
+			fb_table(L, meta, slots[3], 0, sizes, values, slots);
+		}
+	}
+	arrow_message(L, out, meta, NULL);
+	lua_pop(L, 1);
 }
 
-static int
-conn_setNoticeReceiver(lua_State *L)
+/* Append a buffer to the body, record its offset and length */
+static void
+arrow_buffer(lua_State *L, pgbuf *body, uint64_t *buffers, int *nbuffers,
+    size_t start)
 {
-	notice **n;
-	PGconn *conn;
-	int f;
+	buffers[2 * *nbuffers] = start;
+	buffers[2 * *nbuffers + 1] = body->len - start;
+	(*nbuffers)++;
+	fb_pad(L, body, 8);
+}
 
-	if (!lua_isfunction(L, -1))
-		return luaL_argerror(L, -1, "function expected");
+static void
+arrow_column(lua_State *L, PGresult *res, int col, pgbuf *body,
+    uint64_t *buffers, int *nbuffers, uint64_t *nulls)
+{
+	union {
+		float f;
+		double d;
+		uint32_t u32;
+		uint64_t u64;
+	} swap;
+	unsigned char *bytea;
+	const char *value;
+	size_t start, len, offsets;
+	uint64_t v;
+	int row, ntuples, type, bits, binary, bit;
+
+	ntuples = PQntuples(res);
+	type = arrow_type(res, col, &bits);
+	binary = PQfformat(res, col);
+
+	/* Validity bitmap, omitted if there are no NULL values */
+	for (row = 0, *nulls = 0; row < ntuples; row++)
+		if (PQgetisnull(res, row, col))
+			(*nulls)++;
+	start = body->len;
+	if (*nulls) {
+		buf_reserve(L, body, (ntuples + 7) / 8);
+		memset(body->data + start, 0, (ntuples + 7) / 8);
+		for (row = 0; row < ntuples; row++)
+			if (!PQgetisnull(res, row, col))
+				body->data[start + row / 8] |= 1 << row % 8;
+		body->len += (ntuples + 7) / 8;
+	}
+	arrow_buffer(L, body, buffers, nbuffers, start);
+
+	start = body->len;
+	switch (type) {
+	case ARROW_BOOL:
+		buf_reserve(L, body, (ntuples + 7) / 8);
+		memset(body->data + start, 0, (ntuples + 7) / 8);
+		for (row = 0; row < ntuples; row++) {
+			value = PQgetvalue(res, row, col);
+			bit = PQgetisnull(res, row, col) ? 0 :
+			    binary ? *value != 0 : *value == 't';
+			if (bit)
+				body->data[start + row / 8] |= 1 << row % 8;
+		}
+		body->len += (ntuples + 7) / 8;
+		break;
+	case ARROW_INT:
+	case ARROW_FLOAT:
+		for (row = 0; row < ntuples; row++) {
+			value = PQgetvalue(res, row, col);
+			len = PQgetlength(res, row, col);
+			if (PQgetisnull(res, row, col))
+				v = 0;
+			else if (binary)
+				v = len == 8 ? get64(value) : len == 4 ?
+				    get32(value) : get16(value);
+			else if (type == ARROW_INT)
+				v = strtoll(value, NULL, 10);
+			else if (bits == 32) {
+				swap.f = strtof(value, NULL);
+				v = swap.u32;
+			} else {
+				swap.d = strtod(value, NULL);
+				v = swap.u64;
+			}
+			fb_add(L, body, v, bits / 8);
+		}
+		break;
+	default:
+		/* Offsets followed by the data */
+		offsets = body->len;
+		for (row = 0; row <= ntuples; row++)
+			fb_add(L, body, 0, 4);
+		arrow_buffer(L, body, buffers, nbuffers, offsets);
+		start = body->len;
+		for (row = 0; row < ntuples; row++) {
+			if (!PQgetisnull(res, row, col)) {
+				value = PQgetvalue(res, row, col);
+				len = PQgetlength(res, row, col);
+				if (PQftype(res, col) == BYTEAOID && !binary) {
+					bytea = PQunescapeBytea(
+					    (const unsigned char *)value, &len);
+					if (bytea == NULL)
+						luaL_error(L, "out of memory");
+					buf_add(L, body, bytea, len);
+					PQfreemem(bytea);
+				} else
+					buf_add(L, body, value, len);
+			}
+			if (body->len - start > INT32_MAX)
+				luaL_error(L, "column %s is too large",
+				    PQfname(res, col));
+			le_put(body->data + offsets + 4 * (row + 1),
+			    body->len - start, 4);
+		}
+	}
+	arrow_buffer(L, body, buffers, nbuffers, start);
+}
 
-	f = luaL_ref(L, LUA_REGISTRYINDEX);
-	conn = pgsql_conn(L, 1);
+static void
+arrow_batch(lua_State *L, PGresult *res, pgbuf *out)
+{
+	pgbuf *meta, *body;
+	uint64_t *buffers, *nulls;
+	size_t slots[4];
+	uint64_t values[4];
+	int sizes[4], n, col, nfields, nbuffers;
+
+	nfields = PQnfields(res);
+	buffers = lua_newuserdata(L, 6 * nfields * sizeof(uint64_t) + 1);
+	nulls = lua_newuserdata(L, nfields * sizeof(uint64_t) + 1);
+	body = buf_new(L);
+	for (col = nbuffers = 0; col < nfields; col++)
+		arrow_column(L, res, col, body, buffers, &nbuffers,
+		    &nulls[col]);
+
+	meta = buf_new(L);
+	fb_add(L, meta, 0, 4);
+
+	/* Message: version, header_type, header, bodyLength */
+	sizes[0] = 2, values[0] = ARROW_V5;
+	sizes[1] = 1, values[1] = ARROW_RECORDBATCH;
+	sizes[2] = -4;
+	sizes[3] = 8, values[3] = body->len;
+	fb_table(L, meta, 0, 4, sizes, values, slots);
+
+	/* RecordBatch: length, nodes, buffers */
+	sizes[0] = 8, values[0] = PQntuples(res);
+	sizes[1] = -4;
+	sizes[2] = -4;
+	fb_table(L, meta, slots[2], 3, sizes, values, slots);
+
+	/* FieldNode: length, null_count */
+	fb_vector(L, meta, slots[1], nfields, 8);
+	for (col = 0; col < nfields; col++) {
+		fb_add(L, meta, PQntuples(res), 8);
+		fb_add(L, meta, nulls[col], 8);
+	}
 
-	n = gcmalloc(L, sizeof(notice *));
-	*n = malloc(sizeof(notice));
-	if (*n != NULL) {
-		(*n)->L = L;
-		(*n)->f = f;
-		PQsetNoticeReceiver(conn, noticeReceiver, *n);
-	} else
-		return luaL_error(L, "out of memory");
-	return 0;
+	/* Buffer: offset, length */
+	fb_vector(L, meta, slots[2], nbuffers, 8);
+	for (n = 0; n < 2 * nbuffers; n++)
+		fb_add(L, meta, buffers[n], 8);
+
+	arrow_message(L, out, meta, body);
+	lua_pop(L, 4);
 }
 
+/*
+ * res:toArrow([part]) returns the result in the Arrow IPC stream format.
+ * part is 'stream' for a complete stream (the default), or 'schema',
+ * 'batch' or 'end' for the pieces of a stream made of several results,
+ * e.g. the chunks of a query in chunked rows mode.  Text is copied as is,
+ * so the client encoding should be UTF8.
+ */
 static int
-conn_setNoticeProcessor(lua_State *L)
+res_toArrow(lua_State *L)
 {
-	notice **n;
-	PGconn *conn;
-	int f;
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	static const char *const parts[] = { "stream", "schema", "batch",
+	    "end", NULL };
+	pgbuf *out;
+	int part;
+
+	part = luaL_checkoption(L, 2, "stream", parts);
+	out = buf_new(L);
+	if (part == 0 || part == 1)
+		arrow_schema(L, res, out);
+	if (part == 0 || part == 2)
+		arrow_batch(L, res, out);
+	if (part == 0 || part == 3) {
+		fb_add(L, out, 0xffffffff, 4);
+		fb_add(L, out, 0, 4);
+	}
+	lua_pushlstring(L, out->data, out->len);
+	return 1;
+}
 
-	if (!lua_isfunction(L, -1))
-		return luaL_argerror(L, -1, "function expected");
+/*
+ * CSV export
+ *
+ * Options: delimiter (default ','), quote (default '"'), null (the text
+ * for NULL values, default empty), newline (default '\n') and header
+ * (write the field names first, default true).  Values are quoted when
+ * they contain the delimiter, the quote character or a line break, or
+ * when a non-NULL value equals the null text.
+ */
+static void
+csv_options(lua_State *L, int idx, csv *c)
+{
+	const char *quote;
+	size_t len;
 
-	f = luaL_ref(L, LUA_REGISTRYINDEX);
-	conn = pgsql_conn(L, 1);
+	c->delimiter = ",";
+	c->delimiterlen = 1;
+	c->null = "";
+	c->nulllen = 0;
+	c->newline = "\n";
+	c->newlinelen = 1;
+	c->quote = '"';
+	c->header = 1;
+	c->error = 0;
+	if (lua_isnoneornil(L, idx))
+		return;
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	lua_getfield(L, idx, "delimiter");
+	c->delimiter = luaL_optlstring(L, -1, c->delimiter, &c->delimiterlen);
+	luaL_argcheck(L, c->delimiterlen > 0, idx, "empty delimiter");
+	lua_getfield(L, idx, "null");
+	c->null = luaL_optlstring(L, -1, c->null, &c->nulllen);
+	lua_getfield(L, idx, "newline");
+	c->newline = luaL_optlstring(L, -1, c->newline, &c->newlinelen);
+	lua_getfield(L, idx, "quote");
+	quote = luaL_optlstring(L, -1, "\"", &len);
+	luaL_argcheck(L, len == 1, idx, "quote must be a single character");
+	c->quote = *quote;
+	lua_getfield(L, idx, "header");
+	if (!lua_isnil(L, -1))
+		c->header = lua_toboolean(L, -1);
 
-	n = gcmalloc(L, sizeof(notice *));
-	*n = malloc(sizeof(notice));
-	if (*n != NULL) {
-		(*n)->L = L;
-		(*n)->f = f;
-		PQsetNoticeProcessor(conn, noticeProcessor, *n);
-	} else
-		return luaL_error(L, "out of memory");
-	return 0;
+	/*
+	 * The values are left on the stack, numbers converted to strings
+	 * are not referenced by the options table.
+	 */
+}
+
+static void
+csv_write(csv *c, const char *p, size_t len)
+{
+	if (c->b != NULL)
+		luaL_addlstring(c->b, p, len);
+	else if (fwrite(p, 1, len, c->fp) != len && c->error == 0)
+		c->error = errno != 0 ? errno : EIO;
 }
 
-/* Large objects */
-static int
-conn_lo_create(lua_State *L)
+static void
+csv_value(csv *c, const char *value, size_t len, int isnull)
 {
-	Oid oid;
+	const char *p, *q;
+	size_t n;
+	int quote;
 
-	if (lua_gettop(L) == 2)
-		oid = luaL_checkinteger(L, 2);
-	else
-		oid = 0;
-	lua_pushinteger(L, lo_create(pgsql_conn(L, 1), oid));
-	return 1;
+	if (isnull) {
+		csv_write(c, c->null, c->nulllen);
+		return;
+	}
+	quote = len == c->nulllen && !memcmp(value, c->null, len);
+	for (n = 0; n < len && !quote; n++)
+		quote = value[n] == c->quote || value[n] == '\n' ||
+		    value[n] == '\r' || (value[n] == *c->delimiter &&
+		    len - n >= c->delimiterlen &&
+		    !memcmp(value + n, c->delimiter, c->delimiterlen));
+	if (!quote) {
+		csv_write(c, value, len);
+		return;
+	}
+	csv_write(c, &c->quote, 1);
+	for (p = value; (q = memchr(p, c->quote, len - (p - value))) != NULL;
+	    p = q + 1) {
+		csv_write(c, p, q - p + 1);
+		csv_write(c, &c->quote, 1);
+	}
+	csv_write(c, p, len - (p - value));
+	csv_write(c, &c->quote, 1);
 }
 
-static int
-conn_lo_import(lua_State *L)
+static void
+csv_rows(PGresult *res, csv *c)
 {
-	lua_pushinteger(L, lo_import(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
-	return 1;
+	const char *name;
+	int row, col, ntuples, nfields;
+
+	ntuples = PQntuples(res);
+	nfields = PQnfields(res);
+	if (c->header && nfields > 0) {
+		for (col = 0; col < nfields; col++) {
+			if (col)
+				csv_write(c, c->delimiter, c->delimiterlen);
+			name = PQfname(res, col);
+			csv_value(c, name, strlen(name), 0);
+		}
+		csv_write(c, c->newline, c->newlinelen);
+	}
+	for (row = 0; row < ntuples; row++) {
+		for (col = 0; col < nfields; col++) {
+			if (col)
+				csv_write(c, c->delimiter, c->delimiterlen);
+			csv_value(c, PQgetvalue(res, row, col),
+			    PQgetlength(res, row, col),
+			    PQgetisnull(res, row, col));
+		}
+		csv_write(c, c->newline, c->newlinelen);
+	}
 }
 
+/* res:toCSV([opts]) returns the result as CSV text */
 static int
-conn_lo_import_with_oid(lua_State *L)
+res_toCSV(lua_State *L)
 {
-	lua_pushinteger(L,
-	    lo_import_with_oid(pgsql_conn(L, 1), luaL_checkstring(L, 2),
-	    luaL_checkinteger(L, 3)));
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_Buffer b;
+	csv c;
+
+	csv_options(L, 2, &c);
+	luaL_buffinit(L, &b);
+	c.b = &b;
+	c.fp = NULL;
+	csv_rows(res, &c);
+	luaL_pushresult(&b);
 	return 1;
 }
 
+/*
+ * res:writeCSV(file [, opts]) writes the result as CSV to an open Lua
+ * file, returns true or nil and an error message.
+ */
 static int
-conn_lo_export(lua_State *L)
+res_writeCSV(lua_State *L)
 {
-	int r;
-
-	r = lo_export(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
-	    luaL_checkstring(L, 3));
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_Stream *stream;
+	csv c;
 
-	lua_pushboolean(L, r == 1);
+	stream = luaL_checkudata(L, 2, LUA_FILEHANDLE);
+	luaL_argcheck(L, stream->closef != NULL, 2, "file is closed");
+	csv_options(L, 3, &c);
+	c.b = NULL;
+	c.fp = stream->f;
+	errno = 0;
+	csv_rows(res, &c);
+	if (c.error == 0 && fflush(c.fp) != 0)
+		c.error = errno != 0 ? errno : EIO;
+	if (c.error != 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(c.error));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
+/*
+ * res:serialize() returns the fields and tuples of a result as a binary
+ * string that pgsql.deserialize() turns back into a result.
+ */
 static int
-conn_lo_open(lua_State *L)
+res_serialize(lua_State *L)
 {
-	int fd;
+	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	pgbuf *b;
 
-	fd = lo_open(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
-	    luaL_checkinteger(L, 3));
-	if (fd == -1)
+	switch (PQresultStatus(res)) {
+	case PGRES_TUPLES_OK:
+#if PG_VERSION_NUM >= 90200
+	case PGRES_SINGLE_TUPLE:
+#endif
+#if PG_VERSION_NUM >= 170000
+	case PGRES_TUPLES_CHUNK:
+#endif
+		break;
+	default:
 		lua_pushnil(L);
-	else
-		lua_pushinteger(L, fd);
+		lua_pushliteral(L, "result has no tuples");
+		return 2;
+	}
+	b = buf_new(L);
+	serialize_result(L, res, b);
+	lua_pushlstring(L, b->data, b->len);
 	return 1;
 }
 
+/*
+ * pgsql.deserialize(data [, conn]) rebuilds a serialized result, with the
+ * status PGRES_TUPLES_OK.  The type catalogue of conn is used to decode
+ * its values.
+ */
 static int
-conn_lo_write(lua_State *L)
+pgsql_deserialize(lua_State *L)
 {
-	const char *s;
+	PGresult **res;
+	const char *data, *err;
 	size_t len;
 
-	s = lua_tolstring(L, 3, &len);
-	lua_pushinteger(L, lo_write(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
-	    s, len));
+	data = luaL_checklstring(L, 1, &len);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checkudata(L, 2, CONN_METATABLE);
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	if ((*res = deserialize_result(data, len, &err)) == NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+	luaL_setmetatable(L, RES_METATABLE);
+	if (!lua_isnoneornil(L, 2))
+		res_setconn(L, 2);
 	return 1;
 }
 
 static int
-conn_lo_read(lua_State *L)
+res_fields_iterator(lua_State *L)
 {
-	char *buf;
-	size_t len;
+	tuple *t = luaL_checkudata(L, 1, TUPLE_METATABLE);
+	int n;
 
-	len = luaL_checkinteger(L, 3);
-	buf = lua_newuserdata(L, len);
-	len = lo_read(pgsql_conn(L, 1), luaL_checkinteger(L, 2), buf, len);
-	lua_pushlstring(L, buf, len);
-	lua_pushinteger(L, len);
-	return 2;
-}
+	t->row++;
 
-static int
-conn_lo_lseek(lua_State *L)
-{
-	lua_pushinteger(L, lo_lseek(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
-	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4)));
-	return 1;
+	luaL_checkstack(L, PQnfields(t->res), "out of stack space");
+	if (t->row == PQntuples(t->res))
+		for (n = 0; n < PQnfields(t->res); n++)
+			lua_pushnil(L);
+	else
+		for (n = 0; n < PQnfields(t->res); n++)
+			lua_pushstring(L, PQgetvalue(t->res, t->row, n));
+	return PQnfields(t->res);
 }
 
 static int
-conn_lo_tell(lua_State *L)
+res_fields(lua_State *L)
 {
-	lua_pushinteger(L, lo_tell(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
-	return 1;
-}
+	tuple *t;
 
-static int
-conn_lo_truncate(lua_State *L)
-{
-	lua_pushinteger(L, lo_truncate(pgsql_conn(L, 1),
-	    luaL_checkinteger(L, 2), luaL_checkinteger(L, 3)));
-	return 1;
+	lua_pushcfunction(L, res_fields_iterator);
+	t = lua_newuserdata(L, sizeof(tuple));
+	luaL_setmetatable(L, TUPLE_METATABLE);
+	t->res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	t->row = -1;
+	return 2;
 }
 
 static int
-conn_lo_close(lua_State *L)
+res_tuples_iterator(lua_State *L)
 {
-	lua_pushboolean(L,
-	    lo_close(pgsql_conn(L, 1), luaL_checkinteger(L, 2)) == 0);
-	return 1;
-}
+	tuple *t = luaL_checkudata(L, 1, TUPLE_METATABLE);
 
-static int
-conn_lo_unlink(lua_State *L)
-{
-	lua_pushboolean(L,
-	    lo_unlink(pgsql_conn(L, 1), luaL_checkinteger(L, 2)) == 1);
-	return 1;
+	t->row++;
+
+	if (t->row == PQntuples(t->res)) {
+		lua_pushnil(L);
+		lua_pushnil(L);
+	} else {
+		lua_pushvalue(L, 1);
+		lua_pushinteger(L, t->row + 1);
+	}
+	return 2;
 }
 
-#if PG_VERSION_NUM >= 90300
 static int
-conn_lo_lseek64(lua_State *L)
+res_tuples(lua_State *L)
 {
-	lua_pushinteger(L, lo_lseek64(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
-	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4)));
-	return 1;
+	PGresult **res;
+	tuple *t;
+
+	res = (PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+
+	lua_pushcfunction(L, res_tuples_iterator);
+	t = lua_newuserdata(L, sizeof(tuple));
+	luaL_setmetatable(L, TUPLE_METATABLE);
+	t->res = *res;
+	t->row = -1;
+	return 2;
 }
 
 static int
-conn_lo_tell64(lua_State *L)
+res_index(lua_State *L)
 {
-	lua_pushinteger(L,
-	    lo_tell64(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
+	if (lua_type(L, -1) == LUA_TNUMBER) {
+		tuple *t;
+		PGresult *res;
+		int row;
+
+		res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+		row = luaL_checkinteger(L, 2) - 1;
+
+		if (row < 0 || row >= PQntuples(res))
+			lua_pushnil(L);
+		else {
+			t = lua_newuserdata(L, sizeof(tuple));
+			t->res = res;
+			t->row = row;
+			luaL_setmetatable(L, TUPLE_METATABLE);
+		}
+	} else {
+		const char *nam;
+
+		nam = lua_tostring(L, -1);
+		if (lua_getmetatable(L, -2)) {
+			lua_pushstring(L, nam);
+			lua_rawget(L, -2);
+		} else
+			lua_pushnil(L);
+	}
 	return 1;
 }
 
 static int
-conn_lo_truncate64(lua_State *L)
+res_clear(lua_State *L)
 {
-	lua_pushinteger(L, lo_truncate64(pgsql_conn(L, 1),
-	    luaL_checkinteger(L, 2), luaL_checkinteger(L, 3)));
-	return 1;
+	PGresult **r;
+
+	r = luaL_checkudata(L, 1, RES_METATABLE);
+	if (*r) {
+		PQclear(*r);
+		*r = NULL;
+	}
+	return 0;
 }
-#endif
 
 /*
- * Result set functions
+ * Notifies methods (objects returned by conn:notifies())
  */
 static int
-res_status(lua_State *L)
+notify_relname(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQresultStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	PGnotify **n;
+
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	lua_pushstring(L, (*n)->relname);
 	return 1;
 }
 
 static int
-res_resStatus(lua_State *L)
+notify_pid(lua_State *L)
 {
-	lua_pushstring(L, PQresStatus(luaL_checkinteger(L, 2)));
+	PGnotify **n;
+
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	lua_pushinteger(L, (*n)->be_pid);
 	return 1;
 }
 
 static int
-res_errorMessage(lua_State *L)
+notify_extra(lua_State *L)
 {
-	lua_pushstring(L,
-	    PQresultErrorMessage(*(PGresult **)luaL_checkudata(L, 1,
-	    RES_METATABLE)));
+	PGnotify **n;
+
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	lua_pushstring(L, (*n)->extra);
 	return 1;
 }
 
 static int
-res_errorField(lua_State *L)
+notify_clear(lua_State *L)
 {
-	char *field;
+	PGnotify **n;
 
-	field = PQresultErrorField(
-	    *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    lua_tointeger(L, 2));
-	if (field == NULL)
-		lua_pushnil(L);
-	else
-		lua_pushstring(L, field);
-	return 1;
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	if (*n) {
+		PQfreemem(*n);
+		*n = NULL;
+	}
+	return 0;
 }
 
-static int
-res_nfields(lua_State *L)
+/*
+ * Cancel request methods (objects returned by conn:cancelStart())
+ */
+#if PG_VERSION_NUM >= 170000
+static PGcancelConn *
+pgsql_cancel(lua_State *L, int n)
 {
-	lua_pushinteger(L,
-	    PQnfields(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	cancel *c;
+
+	c = luaL_checkudata(L, n, CANCEL_METATABLE);
+	if (c->cconn == NULL)
+		luaL_argerror(L, n, "cancel request is finished");
+	return c->cconn;
 }
 
 static int
-res_ntuples(lua_State *L)
+cancel_poll(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQntuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	lua_pushinteger(L, PQcancelPoll(pgsql_cancel(L, 1)));
 	return 1;
 }
 
 static int
-res_fname(lua_State *L)
+cancel_socket(lua_State *L)
 {
-	lua_pushstring(L,
-	    PQfname(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	lua_pushinteger(L, PQcancelSocket(pgsql_cancel(L, 1)));
 	return 1;
 }
 
 static int
-res_fnumber(lua_State *L)
+cancel_status(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfnumber(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkstring(L, 2)) + 1);
+	lua_pushinteger(L, PQcancelStatus(pgsql_cancel(L, 1)));
 	return 1;
 }
 
 static int
-res_ftable(lua_State *L)
+cancel_errorMessage(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQftable(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	lua_pushstring(L, PQcancelErrorMessage(pgsql_cancel(L, 1)));
 	return 1;
 }
 
+/* cancel:wait([timeout]) drives the request until done or timed out */
 static int
-res_ftablecol(lua_State *L)
+cancel_wait_method(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQftablecol(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
-	return 1;
+	PGcancelConn *cconn;
+	lua_Integer timeout;
+	int res;
+
+	cconn = pgsql_cancel(L, 1);
+	timeout = luaL_optinteger(L, 2, -1);
+	switch (PQcancelStatus(cconn)) {
+	case CONNECTION_OK:
+		lua_pushboolean(L, 1);
+		return 1;
+	case CONNECTION_BAD:
+		res = 0;
+		break;
+	default:
+		res = cancel_wait(cconn, timeout < 0 ? -1 :
+		    clock_ms() + timeout);
+	}
+	lua_pushboolean(L, res == 1);
+	if (res == 1)
+		return 1;
+	if (res == -1)
+		lua_pushliteral(L, "timeout");
+	else
+		lua_pushstring(L, PQcancelErrorMessage(cconn));
+	return 2;
 }
 
 static int
-res_fformat(lua_State *L)
+cancel_finish(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfformat(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
-	return 1;
+	cancel *c;
+
+	c = luaL_checkudata(L, 1, CANCEL_METATABLE);
+	if (c->cconn) {
+		PQcancelFinish(c->cconn);
+		c->cconn = NULL;
+	}
+	return 0;
+}
+#else
+static cancel *
+pgsql_cancel(lua_State *L, int n)
+{
+	cancel *c;
+
+	c = luaL_checkudata(L, n, CANCEL_METATABLE);
+	if (c->finished)
+		luaL_argerror(L, n, "cancel request is finished");
+	return c;
 }
 
 static int
-res_ftype(lua_State *L)
+cancel_poll(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQftype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	lua_pushinteger(L, pgsql_cancel(L, 1)->ok ? PGRES_POLLING_OK :
+	    PGRES_POLLING_FAILED);
 	return 1;
 }
 
 static int
-res_fmod(lua_State *L)
+cancel_socket(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfmod(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	pgsql_cancel(L, 1);
+	lua_pushinteger(L, -1);
 	return 1;
 }
 
 static int
-res_fsize(lua_State *L)
+cancel_status(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfsize(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	lua_pushinteger(L, pgsql_cancel(L, 1)->ok ? CONNECTION_OK :
+	    CONNECTION_BAD);
 	return 1;
 }
 
 static int
-res_binaryTuples(lua_State *L)
+cancel_errorMessage(lua_State *L)
 {
-	lua_pushboolean(L,
-	    PQbinaryTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	lua_pushstring(L, pgsql_cancel(L, 1)->errbuf);
 	return 1;
 }
 
 static int
-res_getvalue(lua_State *L)
+cancel_wait_method(lua_State *L)
 {
-	lua_pushstring(L,
-	    PQgetvalue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
-	return 1;
+	cancel *c = pgsql_cancel(L, 1);
+
+	lua_pushboolean(L, c->ok);
+	if (c->ok)
+		return 1;
+	lua_pushstring(L, c->errbuf);
+	return 2;
 }
 
 static int
-res_getisnull(lua_State *L)
+cancel_finish(lua_State *L)
 {
-	lua_pushboolean(L,
-	    PQgetisnull(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
-	return 1;
+	cancel *c;
+
+	c = luaL_checkudata(L, 1, CANCEL_METATABLE);
+	c->finished = 1;
+	return 0;
 }
+#endif
 
-static int
-res_getlength(lua_State *L)
+/*
+ * Replication stream methods (objects returned by conn:startReplication())
+ */
+static PGconn *
+pgsql_repl(lua_State *L, int n, replication **rp)
 {
-	lua_pushinteger(L,
-	    PQgetlength(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
-	return 1;
+	replication *r;
+	PGconn *conn;
+
+	r = luaL_checkudata(L, n, REPL_METATABLE);
+	if (r->done)
+		luaL_argerror(L, n, "replication stream is stopped");
+	lua_getuservalue(L, n);
+	conn = pgsql_conn(L, -1);
+	lua_pop(L, 1);
+	*rp = r;
+	return conn;
 }
 
-static int
-res_nparams(lua_State *L)
+static void
+be_put(char *p, uint64_t v, int n)
 {
-	lua_pushinteger(L,
-	    PQnparams(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	int i;
+
+	for (i = 0; i < n; i++)
+		p[i] = v >> 8 * (n - i - 1);
 }
 
+/* Send a standby status update, returns 0 on success or -1 */
 static int
-res_paramtype(lua_State *L)
+repl_feedback(PGconn *conn, replication *r, int reply)
 {
-	lua_pushinteger(L,
-	    PQparamtype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2)) - 1);
-	return 1;
+	struct timespec ts;
+	char msg[34];
+	int64_t now;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ((int64_t)ts.tv_sec - PG_EPOCH_OFFSET) * 1000000 +
+	    ts.tv_nsec / 1000;
+	msg[0] = 'r';
+	be_put(msg + 1, r->received, 8);
+	be_put(msg + 9, r->flushed, 8);
+	be_put(msg + 17, r->flushed, 8);
+	be_put(msg + 25, now, 8);
+	msg[33] = reply;
+	r->feedback = clock_ms();
+	if (PQputCopyData(conn, msg, sizeof msg) != 1 || PQflush(conn) == -1)
+		return -1;
+	return 0;
 }
 
+/* The server ended the stream, collect the final results */
 static int
-res_cmdStatus(lua_State *L)
+repl_end(lua_State *L, PGconn *conn, replication *r)
 {
-	lua_pushstring(L,
-	    PQcmdStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	PGresult *res;
+	int failed = 0;
+
+	r->done = 1;
+	while ((res = PQgetResult(conn)) != NULL) {
+		if (!failed && PQresultStatus(res) != PGRES_COMMAND_OK &&
+		    PQresultStatus(res) != PGRES_TUPLES_OK) {
+			failed = 1;
+			lua_pushnil(L);
+			lua_pushstring(L, PQresultErrorMessage(res));
+		}
+		PQclear(res);
+	}
+	if (failed)
+		return 2;
+	lua_pushnil(L);
 	return 1;
 }
 
+/*
+ * stream:read([timeout]) returns the next WAL record, nil when the stream
+ * has ended, or nil and 'timeout'.  Keepalives are answered and status
+ * updates sent while waiting.
+ */
 static int
-res_cmdTuples(lua_State *L)
+repl_read(lua_State *L)
 {
-	lua_pushstring(L,
-	    PQcmdTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	PGconn *conn;
+	replication *r;
+	char **data;
+	lua_Integer timeout;
+	int64_t deadline, now;
+	uint64_t end;
+	int len, wait;
+
+	conn = pgsql_repl(L, 1, &r);
+	timeout = luaL_optinteger(L, 2, -1);
+	deadline = timeout < 0 ? -1 : clock_ms() + timeout;
+	if (!r->confirm)
+		r->flushed = r->received;
+	data = gcmalloc(L, sizeof(char *));
+
+	for (;;) {
+		now = clock_ms();
+		if (r->interval > 0 && now - r->feedback >= r->interval &&
+		    repl_feedback(conn, r, 0))
+			goto failed;
+
+		len = PQgetCopyData(conn, data, 1);
+		if (len == 0) {
+			wait = time_left(deadline);
+			if (wait == 0) {
+				lua_pushnil(L);
+				lua_pushliteral(L, "timeout");
+				return 2;
+			}
+			if (r->interval > 0 && (wait == -1 ||
+			    wait > r->feedback + r->interval - now))
+				wait = r->feedback + r->interval - now;
+			if (wait_socket(PQsocket(conn), POLLIN, wait) == -1 ||
+			    !PQconsumeInput(conn))
+				goto failed;
+			continue;
+		} else if (len == -1)
+			return repl_end(L, conn, r);
+		else if (len == -2)
+			goto failed;
+
+		switch (**data) {
+		case 'w':	/* XLogData */
+			if (len < 25)
+				break;
+			r->received = get64(*data + 1);
+			lua_createtable(L, 0, 4);
+			lua_pushinteger(L, r->received);
+			lua_setfield(L, -2, "lsn");
+			lua_pushinteger(L, get64(*data + 9));
+			lua_setfield(L, -2, "walEnd");
+			lua_pushnumber(L, pgsql_time(get64(*data + 17)));
+			lua_setfield(L, -2, "time");
+			lua_pushlstring(L, *data + 25, len - 25);
+			lua_setfield(L, -2, "data");
+			gcfree(data);
+			return 1;
+		case 'k':	/* Primary keepalive */
+			if (len < 18)
+				break;
+			end = get64(*data + 1);
+			if (end > r->received) {
+				r->received = end;
+				if (!r->confirm)
+					r->flushed = end;
+			}
+			if ((*data)[17] && repl_feedback(conn, r, 0))
+				goto failed;
+			gcfree(data);
+			continue;
+		}
+		gcfree(data);
+		lua_pushnil(L);
+		lua_pushliteral(L, "invalid replication message");
+		return 2;
+	}
+
+failed:
+	lua_pushnil(L);
+	lua_pushstring(L, PQerrorMessage(conn));
+	return 2;
 }
 
+/* stream:confirm(lsn) reports everything up to lsn as processed */
 static int
-res_oidValue(lua_State *L)
+repl_confirm(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQoidValue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	replication *r;
+	uint64_t lsn;
+
+	pgsql_repl(L, 1, &r);
+	lsn = pgsql_lsn(L, 2);
+	if (lsn > r->flushed)
+		r->flushed = lsn;
+	if (lsn > r->received)
+		r->received = lsn;
+	return 0;
 }
 
+/* stream:feedback([reply]) sends a status update immediately */
 static int
-res_oidStatus(lua_State *L)
+repl_sendFeedback(lua_State *L)
 {
-	lua_pushstring(L,
-	    PQoidStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	PGconn *conn;
+	replication *r;
+
+	conn = pgsql_repl(L, 1, &r);
+	if (!r->confirm)
+		r->flushed = r->received;
+	if (repl_feedback(conn, r, lua_toboolean(L, 2))) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(conn));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
-/* Lua specific functions */
+/* stream:lsn() returns the received and the flushed position */
 static int
-res_copy(lua_State *L)
+repl_lsn(lua_State *L)
 {
-	PGresult *res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
-	int row, col, convert;
+	replication *r = luaL_checkudata(L, 1, REPL_METATABLE);
 
-	convert = 0;	/* Do not convert numeric types */
+	lua_pushinteger(L, r->received);
+	lua_pushinteger(L, r->flushed);
+	return 2;
+}
 
-	if (lua_gettop(L) == 2)
-		convert = lua_toboolean(L, 2);
+/* stream:stop() ends the stream, the connection can be used again */
+static int
+repl_stop(lua_State *L)
+{
+	PGconn *conn;
+	replication *r;
+	char *data;
+	int len;
 
-	lua_newtable(L);
-	for (row = 0; row < PQntuples(res); row++) {
-		lua_pushinteger(L, row + 1);
-		lua_newtable(L);
-		for (col = 0; col < PQnfields(res); col++) {
-			if (convert)
-				switch (PQftype(res, col)) {
-				case BOOLOID:
-					lua_pushboolean(L,
-					    strcmp(PQgetvalue(res, row, col),
-					    "f"));
-					break;
-				case INT2OID:
-				case INT4OID:
-				case INT8OID:
-					lua_pushinteger(L,
-					    atol(PQgetvalue(res, row, col)));
-					break;
-				case FLOAT4OID:
-				case FLOAT8OID:
-				case NUMERICOID:
-					lua_pushnumber(L,
-					    atof(PQgetvalue(res, row, col)));
-					break;
-				default:
-					lua_pushstring(L,
-					    PQgetvalue(res, row, col));
-				}
-			else
-				lua_pushstring(L, PQgetvalue(res, row, col));
-			lua_setfield(L, -2, PQfname(res, col));
-		}
-		lua_settable(L, -3);
+	r = luaL_checkudata(L, 1, REPL_METATABLE);
+	if (r->done) {
+		lua_pushboolean(L, 1);
+		return 1;
 	}
+	conn = pgsql_repl(L, 1, &r);
+	if (!r->confirm)
+		r->flushed = r->received;
+	repl_feedback(conn, r, 0);
+	if (PQputCopyEnd(conn, NULL) == 1)
+		while ((len = PQgetCopyData(conn, &data, 0)) > 0)
+			PQfreemem(data);
+	if (repl_end(L, conn, r) == 2)
+		return 2;
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int
-res_fields_iterator(lua_State *L)
-{
-	tuple *t = luaL_checkudata(L, 1, TUPLE_METATABLE);
-	int n;
-
-	t->row++;
+/*
+ * pgoutput decoder (objects returned by pgsql.pgoutput())
+ *
+ * Decodes the data of records read from a replication stream that uses
+ * the pgoutput plugin.  Relation messages are cached, changes are
+ * returned as tables with op, relation, old and new, the column values
+ * converted like query results.  The uservalue holds the relation info
+ * tables, their column types and the optional type catalogue.
+ */
+#define PGOUTPUT_RELS	1
+#define PGOUTPUT_COLS	2
+#define PGOUTPUT_TYPES	3
 
-	luaL_checkstack(L, PQnfields(t->res), "out of stack space");
-	if (t->row == PQntuples(t->res))
-		for (n = 0; n < PQnfields(t->res); n++)
-			lua_pushnil(L);
-	else
-		for (n = 0; n < PQnfields(t->res); n++)
-			lua_pushstring(L, PQgetvalue(t->res, t->row, n));
-	return PQnfields(t->res);
+static void
+rd_need(msgreader *r, size_t n)
+{
+	if ((size_t)(r->end - r->p) < n)
+		luaL_error(r->L, "malformed pgoutput message");
 }
 
 static int
-res_fields(lua_State *L)
+rd_byte(msgreader *r)
 {
-	tuple *t;
-
-	lua_pushcfunction(L, res_fields_iterator);
-	t = lua_newuserdata(L, sizeof(tuple));
-	luaL_setmetatable(L, TUPLE_METATABLE);
-	t->res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
-	t->row = -1;
-	return 2;
+	rd_need(r, 1);
+	return *(const unsigned char *)r->p++;
 }
 
 static int
-res_tuples_iterator(lua_State *L)
+rd_int16(msgreader *r)
 {
-	tuple *t = luaL_checkudata(L, 1, TUPLE_METATABLE);
+	rd_need(r, 2);
+	r->p += 2;
+	return (int16_t)get16(r->p - 2);
+}
 
-	t->row++;
+static int32_t
+rd_int32(msgreader *r)
+{
+	rd_need(r, 4);
+	r->p += 4;
+	return (int32_t)get32(r->p - 4);
+}
 
-	if (t->row == PQntuples(t->res)) {
-		lua_pushnil(L);
-		lua_pushnil(L);
-	} else {
-		lua_pushvalue(L, 1);
-		lua_pushinteger(L, t->row + 1);
-	}
-	return 2;
+static int64_t
+rd_int64(msgreader *r)
+{
+	rd_need(r, 8);
+	r->p += 8;
+	return (int64_t)get64(r->p - 8);
 }
 
-static int
-res_tuples(lua_State *L)
+static const char *
+rd_string(msgreader *r)
 {
-	PGresult **res;
-	tuple *t;
+	const char *s = r->p, *nul;
 
-	res = (PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	nul = memchr(r->p, '\0', r->end - r->p);
+	if (nul == NULL)
+		luaL_error(r->L, "malformed pgoutput message");
+	r->p = nul + 1;
+	return s;
+}
 
-	lua_pushcfunction(L, res_tuples_iterator);
-	t = lua_newuserdata(L, sizeof(tuple));
-	luaL_setmetatable(L, TUPLE_METATABLE);
-	t->res = *res;
-	t->row = -1;
-	return 2;
+/* Set field k of the table on top to an integer */
+static void
+pgoutput_setint(lua_State *L, const char *k, lua_Integer v)
+{
+	lua_pushinteger(L, v);
+	lua_setfield(L, -2, k);
 }
 
-static int
-res_index(lua_State *L)
+static void
+pgoutput_settime(lua_State *L, const char *k, int64_t t)
 {
-	if (lua_type(L, -1) == LUA_TNUMBER) {
-		tuple *t;
-		PGresult *res;
-		int row;
+	lua_pushnumber(L, pgsql_time(t));
+	lua_setfield(L, -2, k);
+}
 
-		res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
-		row = luaL_checkinteger(L, 2) - 1;
+/* Push the value of a column, text values are not '\0' terminated */
+static void
+pgoutput_value(lua_State *L, int types, Oid oid, int kind, int format,
+    const char *p, int len)
+{
+	char tmp[64];
 
-		if (row < 0 || row >= PQntuples(res))
-			lua_pushnil(L);
-		else {
-			t = lua_newuserdata(L, sizeof(tuple));
-			t->res = res;
-			t->row = row;
-			luaL_setmetatable(L, TUPLE_METATABLE);
-		}
+	if (format == 1 || kind == KIND_TEXT || kind == KIND_OTHER) {
+		decode_kind(L, types, kind, oid, format, p, len);
+	} else if (len < (int)sizeof tmp) {
+		memcpy(tmp, p, len);
+		tmp[len] = '\0';
+		decode_kind(L, types, kind, oid, format, tmp, len);
 	} else {
-		const char *nam;
+		lua_pushlstring(L, p, len);
+		decode_kind(L, types, kind, oid, format, lua_tostring(L, -1),
+		    len);
+		lua_remove(L, -2);
+	}
+}
 
-		nam = lua_tostring(L, -1);
-		if (lua_getmetatable(L, -2)) {
-			lua_pushstring(L, nam);
-			lua_rawget(L, -2);
-		} else
-			lua_pushnil(L);
+/*
+ * Decode TupleData into a table keyed by column name, which is set as
+ * field k of the change table on top of the stack.  NULL values are
+ * absent, the names of unchanged TOASTed values are listed in the
+ * unchanged field.
+ */
+static void
+pgoutput_tuple(msgreader *r, int info, relcols *rc, int types, const char *k)
+{
+	lua_State *L = r->L;
+	int change, names, tuple, unchanged = 0, ncols, n, fmt, len;
+
+	change = lua_gettop(L);
+	ncols = rd_int16(r);
+	if (ncols > rc->natts)
+		luaL_error(L, "malformed pgoutput message");
+	lua_getfield(L, info, "columns");
+	names = lua_gettop(L);
+	lua_createtable(L, 0, ncols);
+	tuple = names + 1;
+
+	for (n = 0; n < ncols; n++) {
+		switch (fmt = rd_byte(r)) {
+		case 'n':
+			continue;
+		case 'u':
+			if (!unchanged) {
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, change, "unchanged");
+				unchanged = lua_gettop(L);
+			}
+			lua_rawgeti(L, names, n + 1);
+			lua_rawseti(L, unchanged, lua_rawlen(L, unchanged) + 1);
+			continue;
+		case 't':
+		case 'b':
+			len = rd_int32(r);
+			if (len < 0)
+				luaL_error(L, "malformed pgoutput message");
+			rd_need(r, len);
+			lua_rawgeti(L, names, n + 1);
+			pgoutput_value(L, types, rc->att[n].oid,
+			    rc->att[n].kind, fmt == 'b', r->p, len);
+			lua_rawset(L, tuple);
+			r->p += len;
+			continue;
+		default:
+			luaL_error(L, "malformed pgoutput message");
+		}
+	}
+	lua_pushvalue(L, tuple);
+	lua_setfield(L, change, k);
+	lua_settop(L, change);
+}
+
+/* A Relation message, cache and return the relation info */
+static void
+pgoutput_relation(msgreader *r, int uv, int types)
+{
+	lua_State *L = r->L;
+	relcols *rc;
+	int32_t relid;
+	int natts, n, flags, nkeys = 0;
+
+	relid = rd_int32(r);
+	lua_createtable(L, 0, 7);
+	pgoutput_setint(L, "id", (uint32_t)relid);
+	lua_pushstring(L, rd_string(r));
+	lua_setfield(L, -2, "namespace");
+	lua_pushstring(L, rd_string(r));
+	lua_setfield(L, -2, "name");
+	lua_pushfstring(L, "%c", rd_byte(r));
+	lua_setfield(L, -2, "replicaIdentity");
+	natts = rd_int16(r);
+	if (natts < 0)
+		luaL_error(L, "malformed pgoutput message");
+
+	rc = lua_newuserdata(L, sizeof(relcols) + natts * sizeof(rc->att[0]));
+	rc->natts = natts;
+	lua_createtable(L, natts, 0);	/* columns */
+	lua_createtable(L, natts, 0);	/* types */
+	lua_newtable(L);		/* keys */
+	for (n = 0; n < natts; n++) {
+		flags = rd_byte(r);
+		lua_pushstring(L, rd_string(r));
+		if (flags & 1) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -3, ++nkeys);
+		}
+		lua_rawseti(L, -4, n + 1);
+		rc->att[n].oid = (Oid)rd_int32(r);
+		lua_pushinteger(L, rc->att[n].oid);
+		lua_rawseti(L, -3, n + 1);
+		rd_int32(r);	/* type modifier */
+		rc->att[n].kind = type_kind(L, types, &rc->att[n].oid);
 	}
-	return 1;
+	lua_setfield(L, -5, "keys");
+	lua_setfield(L, -4, "types");
+	lua_setfield(L, -3, "columns");
+
+	lua_rawgeti(L, uv, PGOUTPUT_COLS);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, (uint32_t)relid);
+	lua_pop(L, 1);
+	lua_rawgeti(L, uv, PGOUTPUT_RELS);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, (uint32_t)relid);
+	lua_pop(L, 1);
 }
 
-static int
-res_clear(lua_State *L)
+/* Push the cached info of a relation, return its column types */
+static relcols *
+pgoutput_rel(msgreader *r, int uv)
 {
-	PGresult **r;
+	lua_State *L = r->L;
+	relcols *rc;
+	uint32_t relid;
 
-	r = luaL_checkudata(L, 1, RES_METATABLE);
-	if (*r) {
-		PQclear(*r);
-		*r = NULL;
-	}
-	return 0;
+	relid = (uint32_t)rd_int32(r);
+	lua_rawgeti(L, uv, PGOUTPUT_COLS);
+	lua_rawgeti(L, -1, relid);
+	rc = lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	if (rc == NULL)
+		luaL_error(L, "unknown relation %d", (int)relid);
+	lua_rawgeti(L, uv, PGOUTPUT_RELS);
+	lua_rawgeti(L, -1, relid);
+	lua_remove(L, -2);
+	return rc;
 }
 
-/*
- * Notifies methods (objects returned by conn:notifies())
- */
-static int
-notify_relname(lua_State *L)
+static void
+pgoutput_op(lua_State *L, const char *op, int nfields)
 {
-	PGnotify **n;
-
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	lua_pushstring(L, (*n)->relname);
-	return 1;
+	lua_createtable(L, 0, nfields);
+	lua_pushstring(L, op);
+	lua_setfield(L, -2, "op");
 }
 
+/* decoder:decode(data) returns the decoded message as a table */
 static int
-notify_pid(lua_State *L)
+pgoutput_decode(lua_State *L)
 {
-	PGnotify **n;
-
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	lua_pushinteger(L, (*n)->be_pid);
+	pgoutput *d;
+	msgreader r;
+	relcols *rc;
+	size_t len;
+	int64_t xid = -1;
+	int uv, types, info, kind, n, nrels, flags;
+
+	d = luaL_checkudata(L, 1, PGOUTPUT_METATABLE);
+	r.L = L;
+	r.p = luaL_checklstring(L, 2, &len);
+	r.end = r.p + len;
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	uv = lua_gettop(L);
+	types = lua_rawgeti(L, uv, PGOUTPUT_TYPES) == LUA_TTABLE ?
+	    lua_gettop(L) : 0;
+
+	kind = rd_byte(&r);
+	if (d->streaming && strchr("RYIUDTM", kind))
+		xid = (uint32_t)rd_int32(&r);
+
+	switch (kind) {
+	case 'B':
+		pgoutput_op(L, "begin", 4);
+		pgoutput_setint(L, "lsn", rd_int64(&r));
+		pgoutput_settime(L, "time", rd_int64(&r));
+		pgoutput_setint(L, "xid", (uint32_t)rd_int32(&r));
+		break;
+	case 'C':
+		pgoutput_op(L, "commit", 4);
+		rd_byte(&r);	/* flags */
+		pgoutput_setint(L, "lsn", rd_int64(&r));
+		pgoutput_setint(L, "endLsn", rd_int64(&r));
+		pgoutput_settime(L, "time", rd_int64(&r));
+		break;
+	case 'O':
+		pgoutput_op(L, "origin", 3);
+		pgoutput_setint(L, "lsn", rd_int64(&r));
+		lua_pushstring(L, rd_string(&r));
+		lua_setfield(L, -2, "name");
+		break;
+	case 'R':
+		pgoutput_op(L, "relation", 3);
+		pgoutput_relation(&r, uv, types);
+		lua_setfield(L, -2, "relation");
+		break;
+	case 'Y':
+		pgoutput_op(L, "type", 4);
+		pgoutput_setint(L, "oid", (uint32_t)rd_int32(&r));
+		lua_pushstring(L, rd_string(&r));
+		lua_setfield(L, -2, "namespace");
+		lua_pushstring(L, rd_string(&r));
+		lua_setfield(L, -2, "name");
+		break;
+	case 'I':
+	case 'U':
+	case 'D':
+		pgoutput_op(L, kind == 'I' ? "insert" : kind == 'U' ?
+		    "update" : "delete", 5);
+		rc = pgoutput_rel(&r, uv);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "relation");
+		lua_insert(L, -2);	/* keep the info below the change */
+		info = lua_gettop(L) - 1;
+		n = rd_byte(&r);
+		if (kind != 'I' && (n == 'K' || n == 'O')) {
+			pgoutput_tuple(&r, info, rc, types, "old");
+			n = kind == 'U' ? rd_byte(&r) : 0;
+		}
+		if (n == 'N' && kind != 'D')
+			pgoutput_tuple(&r, info, rc, types, "new");
+		else if (n != 0)
+			return luaL_error(L, "malformed pgoutput message");
+		break;
+	case 'T':
+		pgoutput_op(L, "truncate", 5);
+		nrels = rd_int32(&r);
+		flags = rd_byte(&r);
+		lua_pushboolean(L, flags & 1);
+		lua_setfield(L, -2, "cascade");
+		lua_pushboolean(L, flags & 2);
+		lua_setfield(L, -2, "restartIdentity");
+		lua_createtable(L, nrels > 0 ? nrels : 0, 0);
+		for (n = 1; n <= nrels; n++) {
+			pgoutput_rel(&r, uv);
+			lua_rawseti(L, -2, n);
+		}
+		lua_setfield(L, -2, "relations");
+		break;
+	case 'M':
+		pgoutput_op(L, "message", 5);
+		lua_pushboolean(L, rd_byte(&r) & 1);
+		lua_setfield(L, -2, "transactional");
+		pgoutput_setint(L, "lsn", rd_int64(&r));
+		lua_pushstring(L, rd_string(&r));
+		lua_setfield(L, -2, "prefix");
+		n = rd_int32(&r);
+		if (n < 0)
+			return luaL_error(L, "malformed pgoutput message");
+		rd_need(&r, n);
+		lua_pushlstring(L, r.p, n);
+		lua_setfield(L, -2, "content");
+		break;
+	case 'S':
+		pgoutput_op(L, "streamStart", 3);
+		pgoutput_setint(L, "xid", (uint32_t)rd_int32(&r));
+		lua_pushboolean(L, rd_byte(&r));
+		lua_setfield(L, -2, "first");
+		d->streaming = 1;
+		break;
+	case 'E':
+		pgoutput_op(L, "streamStop", 1);
+		d->streaming = 0;
+		break;
+	case 'c':
+		pgoutput_op(L, "streamCommit", 5);
+		pgoutput_setint(L, "xid", (uint32_t)rd_int32(&r));
+		rd_byte(&r);	/* flags */
+		pgoutput_setint(L, "lsn", rd_int64(&r));
+		pgoutput_setint(L, "endLsn", rd_int64(&r));
+		pgoutput_settime(L, "time", rd_int64(&r));
+		break;
+	case 'A':
+		pgoutput_op(L, "streamAbort", 3);
+		pgoutput_setint(L, "xid", (uint32_t)rd_int32(&r));
+		pgoutput_setint(L, "subxid", (uint32_t)rd_int32(&r));
+		break;
+	default:
+		return luaL_error(L, "unsupported pgoutput message '%c'",
+		    kind);
+	}
+	if (xid != -1)
+		pgoutput_setint(L, "xid", xid);
 	return 1;
 }
 
+/* decoder:relation(id) returns the cached info of a relation */
 static int
-notify_extra(lua_State *L)
+pgoutput_relinfo(lua_State *L)
 {
-	PGnotify **n;
-
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	lua_pushstring(L, (*n)->extra);
+	luaL_checkudata(L, 1, PGOUTPUT_METATABLE);
+	luaL_checkinteger(L, 2);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, PGOUTPUT_RELS);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
 	return 1;
 }
 
+/* pgsql.pgoutput([conn]) creates a decoder, conn provides the type catalogue */
 static int
-notify_clear(lua_State *L)
+pgsql_pgoutput(lua_State *L)
 {
-	PGnotify **n;
+	pgoutput *d;
 
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	if (*n) {
-		PQfreemem(*n);
-		*n = NULL;
+	lua_settop(L, 1);
+	if (!lua_isnil(L, 1) && !pgsql_types(L, 1)) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
 	}
-	return 0;
+	d = lua_newuserdata(L, sizeof(pgoutput));
+	d->streaming = 0;
+	lua_createtable(L, 3, 0);
+	lua_newtable(L);
+	lua_rawseti(L, -2, PGOUTPUT_RELS);
+	lua_newtable(L);
+	lua_rawseti(L, -2, PGOUTPUT_COLS);
+	if (!lua_isnil(L, 1)) {
+		lua_pushvalue(L, 2);
+		lua_rawseti(L, -2, PGOUTPUT_TYPES);
+	}
+	lua_setuservalue(L, -2);
+	luaL_setmetatable(L, PGOUTPUT_METATABLE);
+	return 1;
 }
 
 /*
@@ -1908,11 +9942,12 @@ tuple_copy(lua_State *L)
 			lua_pop(L, 2);
 		}
 	} else {
-		lua_newtable(L);
+		lua_createtable(L, 0, PQnfields(t->res));
 		rv = 1;
 	}
 	for (col = 0; col < PQnfields(t->res); col++) {
-		lua_pushstring(L, PQgetvalue(t->res, t->row, col));
+		lua_pushlstring(L, PQgetvalue(t->res, t->row, col),
+		    PQgetlength(t->res, t->row, col));
 		lua_setfield(L, -2, PQfname(t->res, col));
 	}
 	return rv;
@@ -2094,6 +10129,9 @@ static struct constant pgsql_constant[] = {
 #endif
 #if PG_VERSION_NUM >= 90200
 	{ "PGRES_SINGLE_TUPLE",		PGRES_SINGLE_TUPLE },
+#endif
+#if PG_VERSION_NUM >= 170000
+	{ "PGRES_TUPLES_CHUNK",		PGRES_TUPLES_CHUNK },
 #endif
 	{ "PGRES_COPY_OUT",		PGRES_COPY_OUT },
 	{ "PGRES_COPY_IN",		PGRES_COPY_IN },
@@ -2173,6 +10211,16 @@ luaopen_pgsql(lua_State *L)
 		/* Database Connection Control Functions */
 		{ "connectdb", pgsql_connectdb },
 		{ "connectStart", pgsql_connectStart },
+		{ "connectMany", pgsql_connectMany },
+		{ "setProfiling", pgsql_setProfiling },
+		{ "profile", pgsql_profile },
+		{ "setSpans", pgsql_setSpans },
+		{ "flushSpans", pgsql_flushSpans },
+		{ "pgoutput", pgsql_pgoutput },
+		{ "router", pgsql_router },
+		{ "cache", pgsql_cache },
+		{ "sharedCache", pgsql_sharedCache },
+		{ "deserialize", pgsql_deserialize },
 		{ "libVersion", pgsql_libVersion },
 #if PG_VERSION_NUM >= 90100
 		{ "ping", pgsql_ping },
@@ -2226,6 +10274,7 @@ luaopen_pgsql(lua_State *L)
 		{ "execParams", conn_execParams },
 		{ "prepare", conn_prepare },
 		{ "execPrepared", conn_execPrepared },
+		{ "execPreparedMany", conn_execPreparedMany },
 		{ "describePrepared", conn_describePrepared },
 		{ "describePortal", conn_describePortal },
 
@@ -2237,7 +10286,11 @@ luaopen_pgsql(lua_State *L)
 		{ "sendDescribePrepared", conn_sendDescribePrepared },
 		{ "sendDescribePortal", conn_sendDescribePortal },
 		{ "getResult", conn_getResult },
+		{ "offload", conn_offload },
 		{ "cancel", conn_cancel },
+		{ "cancelStart", conn_cancelStart },
+		{ "setQueryTimeout", conn_setQueryTimeout },
+		{ "queryTimeout", conn_queryTimeout },
 
 #if PG_VERSION_NUM >= 140000
 		/* Pipeline mode */
@@ -2252,6 +10305,9 @@ luaopen_pgsql(lua_State *L)
 		/* Retrieving query results row-by-row */
 		{ "setSingleRowMode", conn_setSingleRowMode },
 #endif
+#if PG_VERSION_NUM >= 170000
+		{ "setChunkedRowsMode", conn_setChunkedRowsMode },
+#endif
 
 		/* Asynchronous Notifications Functions */
 		{ "notifies", conn_notifies },
@@ -2260,6 +10316,9 @@ luaopen_pgsql(lua_State *L)
 		{ "putCopyData", conn_putCopyData },
 		{ "putCopyEnd", conn_putCopyEnd },
 		{ "getCopyData", conn_getCopyData },
+		{ "copyToFile", conn_copyToFile },
+		{ "copyFromFile", conn_copyFromFile },
+		{ "startReplication", conn_startReplication },
 
 		/* Control Functions */
 		{ "clientEncoding", conn_clientEncoding },
@@ -2267,6 +10326,10 @@ luaopen_pgsql(lua_State *L)
 		{ "setErrorVerbosity", conn_setErrorVerbosity },
 		{ "trace", conn_trace },
 		{ "untrace", conn_untrace },
+#if PG_VERSION_NUM >= 140000
+		{ "traceRing", conn_traceRing },
+		{ "traceSnapshot", conn_traceSnapshot },
+#endif
 
 		/* Miscellaneous Functions */
 		{ "consumeInput", conn_consumeInput },
@@ -2277,9 +10340,20 @@ luaopen_pgsql(lua_State *L)
 #if PG_VERSION_NUM >= 100000
 		{ "encryptPassword", conn_encryptPassword },
 #endif
+		/* Statement handles */
+		{ "statement", conn_statement },
+
+		/* Type catalogue */
+		{ "record", conn_record },
+		{ "loadTypes", conn_loadTypes },
+		{ "typeInfo", conn_typeInfo },
+		{ "clearTypes", conn_clearTypes },
+
 		/* Notice processing */
 		{ "setNoticeReceiver", conn_setNoticeReceiver },
 		{ "setNoticeProcessor", conn_setNoticeProcessor },
+		{ "setNoticeQueue", conn_setNoticeQueue },
+		{ "notices", conn_notices },
 
 		/* Large Objects */
 		{ "lo_create", conn_lo_create },
@@ -2334,11 +10408,93 @@ luaopen_pgsql(lua_State *L)
 
 		/* Lua specific extension */
 		{ "copy", res_copy },
+		{ "rows", res_rows },
+		{ "decode", res_decode },
+		{ "vector", res_vector },
+		{ "toArrow", res_toArrow },
+		{ "toCSV", res_toCSV },
+		{ "writeCSV", res_writeCSV },
+		{ "serialize", res_serialize },
 		{ "fields", res_fields },
 		{ "tuples", res_tuples },
 		{ "clear", res_clear },
 		{ NULL, NULL }
 	};
+	struct luaL_Reg stmt_methods[] = {
+		{ "exec", stmt_exec },
+		{ "execBinary", stmt_execBinary },
+		{ "rows", stmt_rows },
+		{ "close", stmt_close },
+		{ "name", stmt_name },
+		{ "nparams", stmt_nparams },
+		{ "nfields", stmt_nfields },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg cancel_methods[] = {
+		{ "poll", cancel_poll },
+		{ "socket", cancel_socket },
+		{ "status", cancel_status },
+		{ "errorMessage", cancel_errorMessage },
+		{ "wait", cancel_wait_method },
+		{ "finish", cancel_finish },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg future_methods[] = {
+		{ "ready", future_ready },
+		{ "wait", future_wait },
+		{ "result", future_result },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg repl_methods[] = {
+		{ "read", repl_read },
+		{ "confirm", repl_confirm },
+		{ "feedback", repl_sendFeedback },
+		{ "lsn", repl_lsn },
+		{ "stop", repl_stop },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg router_methods[] = {
+		{ "exec", router_exec },
+		{ "read", router_read },
+		{ "write", router_write },
+		{ "primary", router_getPrimary },
+		{ "replica", router_getReplica },
+		{ "nodes", router_nodes },
+		{ "hedging", router_hedging },
+		{ "close", router_close },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg cache_methods[] = {
+		{ "exec", cache_exec },
+		{ "execTagged", cache_execTagged },
+		{ "listen", cache_listen },
+		{ "invalidate", cache_invalidateTag },
+		{ "clear", cache_clear },
+		{ "stats", cache_stats },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg shcache_methods[] = {
+		{ "exec", shc_exec },
+		{ "clear", shc_clear },
+		{ "stats", shc_stats },
+		{ "close", shc_close },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg pgoutput_methods[] = {
+		{ "decode", pgoutput_decode },
+		{ "relation", pgoutput_relinfo },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg vector_methods[] = {
+		{ "type", vector_type },
+		{ "nulls", vector_nulls },
+		{ "sum", vector_sum },
+		{ "min", vector_min },
+		{ "max", vector_max },
+		{ "mean", vector_mean },
+		{ "pointer", vector_pointer },
+		{ NULL, NULL }
+	};
 	struct luaL_Reg notify_methods[] = {
 		{ "relname", notify_relname },
 		{ "pid", notify_pid },
@@ -2427,6 +10583,208 @@ luaopen_pgsql(lua_State *L)
 	}
 	lua_pop(L, 1);
 
+	if (luaL_newmetatable(L, STMT_METATABLE)) {
+		luaL_setfuncs(L, stmt_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, stmt_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, CANCEL_METATABLE)) {
+		luaL_setfuncs(L, cancel_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, cancel_finish);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, cancel_finish);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, FUTURE_METATABLE)) {
+		luaL_setfuncs(L, future_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, future_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, future_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, REPL_METATABLE)) {
+		luaL_setfuncs(L, repl_methods, 0);
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, repl_stop);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, ROUTER_METATABLE)) {
+		luaL_setfuncs(L, router_methods, 0);
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, router_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, CACHE_METATABLE)) {
+		luaL_setfuncs(L, cache_methods, 0);
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, CENTRY_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, centry_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, SHCACHE_METATABLE)) {
+		luaL_setfuncs(L, shcache_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, shc_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, shc_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, PGOUTPUT_METATABLE)) {
+		luaL_setfuncs(L, pgoutput_methods, 0);
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, VECTOR_METATABLE)) {
+		luaL_setfuncs(L, vector_methods, 0);
+		lua_pushliteral(L, "__index");
+		lua_pushcfunction(L, vector_index);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__len");
+		lua_pushcfunction(L, vector_len);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, PROFILE_METATABLE)) {
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+	if (luaL_newmetatable(L, SPANS_METATABLE)) {
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, RECORD_METATABLE)) {
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, NOTICE_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, notice_clear);
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, NOTICEQ_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, noticeq_clear);
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+#if PG_VERSION_NUM >= 140000
+	if (luaL_newmetatable(L, TRACERING_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, tracering_close);
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+#endif
+
 	if (luaL_newmetatable(L, GCMEM_METATABLE)) {
 		lua_pushliteral(L, "__gc");
 		lua_pushcfunction(L, gcmem_clear);
@@ -36,16 +36,71 @@
 #define FIELD_METATABLE		"pgsql tuple field"
 #define NOTIFY_METATABLE	"pgsql asynchronous notification"
 #define GCMEM_METATABLE		"pgsql garbage collected memory"
+#define NOTICE_METATABLE	"pgsql notice handler"
+#define NOTICEQ_METATABLE	"pgsql notice queue"
+#define TRACERING_METATABLE	"pgsql trace ring"
+#define PROFILE_METATABLE	"pgsql profile"
+#define SPANS_METATABLE		"pgsql spans"
+#define RECORD_METATABLE	"pgsql record"
+#define STMT_METATABLE		"pgsql statement"
+#define CANCEL_METATABLE	"pgsql cancel request"
+#define FUTURE_METATABLE	"pgsql future"
+#define VECTOR_METATABLE	"pgsql vector"
+#define REPL_METATABLE		"pgsql replication stream"
+#define PGOUTPUT_METATABLE	"pgsql pgoutput decoder"
+#define ROUTER_METATABLE	"pgsql router"
+#define CACHE_METATABLE		"pgsql cache"
+#define CENTRY_METATABLE	"pgsql cache entry"
+#define SHCACHE_METATABLE	"pgsql shared cache"
 
 /* OIDs from server/pg_type.h */
 #define BOOLOID			16
+#define BYTEAOID		17
+#define CHAROID			18
+#define NAMEOID			19
 #define INT8OID			20
 #define INT2OID			21
 #define INT4OID			23
 #define TEXTOID			25
+#define OIDOID			26
+#define JSONOID			114
+#define XMLOID			142
 #define FLOAT4OID		700
 #define FLOAT8OID		701
+#define UNKNOWNOID		705
+#define BPCHAROID		1042
+#define VARCHAROID		1043
 #define NUMERICOID		1700
+#define RECORDOID		2249
+#define JSONBOID		3802
+
+/* Apache Arrow type ids, message header types and version */
+#define ARROW_INT		2
+#define ARROW_FLOAT		3
+#define ARROW_BINARY		4
+#define ARROW_UTF8		5
+#define ARROW_BOOL		6
+#define ARROW_SCHEMA		1
+#define ARROW_RECORDBATCH	3
+#define ARROW_V5		4
+
+/* Value kinds, used to select the binary and text converters */
+enum kind {
+	KIND_OTHER = 0,
+	KIND_BOOL,
+	KIND_INT2,
+	KIND_INT4,
+	KIND_INT8,
+	KIND_OID,
+	KIND_FLOAT4,
+	KIND_FLOAT8,
+	KIND_NUMERIC,
+	KIND_TEXT,
+	KIND_BYTEA,
+	KIND_JSONB,
+	KIND_RECORD,
+	KIND_ARRAY
+};
 
 typedef struct tuple {
 	PGresult	*res;
@@ -57,9 +112,354 @@ typedef struct field {
 	int		 col;
 } field;
 
+/* Growable buffer, allocated with gcmalloc() */
+typedef struct pgbuf {
+	char		*data;
+	size_t		 len;
+	size_t		 size;
+} pgbuf;
+
+/* A binary encoded value of a given type, usable as query parameter */
+typedef struct record {
+	Oid		 oid;
+	int		 len;
+	char		 data[];
+} record;
+
+/*
+ * A prepared statement with per parameter encoders and per column
+ * decoders, determined once when the statement is prepared.
+ */
+typedef struct statement {
+	char		 name[64];
+	int		 nparams;
+	int		 nfields;
+	int		 resultFormat;
+	char		**paramValues;
+	size_t		*paramOffsets;
+	Oid		*paramTypes;
+	int		*paramKinds;
+	int		*paramLengths;
+	int		*paramFormats;
+	Oid		*colTypes;
+	int		*colKinds;
+	pgbuf		 buf;
+} statement;
+
+/*
+ * A cancel request.  Without the asynchronous cancel functions of libpq
+ * 17, the request is sent synchronously when it is created.
+ */
+typedef struct cancel {
+#if PG_VERSION_NUM >= 170000
+	PGcancelConn	*cconn;
+#else
+	int		 finished;
+	int		 ok;
+	char		 errbuf[256];
+#endif
+} cancel;
+
+/*
+ * A query executed on a worker thread.  The worker only calls libpq, the
+ * connection is taken away from its Lua object until the future is
+ * joined.  command and the parameters live in the single allocation mem.
+ * cancel is created before the worker starts, as only PQcancel() may be
+ * called while it uses the connection.
+ */
+typedef struct future {
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	PGconn		*conn;
+	PGconn		**slot;
+	PGcancel	*cancel;
+	PGresult	*res;
+	int		 started;
+	int		 done;
+	int		 joined;
+	struct notice	*receiver;
+	struct notice	*processor;
+	char		**notices;
+	int		 nnotices;
+	const char	*command;
+	int		 nparams;
+	Oid		*paramTypes;
+	char		**paramValues;
+	int		*paramLengths;
+	int		*paramFormats;
+	void		*mem;
+} future;
+
+/*
+ * A result column decoded to a contiguous array of int64_t, double or
+ * one byte booleans, followed by a validity bitmap (bit n is set if value
+ * n is not NULL, least significant bit first).
+ */
+typedef struct vector {
+	int		 kind;
+	int		 len;
+	int		 nulls;
+	unsigned char	*valid;
+	int64_t		 data[];
+} vector;
+
+/* CSV output options and destination, either a buffer or a file */
+typedef struct csv {
+	const char	*delimiter;
+	size_t		 delimiterlen;
+	const char	*null;
+	size_t		 nulllen;
+	const char	*newline;
+	size_t		 newlinelen;
+	char		 quote;
+	int		 header;
+	luaL_Buffer	*b;
+	FILE		*fp;
+	int		 error;
+} csv;
+
+/* Values converted by a decoding thread, for rows lo to hi - 1 */
+typedef union cvalue {
+	lua_Integer	 i;
+	lua_Number	 n;
+	int		 b;
+} cvalue;
+
+typedef struct rowjob {
+	pthread_t	 thread;
+	PGresult	*res;
+	int		*cols;
+	int		*kinds;
+	int		 nconv;
+	int		 lo;
+	int		 hi;
+	cvalue		*values;
+} rowjob;
+
+/*
+ * A logical replication stream, the connection is kept as uservalue.
+ * Unless confirm is set, flushed follows received, i.e. a record counts
+ * as processed when the next one is read.
+ */
+typedef struct replication {
+	uint64_t	 received;	/* last WAL position received */
+	uint64_t	 flushed;	/* position reported as flushed */
+	int64_t		 feedback;	/* time of the last status update */
+	int		 interval;	/* status update interval in ms */
+	int		 confirm;
+	int		 done;
+} replication;
+
+/*
+ * pgoutput decoder state, the relation cache lives in the uservalue.
+ * Within a streamed transaction, messages carry a transaction id.
+ */
+typedef struct pgoutput {
+	int		 streaming;
+} pgoutput;
+
+/* Cached column types of a relation, resolved when it is announced */
+typedef struct relcols {
+	int		 natts;
+	struct {
+		Oid	 oid;
+		int	 kind;
+	}		 att[];
+} relcols;
+
+/* A pgoutput message being parsed */
+typedef struct msgreader {
+	lua_State	*L;
+	const char	*p;
+	const char	*end;
+} msgreader;
+
 typedef struct notice {
 	lua_State	*L;
 	int		 f;
+	future		*future;	/* queue notices while offloaded */
 } notice;
 
+/*
+ * Notices queued in C, a ring of at most limit messages.  When it is
+ * full, the oldest message is dropped.  The notice processor it replaced
+ * is restored when the queue is removed.
+ */
+typedef struct noticeq {
+	char		**msgs;
+	int		 limit;
+	int		 first;
+	int		 count;
+	lua_Integer	 dropped;
+	PQnoticeProcessor prevfn;
+	void		*prevarg;
+} noticeq;
+
+/*
+ * Protocol trace ring buffer.  libpq traces to a FILE that writes into
+ * the ring; of each line only the head is kept to find the message.
+ */
+typedef struct traceent {
+	int64_t		 time;		/* monotonic, in microseconds */
+	int32_t		 length;
+	uint8_t		 msg;		/* index in the message table */
+	char		 dir;		/* 'F' to the server, 'B' from it */
+} traceent;
+
+typedef struct tracering {
+	PGconn		**conn;
+	FILE		*fp;
+	lua_Integer	 total;		/* messages seen */
+	int		 size;
+	int		 headlen;
+	char		 head[64];
+	traceent	 ents[];
+} tracering;
+
+/*
+ * Query profiling, kept in the registry.  The uservalue holds the
+ * statistics per statement and the slow query log.
+ */
+#define PROFILE_BUCKETS	32
+
+typedef struct profile {
+	int		 enabled;
+	int64_t		 slow;		/* threshold in microseconds or -1 */
+	int		 slowmax;	/* size of the slow query log */
+	lua_Integer	 nslow;		/* slow queries seen */
+} profile;
+
+/*
+ * Latencies of a statement in microseconds.  Histogram bucket n counts
+ * durations shorter than 2^n, but not shorter than 2^(n-1) microseconds.
+ */
+typedef struct profstat {
+	lua_Integer	 calls;
+	lua_Integer	 errors;
+	lua_Integer	 rows;
+	int64_t		 total;
+	int64_t		 min;
+	int64_t		 max;
+	lua_Integer	 hist[PROFILE_BUCKETS];
+} profstat;
+
+/*
+ * Phase timestamps of a query, in microseconds on the monotonic clock:
+ * entry, parameters encoded, query sent, first response data and last
+ * result received.  decode is the time spent converting the result.
+ */
+typedef struct qspan {
+	const PGresult	*res;
+	int64_t		 start;
+	int64_t		 encoded;
+	int64_t		 sent;
+	int64_t		 first;
+	int64_t		 done;
+	int64_t		 decode;
+	lua_Integer	 rows;
+	int		 failed;
+} qspan;
+
+/* Spans collected until a batch is handed to the callback */
+typedef struct spans {
+	int64_t		 offset;	/* to convert to Unix time */
+	int		 size;
+	int		 count;
+	qspan		 ents[];
+} spans;
+
+/*
+ * A router over a primary and its replicas, the uservalue holds the
+ * connection objects of the nodes.  The latencies of the last
+ * HEDGE_SAMPLES reads in microseconds determine the hedging delay.
+ */
+#define HEDGE_SAMPLES	128
+
+typedef struct rnode {
+	double		 latency;	/* moving average in milliseconds */
+	int64_t		 retry;		/* when to retry a failed node */
+	int		 inflight;
+	int		 state;
+	int		 draining;	/* results of a cancelled hedge */
+} rnode;
+
+typedef struct router {
+	double		 alpha;		/* weight of a new latency sample */
+	uint64_t	 rand;
+	int		 retry;
+	int		 hedge;		/* percentile, 0 if not hedging */
+	int		 hedgemin;	/* minimum delay in milliseconds */
+	int		 nsamples;
+	int64_t		 samples[HEDGE_SAMPLES];
+	lua_Integer	 hedged;	/* second requests sent */
+	lua_Integer	 hedgewins;	/* second requests that won */
+	int		 n;
+	rnode		 nodes[];
+} router;
+
+/*
+ * Result cache entries are kept in a list, most recently used first.
+ * The key is the command followed by the encoded parameters.
+ */
+typedef struct centry {
+	PGresult	*res;
+	int64_t		 expires;	/* monotonic ms, -1 for never */
+	size_t		 size;
+	struct centry	*prev;
+	struct centry	*next;
+	size_t		 keylen;
+	char		 key[];
+} centry;
+
+typedef struct cache {
+	int64_t		 ttl;
+	size_t		 memory;	/* limit in bytes */
+	size_t		 used;
+	lua_Integer	 count;
+	lua_Integer	 hits;
+	lua_Integer	 misses;
+	lua_Integer	 evictions;
+	lua_Integer	 invalidations;
+	lua_Integer	 generation;	/* changes on every invalidation */
+	centry		*head;
+	centry		*tail;
+} cache;
+
+/*
+ * Shared result cache file: a header followed by fixed size slots, each
+ * holding a key and a serialized result.
+ */
+#define SHCACHE_MAGIC	"pgsqlshc"
+#define SHCACHE_VERSION	2
+
+typedef struct shheader {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 slotsize;
+	uint64_t	 nslots;
+} shheader;
+
+typedef struct shslot {
+	uint32_t	 seq;		/* odd while being written */
+	uint32_t	 keylen;
+	uint32_t	 vallen;
+	uint32_t	 pad;
+	uint64_t	 lock;		/* owner pid and time, 0 if free */
+	uint64_t	 hash;		/* of the key */
+	uint64_t	 check;		/* hash of the value */
+	int64_t		 expires;	/* Unix time in ms, 0 if empty */
+	int64_t		 stamp;		/* when written */
+	char		 data[];	/* key followed by value */
+} shslot;
+
+typedef struct shcache {
+	shheader	*hdr;
+	size_t		 maplen;
+	int64_t		 ttl;
+	lua_Integer	 hits;
+	lua_Integer	 misses;
+	lua_Integer	 stores;
+} shcache;
+
 #endif /* __LUAPGSQL_H__ */
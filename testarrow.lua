@@ -0,0 +1,50 @@
+-- Test the Arrow IPC stream export
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local function u32(s, pos)
+	return string.unpack('<I4', s, pos)
+end
+
+local res = conn:exec([[select g as i, g / 2.0::float8 as f, g % 2 = 0 as b,
+    'row ' || g as t from generate_series(1, 100) g]])
+
+-- A stream is a schema message, a record batch message and an end marker
+local stream = res:toArrow()
+local schema, batch = res:toArrow('schema'), res:toArrow('batch')
+assert(stream == schema .. batch .. res:toArrow('end'))
+assert(res:toArrow('end') == '\xff\xff\xff\xff\0\0\0\0')
+assert(#schema % 8 == 0 and #batch % 8 == 0)
+assert(u32(schema, 1) == 0xffffffff and u32(schema, 5) == #schema - 8)
+assert(u32(batch, 1) == 0xffffffff)
+
+-- Several batches, e.g. from chunked rows mode, share one schema
+if pgsql.PGRES_TUPLES_CHUNK then
+	local out = {}
+	assert(conn:sendQuery('select g from generate_series(1, 10) g'))
+	assert(conn:setChunkedRowsMode(4))
+	local r = conn:getResult()
+	while r do
+		if r:status() == pgsql.PGRES_TUPLES_CHUNK then
+			if #out == 0 then
+				out[1] = r:toArrow('schema')
+			end
+			out[#out + 1] = r:toArrow('batch')
+		else
+			out[#out + 1] = r:toArrow('end')
+		end
+		r = conn:getResult()
+	end
+	assert(#out == 5)
+end
+
+local f = io.open('/tmp/luapgsql-test.arrow', 'wb')
+f:write(stream)
+f:close()
+print('written /tmp/luapgsql-test.arrow')
+
+conn:finish()
+print('ok')
@@ -0,0 +1,81 @@
+-- Test the result cache
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+local other = pgsql.connectdb('')
+
+other:exec('drop table if exists luapgsql_cache')
+other:exec('create table luapgsql_cache (id integer, name text)')
+other:exec("insert into luapgsql_cache values (1, 'one'), (2, 'two')")
+
+local cache = pgsql.cache(conn, { ttl = 200 })
+assert(cache:listen('luapgsql_cache'))
+
+local sql = 'select name from luapgsql_cache where id = $1::integer'
+local res = cache:execTagged('ref', sql, 1)
+assert(res:ntuples() == 1 and res[1].name == 'one')
+res = cache:execTagged({ 'ref', 'other' }, sql, 2)
+assert(res[1].name == 'two')
+
+-- Hits return a result of their own
+other:exec("update luapgsql_cache set name = 'uno' where id = 1")
+res = cache:exec(sql, 1)
+assert(res[1].name == 'one' and res:nfields() == 1)
+res:clear()
+assert(cache:exec(sql, 1)[1].name == 'one')
+local st = cache:stats()
+assert(st.entries == 2 and st.hits == 2 and st.misses == 2)
+assert(st.memory > 0)
+
+-- Parameters of different types are different keys
+assert(cache:exec(sql, '1')[1].name == 'uno')
+assert(cache:exec(sql, 1.0)[1].name == 'uno')
+assert(cache:stats().entries == 4)
+
+-- Invalidation by notification
+other:exec("notify luapgsql_cache, 'ref'")
+other:exec('select pg_sleep(0.05)')
+assert(cache:exec(sql, 1)[1].name == 'uno')
+st = cache:stats()
+assert(st.invalidations == 2 and st.entries == 3)
+
+-- An empty payload invalidates the entries tagged with the channel
+cache:execTagged('luapgsql_cache', 'select count(*) from luapgsql_cache')
+other:exec('notify luapgsql_cache')
+other:exec('select pg_sleep(0.05)')
+assert(cache:invalidate('nothing') == 0)
+assert(cache:stats().invalidations == 3)
+cache:execTagged('ref', sql, 2)
+assert(cache:invalidate('ref') == 1)
+
+-- Expiry
+cache:exec('select 1')
+other:exec('select pg_sleep(0.25)')
+local misses = cache:stats().misses
+cache:exec('select 1')
+assert(cache:stats().misses == misses + 1)
+
+-- Errors are not cached
+assert(cache:exec('select * from luapgsql_nonexistent'):status()
+    == pgsql.PGRES_FATAL_ERROR)
+cache:exec('select * from luapgsql_nonexistent')
+assert(cache:stats().misses == misses + 3)
+
+cache:clear()
+assert(cache:stats().entries == 0 and cache:stats().memory == 0)
+
+-- Least recently used entries are evicted
+cache = pgsql.cache(conn, { memory = 4096 })
+for n = 1, 100 do
+	cache:exec('select $1::integer', n)
+end
+st = cache:stats()
+assert(st.memory <= 4096 and st.evictions > 0)
+assert(st.entries + st.evictions == 100)
+cache:exec('select $1::integer', 100)
+assert(cache:stats().hits == 1)
+
+other:exec('drop table luapgsql_cache')
+print('cache ok')
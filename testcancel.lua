@@ -0,0 +1,57 @@
+-- Test cancel requests
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local other = pgsql.connectdb('')
+
+-- Send a long query and wait until the server runs it
+local function sleep()
+	assert(conn:sendQuery('select pg_sleep(10)'))
+	local sql = string.format([[select 1 from pg_stat_activity
+	    where pid = %d and state = 'active']], conn:backendPID())
+	while other:exec(sql):ntuples() == 0 do
+	end
+end
+
+local function cancelled()
+	local res = conn:getResult()
+	assert(res:status() == pgsql.PGRES_FATAL_ERROR)
+	assert(res:errorField(pgsql.PG_DIAG_SQLSTATE) == '57014')
+	while conn:getResult() do
+	end
+end
+
+local start = os.time()
+
+-- Driven by polling, as from an event loop
+sleep()
+local c = assert(conn:cancelStart())
+local status
+repeat
+	status = c:poll()
+until status == pgsql.PGRES_POLLING_OK or
+    status == pgsql.PGRES_POLLING_FAILED
+assert(status == pgsql.PGRES_POLLING_OK, c:errorMessage())
+assert(c:status() == pgsql.CONNECTION_OK)
+assert(c:wait() == true)
+c:finish()
+assert(not pcall(c.poll, c))
+cancelled()
+
+-- Blocking, with and without a timeout
+sleep()
+assert(conn:cancel(5000) == true)
+cancelled()
+sleep()
+assert(conn:cancel() == true)
+cancelled()
+
+-- Nothing running
+assert(conn:cancel(1000) == true)
+assert(conn:exec('select 1'):getvalue(1, 1) == '1')
+
+assert(os.time() - start < 8)
+print('cancel ok')
@@ -0,0 +1,61 @@
+-- Testing the type catalogue and composite type conversion
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+if conn:status() ~= pgsql.CONNECTION_OK then
+	print('database connection failed')
+	print(conn:errorMessage())
+	os.exit(1)
+end
+
+conn:exec('drop type if exists luapgsql_test cascade')
+conn:exec('create type luapgsql_test as (a integer, b text, c numeric, d integer[])')
+
+local info = conn:typeInfo('luapgsql_test')
+print(info.name, info.type, #info.attrs)
+for n, attr in ipairs(info.attrs) do
+	print(n, attr.name, conn:typeInfo(attr.type).name)
+end
+
+local res = conn:exec([[
+select (1, 'a "quoted", string', 12.5, '{1,NULL,3}')::luapgsql_test as x
+]])
+
+local x = res:decode(1, 1)
+print(x.a, x.b, x.c, x.d[1], x.d[2], x.d[3])
+
+local rec = conn:record('luapgsql_test', {
+	a = 42,
+	b = 'hello',
+	c = '3.1415926535897932384626',
+	d = { 5, 6 }
+})
+
+res = conn:execParams('select ($1).b, ($1).c::text, ($1).d::text', rec)
+if res:status() ~= pgsql.PGRES_TUPLES_OK then
+	print(res:errorMessage())
+else
+	print(res[1][1], res[1][2], res[1][3])
+end
+
+-- Boolean strings and the shortest representation of floats
+conn:exec('drop type if exists luapgsql_flag cascade')
+conn:exec('create type luapgsql_flag as (b boolean, n numeric)')
+conn:clearTypes()
+for _, v in ipairs({ { 'f', 'false' }, { 'false', 'false' },
+    { 'Yes', 'true' }, { true, 'true' }, { false, 'false' } }) do
+	rec = conn:record('luapgsql_flag', { b = v[1], n = 0.1 })
+	res = conn:execParams('select ($1).b::text, ($1).n::text', rec)
+	assert(res[1][1] == v[2] and res[1][2] == '0.1')
+end
+assert(not pcall(conn.record, conn, 'luapgsql_flag', { b = 'maybe' }))
+assert(not pcall(conn.record, conn, 'luapgsql_flag', { b = 1 }))
+rec = conn:record('luapgsql_flag', { n = 1 / 3 })
+res = conn:execParams('select ($1).n::float8 = $2', rec, 1 / 3)
+assert(res[1][1] == 't')
+conn:exec('drop type luapgsql_flag')
+
+conn:clearTypes()
+conn:exec('drop type luapgsql_test')
+conn:finish()
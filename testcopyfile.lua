@@ -0,0 +1,47 @@
+-- Test conn:copyToFile() and conn:copyFromFile()
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local name = os.tmpname()
+
+local fh = io.open(name, 'w')
+local count, err = conn:copyToFile(
+    'copy (select n, repeat(\'x\', n % 100) from generate_series(1, 100000) n)'
+    .. ' to stdout', fh)
+fh:close()
+assert(count == 100000 and err == nil)
+
+conn:exec('create temporary table copied (a integer, b text)')
+
+-- A small buffer splits rows across several CopyData messages
+fh = io.open(name, 'r')
+count, err = conn:copyFromFile('copy copied from stdin', fh, 1000)
+fh:close()
+assert(count == 100000 and err == nil)
+assert(conn:exec('select sum(a), sum(length(b)) from copied')
+    :getvalue(1, 1) == '5000050000')
+
+-- Errors from the server are returned, the connection remains usable
+fh = io.open(name, 'r')
+count, err = conn:copyFromFile('copy copied (a) from stdin', fh)
+fh:close()
+assert(count == nil and err:find('extra data'))
+
+count, err = conn:copyToFile('select 1', io.stdout)
+assert(count == nil and err == 'command is not a matching COPY')
+
+fh = io.open(name, 'w')
+count, err = conn:copyFromFile('copy copied to stdout', fh)
+fh:close()
+assert(count == nil)
+assert(conn:exec('select 1'):getvalue(1, 1) == '1')
+
+fh = io.open(name, 'r')
+fh:close()
+assert(not pcall(conn.copyToFile, conn, 'copy copied to stdout', fh))
+
+os.remove(name)
+print 'ok'
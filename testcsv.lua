@@ -0,0 +1,62 @@
+-- Test res:toCSV() and res:writeCSV()
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local res = conn:exec([[
+select 1 as id, 'plain' as "a b", 'with, comma' as c, 'say "hi"' as d,
+    E'two\nlines' as e, null as f, '' as g
+union all
+select 2, 'NULL', '', '', '', 'x', null
+]])
+
+assert(res:toCSV() == 'id,a b,c,d,e,f,g\n' ..
+    '1,plain,"with, comma","say ""hi""","two\nlines",,""\n' ..
+    '2,NULL,"","","",x,\n')
+
+-- Values equal to the null text are quoted
+assert(res:toCSV({ null = 'NULL', header = false }) ==
+    '1,plain,"with, comma","say ""hi""","two\nlines",NULL,\n' ..
+    '2,"NULL",,,,x,NULL\n')
+
+-- Custom delimiter, quote and newline
+assert(res:toCSV({ delimiter = ';', newline = '\r\n', quote = "'",
+    header = false }) ==
+    "1;plain;with, comma;say \"hi\";'two\nlines';;''\r\n" ..
+    "2;NULL;'';'';'';x;\r\n")
+assert(res:toCSV({ delimiter = '::', header = false }):find('^1::plain::'))
+assert(conn:exec("select 'a::b'"):toCSV({ delimiter = '::' }) ==
+    '?column?\n"a::b"\n')
+
+-- Numbers are accepted as option strings
+assert(res:toCSV({ null = 0, header = false }):find(',0,\n2,'))
+assert(res:toCSV({ delimiter = 9, header = false }):find('^19plain9'))
+
+assert(not pcall(res.toCSV, res, { delimiter = '' }))
+assert(not pcall(res.toCSV, res, { quote = "''" }))
+
+-- Results without tuples
+assert(conn:exec('select 1 as a where false'):toCSV() == 'a\n')
+assert(conn:exec('set search_path to public'):toCSV() == '')
+
+-- Writing to files
+local path = os.tmpname()
+local f = assert(io.open(path, 'w'))
+assert(res:writeCSV(f, { delimiter = '|' }) == true)
+f:close()
+f = assert(io.open(path))
+assert(f:read('a') == res:toCSV({ delimiter = '|' }))
+f:close()
+os.remove(path)
+assert(not pcall(res.writeCSV, res, f))
+
+f = io.open('/dev/full', 'w')
+if f then
+	local ok, err = res:writeCSV(f)
+	assert(ok == nil and err:find('space'))
+	f:close()
+end
+
+print('csv ok')
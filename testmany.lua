@@ -0,0 +1,53 @@
+-- Test conn:execPreparedMany()
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+conn:exec('create temporary table many (a integer primary key, b text)')
+assert(conn:prepare('ins', 'insert into many values ($1, $2)')
+    :status() == pgsql.PGRES_COMMAND_OK)
+
+local rows = {}
+for n = 1, 10000 do
+	rows[n] = { n, 'row ' .. n }
+end
+
+local count, err, row = conn:execPreparedMany('ins', rows)
+assert(count == 10000 and err == nil and row == nil)
+assert(conn:exec('select count(*) from many'):getvalue(1, 1) == '10000')
+
+-- A failure aborts the remaining rows and rolls back the preceding ones
+count, err, row = conn:execPreparedMany('ins', {
+	{ 10001, 'a' }, { 1, 'duplicate' }, { 10002, 'b' }
+})
+assert(count == 0 and row == 2 and err:find('duplicate'))
+assert(conn:exec('select count(*) from many'):getvalue(1, 1) == '10000')
+assert(conn:transactionStatus() == pgsql.PQTRANS_IDLE)
+
+-- Inside a transaction, the failure aborts it
+conn:exec('begin')
+count, err, row = conn:execPreparedMany('ins', { { 10001, 'a' }, { 1, 'b' } })
+assert(count == 0 and row == 2)
+assert(conn:transactionStatus() == pgsql.PQTRANS_INERROR)
+conn:exec('rollback')
+assert(conn:exec('select count(*) from many'):getvalue(1, 1) == '10000')
+
+-- The connection leaves pipeline mode after a failure
+count, err, row = conn:execPreparedMany('nonexistent', { { 1 }, { 2 } })
+assert(count == 0 and row == 1 and err:find('nonexistent'))
+assert(conn:pipelineStatus() == pgsql.PQ_PIPELINE_OFF)
+assert(conn:exec('select 1'):getvalue(1, 1) == '1')
+
+assert(conn:prepare('sel', 'select b from many where a = $1')
+    :status() == pgsql.PGRES_COMMAND_OK)
+local results = conn:execPreparedMany('sel', { { 1 }, { 2 }, { 3 } },
+    { results = true })
+assert(#results == 3)
+for n, res in ipairs(results) do
+	assert(res:getvalue(1, 1) == 'row ' .. n)
+end
+
+conn:finish()
+print('ok')
@@ -0,0 +1,87 @@
+-- Test queued notices
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local function raise(n)
+	conn:exec(string.format([[do $$ begin
+	    for i in 1..%d loop raise notice 'notice %%', i; end loop;
+	    end $$]], n))
+end
+
+local notices, dropped = conn:notices()
+assert(#notices == 0 and dropped == 0)
+
+conn:setNoticeQueue(100)
+raise(10)
+notices, dropped = conn:notices()
+assert(#notices == 10 and dropped == 0)
+assert(notices[1]:find('notice 1\n', 1, true))
+assert(notices[10]:find('notice 10\n', 1, true))
+assert(#conn:notices() == 0)
+
+-- The oldest notices are dropped when the queue is full
+raise(250)
+notices, dropped = conn:notices()
+assert(#notices == 100 and dropped == 150)
+assert(notices[1]:find('notice 151\n', 1, true))
+
+-- Resizing the queue keeps pending notices
+raise(5)
+conn:setNoticeQueue(3)
+notices, dropped = conn:notices()
+assert(#notices == 3 and dropped == 2)
+assert(notices[1]:find('notice 3\n', 1, true))
+
+-- A Lua notice processor replaces the queue and is restored with it
+local seen = 0
+conn:setNoticeProcessor(function (msg) seen = seen + 1 end)
+raise(2)
+assert(seen == 2 and #conn:notices() == 0)
+conn:setNoticeQueue(10)
+raise(2)
+assert(seen == 2 and #conn:notices() == 2)
+conn:setNoticeQueue(0)
+raise(2)
+assert(seen == 4)
+
+-- A Lua notice processor installed later stays when the queue is removed
+conn:setNoticeQueue(10)
+conn:setNoticeProcessor(function (msg) seen = seen + 1 end)
+conn:setNoticeQueue(0)
+raise(1)
+assert(seen == 5)
+
+-- Removing the queue restores the default processor, the collected
+-- queue is no longer used
+local other = pgsql.connectdb('')
+other:exec('set client_min_messages to warning')
+for n = 1, 3 do
+	other:setNoticeQueue(5)
+	other:setNoticeQueue(10)
+	other:setNoticeQueue(0)
+	collectgarbage()
+	other:exec([[do $$ begin raise warning 'default processor'; end $$]])
+end
+local pending, lost = other:notices()
+assert(#pending == 0 and lost == 0)
+other:finish()
+
+-- Offloaded queries queue notices from the worker thread
+conn:setNoticeQueue()
+local f = conn:offload([[do $$ begin raise notice 'offloaded'; end $$]])
+f:wait()
+f:result()
+notices = conn:notices()
+assert(#notices == 1 and notices[1]:find('offloaded'))
+
+for n = 1, 1000 do
+	conn:setNoticeProcessor(function () end)
+end
+collectgarbage()
+conn:finish()
+assert(not pcall(conn.notices, conn))
+collectgarbage()
+print 'ok'
@@ -0,0 +1,57 @@
+-- Test queries offloaded to a worker thread
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local notices = {}
+conn:setNoticeProcessor(function (msg)
+	notices[#notices + 1] = msg
+end)
+
+local f = conn:offload('select pg_sleep(0.5), $1::integer + 1 as n', 41)
+assert(f:ready() == false)
+assert(f:wait(10) == false)
+
+-- The connection is not usable while the query runs
+local ok, err = pcall(conn.exec, conn, 'select 1')
+assert(not ok and err:find('busy'))
+
+-- Lua keeps running meanwhile
+local n = 0
+while not f:ready() do
+	n = n + 1
+end
+assert(n > 0)
+assert(f:wait())
+
+local res = f:result()
+assert(res:status() == pgsql.PGRES_TUPLES_OK)
+assert(res[1].n == '42')
+assert(f:result() == res)
+
+-- Notices are delivered on the Lua thread once the future is joined
+f = conn:offload([[do $$ begin raise notice 'offloaded'; end $$]])
+assert(#notices == 0)
+f:result()
+assert(#notices == 1 and notices[1]:find('offloaded'))
+
+-- Several connections can run queries concurrently
+local conns = pgsql.connectMany('', 4)
+local futures = {}
+for k, c in ipairs(conns) do
+	futures[k] = c:offload('select pg_sleep(0.3)')
+end
+for _, fut in ipairs(futures) do
+	assert(fut:result():status() == pgsql.PGRES_TUPLES_OK)
+end
+
+-- A collected future cancels its query and frees the connection
+f = conn:offload('select pg_sleep(10)')
+f = nil
+collectgarbage()
+assert(conn:exec('select 1'):getvalue(1, 1) == '1')
+
+conn:finish()
+print('ok')
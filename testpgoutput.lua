@@ -0,0 +1,84 @@
+-- Test the pgoutput decoder on a logical replication stream
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+conn:exec([[select pg_drop_replication_slot(slot_name)
+    from pg_replication_slots where slot_name = 'cdc']])
+conn:exec('drop table if exists cdc')
+conn:exec('drop publication if exists cdc')
+conn:exec([[create table cdc (id integer primary key, name text,
+    price numeric, ok boolean, tags text[], big text)]])
+conn:exec('alter table cdc replica identity full')
+conn:exec('create publication cdc for table cdc')
+local lsn = conn:exec([[select lsn from
+    pg_create_logical_replication_slot('cdc', 'pgoutput')]]):getvalue(1, 1)
+
+conn:exec([[insert into cdc values (1, 'one', 1.5, true, '{a,b}', null),
+    (2, 'two', 2.25, false, '{}', repeat('x', 10000))]])
+conn:exec([[update cdc set name = 'uno' where id = 1]])
+conn:exec([[delete from cdc where id = 2]])
+conn:exec([[truncate cdc]])
+conn:exec([[insert into cdc (id) select n from generate_series(1, 10000) n]])
+
+local repl = pgsql.connectdb('replication=database')
+local dec = assert(pgsql.pgoutput(repl))
+local stream = assert(repl:startReplication('cdc', lsn, {
+	options = { proto_version = 1, publication_names = 'cdc' }
+}))
+
+-- Five transactions, the last one inserts 10000 rows
+local changes, commits = {}, 0
+local start = os.clock()
+repeat
+	local rec = assert(stream:read(5000))
+	local c = dec:decode(rec.data)
+	changes[#changes + 1] = c
+	if c.op == 'commit' then
+		commits = commits + 1
+	end
+until commits == 5
+print(string.format('%.0f changes/s', #changes / (os.clock() - start)))
+stream:stop()
+
+local ops = {}
+for n = 1, 14 do
+	ops[n] = changes[n].op
+end
+assert(table.concat(ops, ' ') == 'begin relation insert insert commit '
+    .. 'begin update commit begin delete commit begin relation truncate')
+
+local rel = changes[2].relation
+assert(rel.namespace == 'public' and rel.name == 'cdc')
+assert(rel.replicaIdentity == 'f' and #rel.columns == 6)
+assert(dec:relation(rel.id).name == 'cdc')
+
+local new = changes[3].new
+assert(changes[3].relation == rel)
+assert(new.id == 1 and new.name == 'one' and new.price == 1.5)
+assert(new.ok == true and new.tags[2] == 'b' and new.big == nil)
+assert(math.type(changes[1].xid) == 'integer' and changes[1].time > 0)
+assert(#changes[4].new.big == 10000)
+
+local upd = changes[7]
+assert(upd.old.name == 'one' and upd.new.name == 'uno')
+
+-- A delete only carries the old row
+local del = changes[10]
+assert(del.old.id == 2 and del.new == nil)
+
+-- A truncate announces the relation again
+assert(changes[14].relations[1] == changes[13].relation)
+assert(changes[14].cascade == false)
+assert(changes[#changes - 1].new.id == 10000)
+
+assert(not pcall(dec.decode, dec, 'I\0\0\0\1'))
+assert(not pcall(dec.decode, dec, 'B\0'))
+
+repl:finish()
+conn:exec([[select pg_drop_replication_slot('cdc')]])
+conn:exec('drop publication cdc')
+conn:exec('drop table cdc')
+print 'ok'
@@ -0,0 +1,92 @@
+-- Test query profiling
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+assert(pgsql.profile().enabled == false)
+conn:exec('select 1')
+
+pgsql.setProfiling({ slow = 50, slowlog = 2 })
+
+-- Queries differing in their constants are aggregated
+for n = 1, 10 do
+	conn:exec(string.format([[select n, 'a''b' -- comment
+	    from   generate_series(1, %d) n where n < 1.5e3]], n))
+end
+conn:execParams('select $1::integer + 1', 41)
+conn:exec('select * from nonexistent')
+assert(conn:prepare('stmt', 'select $1::text'):status()
+    == pgsql.PGRES_COMMAND_OK)
+conn:execPrepared('stmt', 'x')
+conn:execPrepared('stmt', 'y')
+
+-- Asynchronous queries are accounted when the last result is fetched
+conn:sendQueryParams('select pg_sleep(0.06), $1::boolean', true)
+while conn:getResult() do
+end
+
+local p = pgsql.profile()
+assert(p.enabled)
+
+local st = p.statements[
+    "select n, ? from generate_series(?, ?) n where n < ?"]
+assert(st.calls == 10 and st.rows == 55 and st.errors == 0)
+assert(st.min <= st.mean and st.mean <= st.max and st.p50 <= st.p99)
+local calls = 0
+for _, c in ipairs(st.histogram) do
+	calls = calls + c
+end
+assert(calls == 10 and #st.histogram == 32)
+
+assert(p.statements['select $? + ?'] == nil)
+assert(p.statements['select $1::integer + ?'].calls == 1)
+assert(p.statements['select * from nonexistent'].errors == 1)
+assert(p.statements['EXECUTE stmt'].calls == 2)
+
+local slow = p.slow
+assert(#slow == 1)
+assert(slow[1].query == 'select pg_sleep(?), $1::boolean')
+assert(slow[1].duration >= 50 and slow[1].rows == 1)
+assert(slow[1].params[1] == 'bool')
+
+-- The slow query log keeps the most recent entries
+for n = 1, 3 do
+	conn:execParams('select pg_sleep(0.06), $1', n)
+end
+slow = pgsql.profile(true).slow
+assert(#slow == 2 and slow[2].params[1] == 'int8')
+assert(next(pgsql.profile().statements) == nil)
+
+-- Queries in pipeline mode are not profiled, nor do they disturb the
+-- accounting of other queries
+if conn.enterPipelineMode then
+	assert(conn:enterPipelineMode())
+	for n = 1, 3 do
+		assert(conn:sendQueryParams('select $1::integer', n))
+	end
+	assert(conn:pipelineSync())
+	local results = 0
+	for n = 1, 3 do
+		local res = conn:getResult()
+		assert(res:status() == pgsql.PGRES_TUPLES_OK)
+		assert(res:getvalue(1, 1) == tostring(n))
+		assert(conn:getResult() == nil)
+		results = results + 1
+	end
+	assert(conn:getResult():status() == pgsql.PGRES_PIPELINE_SYNC)
+	assert(conn:exitPipelineMode())
+	assert(results == 3)
+	assert(next(pgsql.profile().statements) == nil)
+
+	conn:sendQuery('select 2')
+	while conn:getResult() do
+	end
+	assert(pgsql.profile(true).statements['select ?'].calls == 1)
+end
+
+pgsql.setProfiling(false)
+conn:exec('select 1')
+assert(next(pgsql.profile().statements) == nil)
+print 'ok'
@@ -0,0 +1,63 @@
+-- Test conn:startReplication() with the pgoutput plugin
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+conn:exec('drop table if exists repl')
+conn:exec('drop publication if exists repl')
+conn:exec('create table repl (a integer primary key, b text)')
+conn:exec('create publication repl for table repl')
+local lsn = conn:exec([[select lsn from
+    pg_create_logical_replication_slot('repl', 'pgoutput')]]):getvalue(1, 1)
+
+local repl = pgsql.connectdb('replication=database')
+assert(repl:status() == pgsql.CONNECTION_OK)
+
+conn:exec([[insert into repl select n, 'row ' || n
+    from generate_series(1, 100) n]])
+
+local stream = assert(repl:startReplication('repl', lsn, {
+	options = { proto_version = 1, publication_names = 'repl' },
+	feedback = 100
+}))
+
+-- Begin, Relation, 100 Inserts and Commit
+local kinds = {}
+repeat
+	local rec = assert(stream:read(5000))
+	assert(math.type(rec.lsn) == 'integer' and rec.time > 0)
+	local kind = rec.data:sub(1, 1)
+	kinds[kind] = (kinds[kind] or 0) + 1
+until kind == 'C'
+assert(kinds.B == 1 and kinds.R == 1 and kinds.I == 100)
+
+local rec, err = stream:read(200)
+assert(rec == nil and err == 'timeout')
+
+local received, flushed = stream:lsn()
+assert(received == flushed)
+assert(stream:feedback())
+assert(stream:stop())
+assert(not pcall(stream.read, stream))
+
+-- The connection is usable again after the stream stopped
+assert(repl:exec('IDENTIFY_SYSTEM'):status() == pgsql.PGRES_TUPLES_OK)
+repl:finish()
+
+-- The flushed position is reported to the server
+local confirmed = conn:exec([[select confirmed_flush_lsn from
+    pg_replication_slots where slot_name = 'repl']]):getvalue(1, 1)
+assert(confirmed ~= lsn)
+
+-- Errors of the START_REPLICATION command are returned
+repl = pgsql.connectdb('replication=database')
+stream, err = repl:startReplication('nonexistent', 0)
+assert(stream == nil and err:find('does not exist'))
+repl:finish()
+
+conn:exec([[select pg_drop_replication_slot('repl')]])
+conn:exec('drop publication repl')
+conn:exec('drop table repl')
+print 'ok'
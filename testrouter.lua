@@ -0,0 +1,81 @@
+-- Test read/write routing, set PGREPLICA to the conninfo of a replica
+
+local pgsql = require 'pgsql'
+
+local replica = os.getenv('PGREPLICA')
+local nodes = { '' }
+if replica then
+	nodes[2] = replica
+end
+
+local router = pgsql.router(nodes, { retry = 100 })
+local info = router:nodes()
+assert(info[1].role == 'primary' and info[1].latency > 0)
+assert(router:primary() == info[1].conn)
+
+router:write('create temporary table luapgsql_router (n integer)')
+assert(router:exec('insert into luapgsql_router values ($1)', 1):status()
+    == pgsql.PGRES_COMMAND_OK)
+
+-- Inside a transaction everything goes to the primary
+router:exec('begin')
+assert(router:exec('select n from luapgsql_router'):ntuples() == 1)
+assert(router:exec('select 1 from luapgsql_router for update'):ntuples()
+    == 1)
+router:exec('commit')
+
+local res = router:exec('select pg_is_in_recovery()')
+if replica then
+	assert(info[2].role == 'replica')
+	assert(router:replica() == info[2].conn)
+	assert(res[1][1] == 't')
+	assert(router:write('select pg_is_in_recovery()')[1][1] == 'f')
+	assert(router:exec([[select pg_is_in_recovery()
+	    from luapgsql_router for share]])[1][1] == 'f')
+else
+	-- Without replicas reads go to the primary
+	assert(router:replica() == info[1].conn)
+	assert(res[1][1] == 'f')
+end
+
+-- A lost connection is reset
+local pid = info[1].conn:backendPID()
+local other = pgsql.connectdb('')
+other:exec('select pg_terminate_backend(' .. pid .. ')')
+local r = router:write('select 1')
+if r == nil or r:status() ~= pgsql.PGRES_TUPLES_OK then
+	r = router:write('select 1')
+end
+assert(r:status() == pgsql.PGRES_TUPLES_OK)
+assert(info[1].conn:backendPID() ~= pid)
+assert(router:nodes()[1].role == 'primary')
+
+router:close()
+assert(router:exec('select 1') == nil)
+
+-- Hedged reads, using two connections to the replica
+if replica then
+	router = pgsql.router({ '', replica, replica }, { hedge = 90 })
+	assert(router:hedging() == nil)
+	for n = 1, 20 do
+		router:exec('select 1')
+	end
+	local delay, hedged, wins = router:hedging()
+	assert(delay >= 1 and hedged == 0 and wins == 0)
+
+	-- Stall one of the replica connections
+	local slow = router:nodes()[2].conn:backendPID()
+	local sql = string.format([[select pg_sleep(case pg_backend_pid()
+	    when %d then 2 else 0 end), $1::integer]], slow)
+	for n = 1, 30 do
+		assert(router:exec(sql, n)[1][2] == tostring(n))
+		delay, hedged, wins = router:hedging()
+		if hedged > 0 then
+			break
+		end
+	end
+	assert(hedged == 1 and wins == 1)
+	assert(router:read('select 42')[1][1] == '42')
+	router:close()
+end
+print('router ok')
@@ -0,0 +1,76 @@
+-- Test res:rows() and res:copy()
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local res = conn:exec([[
+select n as id, n * 1.5 as f, n % 2 = 0 as even, 'row ' || n as name,
+    case when n = 2 then null else n end as maybe
+from generate_series(1, 3) n
+]])
+assert(res:status() == pgsql.PGRES_TUPLES_OK)
+
+-- Hash mode is the default, values are strings unless converted
+local rows = res:rows()
+assert(#rows == 3)
+assert(rows[1].id == '1' and rows[1].f == '1.5' and rows[1].even == 'f')
+assert(rows[3].name == 'row 3' and rows[3].maybe == '3')
+assert(rows[1][1] == nil)
+
+rows = res:rows('hash', true)
+assert(rows[2].id == 2 and math.type(rows[2].id) == 'integer')
+assert(rows[2].f == 3.0 and math.type(rows[2].f) == 'float')
+assert(rows[2].even == true and rows[1].even == false)
+assert(rows[2].name == 'row 2')
+
+-- Array mode
+rows = res:rows('array')
+assert(#rows == 3 and #rows[1] == 5)
+assert(rows[1][1] == '1' and rows[1][4] == 'row 1')
+assert(rows[1].id == nil)
+
+rows = res:rows('array', true)
+assert(rows[3][1] == 3 and rows[3][2] == 4.5 and rows[3][3] == false)
+
+-- NULLs are empty strings, as with res:copy(), and zero when converted
+assert(res:rows()[2].maybe == '' and res:getisnull(2, 5))
+assert(res:rows('array', true)[2][5] == 0)
+
+assert(not pcall(res.rows, res, 'list'))
+
+-- res:copy() returns the same as hash mode
+local copy = res:copy(true)
+rows = res:rows('hash', true)
+for n = 1, 3 do
+	for k, v in pairs(rows[n]) do
+		assert(copy[n][k] == v)
+	end
+end
+
+-- Empty results
+res = conn:exec('select 1 as a where false')
+assert(#res:rows() == 0 and #res:rows('array', true) == 0)
+
+-- Converting on several threads gives the same rows
+res = conn:exec([[
+select n, n::int2 as s, n::int8 * 1000000000 as b, n / 7.0 as q,
+    n::float4 / 3 as f, n % 3 = 0 as t, 'v' || n as name,
+    case when n % 5 = 0 then null else n end as maybe
+from generate_series(1, 20000) n
+]])
+local function same(a, b)
+	assert(#a == #b)
+	for n = 1, #a do
+		for k, v in pairs(a[n]) do
+			assert(b[n][k] == v and math.type(b[n][k]) == math.type(v))
+		end
+	end
+end
+same(res:copy(true), res:copy(true, 4))
+same(res:copy(true, 4), res:copy(true))
+same(res:rows('array', true), res:rows('array', true, 64))
+same(res:rows('array'), res:rows('array', false, 4))
+
+print('rows ok')
@@ -0,0 +1,96 @@
+-- Test result serialization
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local res = conn:exec([[
+select n, n::text || repeat('x', n % 200) as s, n::float8 / 3 as f,
+    case when n % 3 = 0 then null else n % 2 = 0 end as b,
+    '\x00ff'::bytea as raw, array[n, n + 1] as a
+from generate_series(1, 1000) n]])
+local blob = res:serialize()
+assert(type(blob) == 'string' and blob:sub(1, 3) == 'PGR')
+
+local copy = pgsql.deserialize(blob, conn)
+assert(copy:status() == pgsql.PGRES_TUPLES_OK)
+assert(copy:ntuples() == res:ntuples() and copy:nfields() == res:nfields())
+for col = 1, res:nfields() do
+	assert(copy:fname(col) == res:fname(col))
+	assert(copy:ftype(col) == res:ftype(col))
+	assert(copy:fmod(col) == res:fmod(col))
+	assert(copy:fsize(col) == res:fsize(col))
+	assert(copy:fformat(col) == res:fformat(col))
+end
+for row = 1, res:ntuples() do
+	for col = 1, res:nfields() do
+		assert(copy:getisnull(row, col) == res:getisnull(row, col))
+		assert(copy:getvalue(row, col) == res:getvalue(row, col))
+	end
+end
+assert(copy:getisnull(3, 4) and not copy:getisnull(2, 4))
+assert(copy[2].b == res[2].b and copy[10].s == res[10].s)
+
+-- Conversions with the type catalogue work on the copy
+local rows = copy:rows('array', true)
+assert(rows[7][1] == 7 and #rows == 1000)
+assert(copy:decode(1, 6)[2] == 2)
+
+-- Results in binary format
+local stmt = conn:statement([[
+select n as i, n::int8 << 40 as b, n::float8 / 3 as f, n / 7.0 as num,
+    'row ' || n as t, n % 2 = 0 as flag,
+    decode(lpad(to_hex(n), 4, '0'), 'hex') as raw, array[n, null, n + 1] as a,
+    timestamp '2000-01-01' + n * interval '1 day' as ts,
+    case when n % 3 = 0 then null else n end as maybe
+from generate_series(1, $1::integer) n]])
+local bin = stmt:execBinary(100)
+assert(bin:ntuples() == 100 and bin:fformat(1) == 1)
+copy = pgsql.deserialize(bin:serialize(), conn)
+assert(copy:ntuples() == 100 and copy:nfields() == bin:nfields())
+for col = 1, bin:nfields() do
+	assert(copy:fformat(col) == 1 and copy:ftype(col) == bin:ftype(col))
+end
+for row = 1, bin:ntuples() do
+	for col = 1, bin:nfields() do
+		assert(copy:getisnull(row, col) == bin:getisnull(row, col))
+		assert(copy:getlength(row, col) == bin:getlength(row, col))
+		assert(copy:getvalue(row, col) == bin:getvalue(row, col))
+	end
+end
+assert(copy:decode(5, 1) == 5 and copy:decode(5, 2) == 5 << 40)
+assert(copy:decode(5, 5) == 'row 5' and copy:decode(6, 6) == true)
+assert(copy:decode(5, 7) == '\0\5')
+assert(copy:decode(5, 8)[1] == 5 and copy:decode(5, 8)[3] == 6)
+assert(copy:decode(3, 10) == nil and copy:decode(4, 10) == 4)
+assert(copy:vector(3):sum() == bin:vector(3):sum())
+
+-- Wide results
+local cols = {}
+for n = 1, 1500 do
+	cols[n] = string.format("'v%d' as c%d", n, n)
+end
+local wide = conn:exec('select ' .. table.concat(cols, ', '))
+copy = pgsql.deserialize(wide:serialize())
+assert(copy:nfields() == 1500 and copy:fname(1500) == 'c1500')
+assert(copy:getvalue(1, 1) == 'v1' and copy:getvalue(1, 1500) == 'v1500')
+
+-- Empty results and results without tuples
+local empty = pgsql.deserialize(conn:exec('select 1 as x where false')
+    :serialize())
+assert(empty:ntuples() == 0 and empty:fname(1) == 'x')
+local none, err = conn:exec('set search_path to public'):serialize()
+assert(none == nil and err == 'result has no tuples')
+
+-- Malformed input
+assert(pgsql.deserialize('') == nil)
+assert(pgsql.deserialize(blob:sub(1, #blob - 1)) == nil)
+assert(pgsql.deserialize(blob .. 'x') == nil)
+assert(select(2, pgsql.deserialize('PGR\2' .. blob:sub(5))):find('version'))
+
+-- Values with embedded zeros survive
+local z = conn:execParams("select $1::bytea", 'a\0b')
+assert(pgsql.deserialize(z:serialize()):getvalue(1, 1) == z:getvalue(1, 1))
+
+print('serialize ok')
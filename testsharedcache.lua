@@ -0,0 +1,158 @@
+-- Test the shared result cache
+
+local pgsql = require 'pgsql'
+
+local contended = [[select $1::integer as n,
+    repeat($2, $1::integer * 10) as pad]]
+
+-- A child process of the contention test below
+local function child(path, seed)
+	local conn = pgsql.connectdb('')
+	local c = assert(pgsql.sharedCache(path))
+	local bad = 0
+	math.randomseed(seed)
+	for i = 1, 500 do
+		local n = math.random(1, 40)
+		local res = c:exec(conn, contended, n, 'x' .. n .. ',')
+		if res == nil or res[1].n ~= tostring(n) or
+		    res[1].pad ~= string.rep('x' .. n .. ',', n * 10) then
+			bad = bad + 1
+		end
+	end
+	local st = c:stats()
+	print(string.format('done %d %d %d', bad, st.hits, st.stores))
+end
+
+if arg and arg[1] == 'child' then
+	child(arg[2], tonumber(arg[3]))
+	return
+end
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local path = os.tmpname()
+os.remove(path)
+
+-- Two mappings of the same file, as two processes would have
+local a = pgsql.sharedCache(path, { size = 4 * 1024 * 1024,
+    slot = 65536 })
+local b = pgsql.sharedCache(path)
+local st = b:stats()
+assert(st.slots == 63 and st.slotSize == 65536 and st.used == 0)
+
+local sql = [[select $1::integer as n, null::text as nothing,
+    'x' || $1 as s, now() as t]]
+local res = a:exec(conn, sql, 1)
+assert(res:ntuples() == 1 and res[1].n == '1')
+assert(a:stats().stores == 1 and a:stats().misses == 1)
+
+local hit = b:exec(conn, sql, 1)
+assert(b:stats().hits == 1 and b:stats().misses == 0)
+assert(hit:nfields() == 4 and hit:fname(3) == 's')
+assert(hit:ftype(1) == res:ftype(1) and hit:ftype(4) == res:ftype(4))
+assert(hit[1].s == 'x1' and hit[1].t == res[1].t)
+assert(hit:getisnull(1, 2) and not hit:getisnull(1, 1))
+assert(b:stats().used == 1)
+
+-- Other parameters, other entries
+assert(b:exec(conn, sql, 2)[1].n == '2')
+assert(b:stats().misses == 1)
+
+-- Empty results and results larger than a slot
+assert(a:exec(conn, 'select 1 where false'):ntuples() == 0)
+assert(b:exec(conn, 'select 1 where false'):ntuples() == 0)
+a:exec(conn, 'select generate_series(1, 20000)')
+local stores = a:stats().stores
+assert(a:exec(conn, 'select generate_series(1, 20000)'):ntuples() == 20000)
+assert(a:stats().stores == stores)
+
+-- Errors are passed through and not stored
+assert(a:exec(conn, 'select * from luapgsql_nonexistent'):status()
+    == pgsql.PGRES_FATAL_ERROR)
+
+a:clear()
+assert(b:stats().used == 0)
+b:exec(conn, sql, 1)
+assert(b:stats().misses == 2)
+
+-- Wide results
+local cols = {}
+for n = 1, 1500 do
+	cols[n] = string.format("'v%d' as c%d", n, n)
+end
+local wide = 'select ' .. table.concat(cols, ', ')
+res = a:exec(conn, wide)
+assert(res:nfields() == 1500)
+hit = b:exec(conn, wide)
+assert(b:stats().hits == 2)
+assert(hit:nfields() == 1500 and hit:fname(1500) == 'c1500')
+assert(hit[1].c1 == 'v1' and hit[1].c1500 == 'v1500')
+
+-- Locks held by other processes, written into the file directly
+local function lockall(c, time)
+	local f = assert(io.open(path, 'r+b'))
+	local st = c:stats()
+	for n = 0, st.slots - 1 do
+		f:seek('set', 64 + n * st.slotSize + 16)
+		f:write(string.pack('=I8', 1 << 32 | time & 0xffffffff))
+	end
+	f:close()
+end
+
+-- A fresh lock keeps writers out
+lockall(a, os.time() * 1000 + 500)
+stores = a:stats().stores
+a:exec(conn, 'select 42')
+assert(a:stats().stores == stores)
+
+-- A stale one is taken over
+lockall(a, os.time() * 1000 - 10000)
+a:exec(conn, 'select 42')
+assert(a:stats().stores == stores + 1)
+assert(b:exec(conn, 'select 42')[1][1] == '42')
+assert(b:stats().hits == 3)
+
+a:close()
+assert(not pcall(a.exec, a, conn, sql, 1))
+b:close()
+os.remove(path)
+
+-- Several processes reading and writing the same few slots
+local lua = arg and arg[-1]
+if lua then
+	local c = pgsql.sharedCache(path, { size = 64 + 16 * 4096,
+	    slot = 4096, ttl = 20 })
+	local cmd = {}
+	for n = 1, 4 do
+		cmd[n] = string.format('%s %s child %s %d > %s.%d 2>&1 &',
+		    lua, arg[0], path, n, path, n)
+	end
+	assert(os.execute(table.concat(cmd, ' ') .. ' wait'))
+	local hits, stored = 0, 0
+	for n = 1, 4 do
+		local f = assert(io.open(path .. '.' .. n))
+		local out = f:read('a')
+		f:close()
+		os.remove(path .. '.' .. n)
+		local bad, h, s = out:match('done (%d+) (%d+) (%d+)')
+		assert(bad == '0', out)
+		hits = hits + tonumber(h)
+		stored = stored + tonumber(s)
+	end
+	assert(hits > 0 and stored > 0)
+	c:close()
+	os.remove(path)
+else
+	print('no interpreter to run child processes, skipping')
+end
+
+-- Other files are not touched
+local f = io.open(path, 'w')
+f:write(string.rep('x', 8192))
+f:close()
+local c, err = pgsql.sharedCache(path)
+assert(c == nil and err:find('not a shared cache file'))
+os.remove(path)
+
+print('shared cache ok')
@@ -0,0 +1,78 @@
+-- Test query phase spans
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local batches, spans = 0, {}
+
+local function collect(b)
+	batches = batches + 1
+	for i = 1, b.n do
+		spans[#spans + 1] = {
+			name = b.name[i],
+			start = b.start[i],
+			encoded = b.encoded[i],
+			sent = b.sent[i],
+			first = b.first[i],
+			done = b.done[i],
+			decode = b.decode[i],
+			rows = b.rows[i],
+			failed = b.failed[i]
+		}
+	end
+	-- Queries run by the callback are not recorded
+	conn:exec('select 1')
+end
+
+pgsql.setSpans(collect, 3)
+
+local res = conn:exec('select generate_series(1, 1000)')
+res:copy()
+conn:execParams('select $1::integer + 1', 41)
+assert(batches == 0)
+conn:exec('select * from nonexistent')
+assert(batches == 0)
+assert(conn:prepare('stmt', 'select $1::text'):status()
+    == pgsql.PGRES_COMMAND_OK)
+assert(batches == 0)
+conn:execPrepared('stmt', 'x')
+assert(batches == 1 and #spans == 3)
+
+local stmt = conn:statement('select $1::integer')
+stmt:exec(5)
+pgsql.flushSpans()
+assert(batches == 2 and #spans == 5)
+
+local now = os.time() * 1000000
+for _, s in ipairs(spans) do
+	assert(s.start <= s.encoded and s.encoded <= s.sent)
+	assert(s.sent <= s.first and s.first <= s.done)
+	assert(math.abs(s.start - now) < 60000000)
+end
+
+assert(spans[1].name == 'select generate_series(1, 1000)')
+assert(spans[1].rows == 1000 and spans[1].decode > 0)
+assert(spans[2].rows == 1 and spans[2].decode == 0)
+assert(spans[3].failed and not spans[2].failed)
+assert(spans[4].name == 'stmt' and spans[4].rows == 1)
+assert(spans[5].rows == 1)
+
+-- Parameters that fail to encode leave no span behind
+assert(not pcall(conn.execParams, conn, 'select $1', {}))
+assert(not pcall(conn.execPrepared, conn, 'stmt', function () end))
+assert(not pcall(stmt.exec, stmt, {}))
+assert(not pcall(stmt.exec, stmt, 1, 2))
+pgsql.flushSpans()
+assert(batches == 2 and #spans == 5)
+
+-- Disabling delivers what is left
+conn:exec('select 2')
+pgsql.setSpans(nil)
+assert(batches == 3 and #spans == 6)
+conn:exec('select 3')
+pgsql.flushSpans()
+assert(#spans == 6)
+
+print('spans ok')
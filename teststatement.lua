@@ -0,0 +1,75 @@
+-- Test statement handles
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+conn:exec([[
+create temporary table luapgsql_test (
+	id integer primary key,
+	small smallint,
+	amount numeric(10, 2),
+	name text,
+	created timestamptz default now()
+)]])
+
+local ins = conn:statement([[
+insert into luapgsql_test (id, small, amount, name) values ($1, $2, $3, $4)
+]])
+assert(ins:name():find('^luapgsql_stmt_'))
+assert(ins:nparams() == 4 and ins:nfields() == 0)
+
+for n = 1, 10 do
+	local res = ins:exec(n, n * 2, n / 4, 'row ' .. n)
+	assert(res:status() == pgsql.PGRES_COMMAND_OK, res:errorMessage())
+	assert(res:cmdTuples() == '1')
+end
+assert(ins:exec(11, nil, nil, nil):status() == pgsql.PGRES_COMMAND_OK)
+
+local sel = conn:statement([[
+select id, small, amount, name, created from luapgsql_test where id > $1
+    order by id
+]])
+assert(sel:nparams() == 1 and sel:nfields() == 5)
+assert(sel:name() ~= ins:name())
+
+-- Rows are decoded according to the column types
+local rows = assert(sel:rows(7))
+assert(#rows == 4)
+for n = 1, 3 do
+	local row = rows[n]
+	assert(row.id == n + 7 and math.type(row.id) == 'integer')
+	assert(row.small == 2 * (n + 7) and math.type(row.small) == 'integer')
+	assert(row.amount == (n + 7) / 4 and math.type(row.amount) == 'float')
+	assert(row.name == 'row ' .. n + 7)
+	assert(type(row.created) == 'string')
+end
+assert(rows[4].id == 11 and rows[4].small == nil and rows[4].name == nil)
+assert(#sel:rows(11) == 0)
+
+-- Text results of the same statement
+local res = sel:exec(9)
+assert(res:status() == pgsql.PGRES_TUPLES_OK and res:ntuples() == 2)
+assert(res:getvalue(1, 1) == '10' and res:getvalue(1, 3) == '2.50')
+
+-- The number of parameters is checked before anything is sent
+local ok, err = pcall(ins.exec, ins, 1)
+assert(not ok and err:find('statement expects 4 parameters, got 1'))
+ok, err = pcall(sel.rows, sel)
+assert(not ok and err:find('statement expects 1 parameters, got 0'))
+ok, err = pcall(sel.exec, sel, 1, 2)
+assert(not ok and err:find('statement expects 1 parameters, got 2'))
+
+-- Server errors are returned as results
+res = ins:exec(1, 1, 1, 'duplicate')
+assert(res:status() == pgsql.PGRES_FATAL_ERROR)
+assert(res:errorField(pgsql.PG_DIAG_SQLSTATE) == '23505')
+assert(conn:exec('select count(*) from luapgsql_test'):getvalue(1, 1) == '11')
+
+-- Closed statements are gone on the server
+assert(ins:close() == true and sel:close() == true)
+assert(ins:exec(12, 1, 1, 'closed'):status() == pgsql.PGRES_FATAL_ERROR)
+
+conn:finish()
+print('statement ok')
@@ -0,0 +1,65 @@
+-- Test the client-side query timeout
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+assert(conn:queryTimeout() == 0)
+conn:setQueryTimeout(200)
+assert(conn:queryTimeout() == 200)
+assert(not pcall(conn.setQueryTimeout, conn, -1))
+
+-- Queries finishing in time are not affected
+assert(conn:exec('select 1'):getvalue(1, 1) == '1')
+assert(conn:execParams('select $1::integer', 2):getvalue(1, 1) == '2')
+
+-- Slow queries are cancelled and the connection remains usable
+local start = os.time()
+local res, err, closed = conn:exec('select pg_sleep(5)')
+assert(res == nil and err == 'timeout' and closed == nil)
+assert(conn:exec('select 1'):getvalue(1, 1) == '1')
+
+res, err = conn:execParams('select pg_sleep($1)', 5)
+assert(res == nil and err == 'timeout')
+assert(conn:prepare('slow', 'select pg_sleep($1)'):status()
+    == pgsql.PGRES_COMMAND_OK)
+res, err = conn:execPrepared('slow', 5.0)
+assert(res == nil and err == 'timeout')
+
+local stmt = conn:statement('select pg_sleep($1::float8)')
+res, err = stmt:exec(5)
+assert(res == nil and err == 'timeout')
+assert(stmt:exec(0):status() == pgsql.PGRES_TUPLES_OK)
+assert(os.time() - start < 4)
+
+-- A server that does not react to the cancel request, simulated by
+-- stopping the backend, costs the connection instead of blocking
+local pid = conn:backendPID()
+if os.execute('kill -STOP ' .. pid .. ' 2>/dev/null') then
+	start = os.time()
+	res, err, closed = conn:exec('select 1')
+	os.execute('kill -CONT ' .. pid)
+	assert(res == nil and err == 'timeout' and closed == 'closed')
+	assert(os.time() - start < 4)
+	assert(conn:status() == pgsql.CONNECTION_BAD)
+
+	-- Queries that can't be sent fail with the connection's message
+	res, err = conn:exec('select 1')
+	assert(res == nil and err == conn:errorMessage() and #err > 0)
+	res, err = stmt:exec(0)
+	assert(res == nil and err == conn:errorMessage() and #err > 0)
+
+	conn:reset()
+	assert(conn:status() == pgsql.CONNECTION_OK)
+	assert(conn:exec('select 1'):getvalue(1, 1) == '1')
+else
+	print('backend not stoppable, skipping the close test')
+end
+
+-- Disabled again
+conn:setQueryTimeout(0)
+assert(conn:queryTimeout() == 0)
+assert(conn:exec('select pg_sleep(0.3)'):status() == pgsql.PGRES_TUPLES_OK)
+
+print('timeout ok')
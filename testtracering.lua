@@ -0,0 +1,47 @@
+-- Test the in-memory protocol trace
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local entries, total = conn:traceSnapshot()
+assert(#entries == 0 and total == 0)
+
+conn:traceRing(16)
+conn:exec('select 1')
+entries, total = conn:traceSnapshot()
+assert(total == 5 and #entries == 5)
+
+local names = {}
+for n, e in ipairs(entries) do
+	names[n] = e.dir .. ' ' .. e.type .. ' ' .. e.name
+end
+assert(table.concat(names, ', ') == 'F Q Query, B T RowDescription, '
+    .. 'B D DataRow, B C CommandComplete, B Z ReadyForQuery')
+
+assert(entries[1].length == 13)
+for n = 2, #entries do
+	assert(entries[n].time >= entries[n - 1].time)
+end
+
+-- The ring keeps the last entries
+conn:exec('select generate_series(1, 100)')
+entries, total = conn:traceSnapshot()
+assert(total == 109 and #entries == 16)
+assert(entries[16].name == 'ReadyForQuery')
+assert(#conn:traceSnapshot(3) == 3)
+
+-- Long lines are handled
+conn:exec(string.format("select '%s'", string.rep('x', 100000)))
+entries = conn:traceSnapshot(2)
+assert(entries[1].name == 'CommandComplete')
+
+conn:untrace()
+conn:exec('select 1')
+assert(#conn:traceSnapshot() == 0)
+
+conn:traceRing()
+conn:finish()
+collectgarbage()
+print 'ok'
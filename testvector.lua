@@ -0,0 +1,50 @@
+-- Test typed column vectors
+
+local pgsql = require 'pgsql'
+
+local conn = pgsql.connectdb('')
+assert(conn:status() == pgsql.CONNECTION_OK)
+
+local sql = [[select g::int4 as i, g / 4.0 as n, g::float8 * 2 as f,
+    g % 2 = 0 as b, case when g % 3 = 0 then null else g end as z
+    from generate_series(1, 10) g]]
+
+local stmt = conn:statement(sql)
+local binary = stmt:execBinary()
+assert(binary:fformat(1) == 1 and binary:fformat(2) == 1)
+
+for _, res in ipairs({ conn:exec(sql), conn:execParams(sql), binary }) do
+	local i = res:vector(1)
+	assert(#i == 10 and i:type() == 'integer' and i:nulls() == 0)
+	assert(i[1] == 1 and i[10] == 10 and i[0] == nil and i[11] == nil)
+	assert(i:sum() == 55 and i:min() == 1 and i:max() == 10)
+	assert(i:mean() == 5.5)
+
+	local n = res:vector(2)
+	assert(n:type() == 'number' and n[2] == 0.5 and n:sum() == 13.75)
+
+	local f = res:vector(3)
+	assert(f:max() == 20.0 and f:min() == 2.0)
+
+	local b = res:vector(4)
+	assert(b:type() == 'boolean' and b[1] == false and b[2] == true)
+	assert(b:sum() == 5 and b:max() == true and b:mean() == 0.5)
+
+	local z = res:vector(5)
+	assert(z:nulls() == 3 and z[3] == nil and z[4] == 4)
+	assert(z:sum() == 37 and z:mean() == 37 / 7)
+
+	local values, valid = z:pointer()
+	assert(type(values) == 'userdata' and type(valid) == 'userdata')
+end
+
+-- Empty vectors
+local empty = conn:statement('select 1::int8 where false'):execBinary()
+local e = empty:vector(1)
+assert(#e == 0 and e:sum() == 0 and e:mean() == nil and e:min() == nil)
+
+-- Only boolean and numeric columns can be decoded to vectors
+assert(not pcall(function () conn:exec('select \'a\'::text'):vector(1) end))
+
+conn:finish()
+print('ok')